@@ -1,45 +1,153 @@
-Module['file'] = Module['file'] || function file(initialCapacity = 256) {
+Module['file'] = Module['file'] || function file(chunkSize = 1024 * 1024) {
+  // output kept in fixed-size chunks, so growing never copies what was written,
+  // and out-of-order writes (the 'mdat' size) land in the chunk they address
+  const chunks = [];
   let cursor = 0;
   let usedBytes = 0;
-  let contents = new Uint8Array(initialCapacity);
   return {
-    'contents': function () {
-      return contents.slice(0, usedBytes);
+    'contents': contents,
+    'chunks': used,
+    'blob': function (type = 'video/mp4') {
+      return new Blob(used(), { 'type': type });
     },
+    'close': contents,
     'seek': function (offset) {
       // offset in bytes
       cursor = offset;
     },
-    'write': function (data) {
+    'write': function (data, offset = cursor) {
       const size = data.byteLength;
-      expand(cursor + size);
-      contents.set(data, cursor);
-      cursor += size;
+      cursor = offset;
+      for (let pos = 0; pos < size; ) {
+        const index = Math.floor(cursor / chunkSize);
+        const start = cursor - index * chunkSize;
+        const n = Math.min(size - pos, chunkSize - start);
+        while (chunks.length <= index) chunks.push(new Uint8Array(chunkSize));
+        chunks[index].set(data.subarray(pos, pos + n), start);
+        pos += n;
+        cursor += n;
+      }
       usedBytes = Math.max(usedBytes, cursor);
       return size;
     },
   };
 
-  function expand (newCapacity) {
-    var prevCapacity = contents.length;
-    if (prevCapacity >= newCapacity) return; // No need to expand, the storage was already large enough.
-    // Don't expand strictly to the given requested limit if it's only a very small increase, but instead geometrically grow capacity.
-    // For small filesizes (<1MB), perform size*2 geometric increase, but for large sizes, do a much more conservative size*1.125 increase to
-    // avoid overshooting the allocation cap by a very large margin.
-    var CAPACITY_DOUBLING_MAX = 1024 * 1024;
-    newCapacity = Math.max(
-      newCapacity,
-      (prevCapacity *
-        (prevCapacity < CAPACITY_DOUBLING_MAX ? 2.0 : 1.125)) >>>
-        0
-    );
-    if (prevCapacity != 0) newCapacity = Math.max(newCapacity, 256); // At minimum allocate 256b for each file when expanding.
-    const oldContents = contents;
-    contents = new Uint8Array(newCapacity); // Allocate new storage.
-    if (usedBytes > 0) contents.set(oldContents.subarray(0, usedBytes), 0);
+  // the whole file: joined once, unless it fits in a single chunk
+  function contents () {
+    const views = used();
+    if (views.length === 1) return views[0];
+    const out = new Uint8Array(usedBytes);
+    views.forEach((view, i) => out.set(view, i * chunkSize));
+    return out;
+  }
+
+  // views of the written bytes of each chunk
+  function used () {
+    const count = Math.ceil(usedBytes / chunkSize);
+    return chunks.slice(0, count).map((chunk, i) => chunk.subarray(0, Math.min(chunkSize, usedBytes - i * chunkSize)));
   }
 }
 
+// Output sinks for Module.create({ sink }): { write(data, offset), ready(), close(), seekable }.
+// data is a view into the heap, only valid during the call; ready() returns a
+// promise while the sink wants the encoder to wait; close() result is returned by end().
+// Sinks with seekable = false need { sequential } or { fragmentation } output.
+Module['sink'] = function sink (target, settings = {}) {
+  if (target == null) return Module['file']();
+  if (target === 'blob') return Module['blobSink'](settings['type']);
+  if (typeof target === 'number') return Module['fileDescriptorSink'](target);
+  if (typeof target['getWriter'] === 'function') return Module['streamSink'](target, settings);
+  if (typeof target['on'] === 'function' && typeof target['write'] === 'function') return Module['writableSink'](target);
+  if (typeof target['write'] === 'function') return target;
+  throw new Error('Unknown sink');
+};
+
+// Node.js file descriptor: positional writes, so non-sequential output can be patched
+Module['fileDescriptorSink'] = function fileDescriptorSink (fd) {
+  const fs = require('fs');
+  return {
+    'write': function (data, offset) {
+      let done = 0;
+      while (done < data.byteLength) {
+        done += fs.writeSync(fd, data, done, data.byteLength - done, offset + done);
+      }
+    },
+    'close': function () {
+      return fd;
+    },
+  };
+};
+
+// Node.js Writable: sequential only, waits for 'drain' when write() returns false
+Module['writableSink'] = function writableSink (writable) {
+  let position = 0;
+  let drain = null;
+  let error = null;
+  writable.on('error', err => { error = err; });
+  return {
+    'seekable': false,
+    'write': function (data, offset) {
+      if (error) throw error;
+      if (offset !== position) throw new Error('Writable sink can not seek, use { sequential: true } or { fragmentation: true }');
+      position += data.byteLength;
+      if (!writable.write(Buffer.from(data)) && !drain) {
+        drain = new Promise(resolve => writable.once('drain', resolve)).then(() => { drain = null; });
+      }
+    },
+    'ready': function () {
+      return drain;
+    },
+    'close': function () {
+      return new Promise((resolve, reject) => {
+        if (error) return reject(error);
+        writable.once('error', reject);
+        writable.end(resolve);
+      });
+    },
+  };
+};
+
+// WHATWG WritableStream; { seekable: true } for streams accepting
+// { type: 'write', position, data } chunks, e.g. FileSystemWritableFileStream
+Module['streamSink'] = function streamSink (stream, settings = {}) {
+  const writer = stream.getWriter();
+  const seekable = Boolean(settings['seekable']);
+  let position = 0;
+  let error = null;
+  return {
+    'seekable': seekable,
+    'write': function (data, offset) {
+      if (error) throw error;
+      let chunk = data.slice();
+      if (offset !== position) {
+        if (!seekable) throw new Error('Stream sink can not seek, use { sequential: true } or { fragmentation: true }');
+        chunk = { 'type': 'write', 'position': offset, 'data': chunk };
+      }
+      position = offset + data.byteLength;
+      writer.write(chunk).catch(err => { error = err; });
+    },
+    'ready': function () {
+      return writer.desiredSize > 0 ? null : writer.ready;
+    },
+    'close': function () {
+      return writer.close();
+    },
+  };
+};
+
+// Blob from the chunks of the in-memory file, without joining them into one buffer
+Module['blobSink'] = function blobSink (type = 'video/mp4') {
+  const file = Module['file']();
+  return {
+    'write': function (data, offset) {
+      file['write'](data, offset);
+    },
+    'close': function () {
+      return file['blob'](type);
+    },
+  };
+};
+
 Module['create_buffer'] = function create_buffer (size) {
   return Module['_malloc'](size);
 };
@@ -55,16 +163,29 @@ Module['create'] = function createEncoder(settings = {}) {
   const stride = settings['stride'] || 4;
   if (!width || !height) throw new Error("width and height must be > 0");
 
-  const file = Module['file']();
+  const sink = Module['sink'](settings['sink'], settings);
+  let sinkError = null;
+  if (sink['seekable'] === false && !settings['sequential'] && !settings['fragmentation']) {
+    throw new Error('Output sink can not seek, use { sequential: true } or { fragmentation: true }');
+  }
 
   let _yuv_pointer = null;
   let _rgb_pointer = null;
+  let _audio_pointer = null;
+  let _audio_capacity = 0;
 
   let ended = false;
+  // stats and trace taken when ended, including writing the index
+  let _stats = null;
+  let _trace = null;
 
   const cfg = Object.assign({}, settings);
   delete cfg['stride'];
-  const encoder_pointer = Module['create_encoder'](cfg, write);
+  delete cfg['sink'];
+  // Muxer output is collected in a native ring and drained once per encode call
+  if (cfg['ringSize'] == null && cfg['bufferSize'] == null) cfg['ringSize'] = 1024 * 1024;
+  const encoder_pointer = Module['create_encoder'](cfg, cfg['ringSize'] > 0 ? drain : write);
+  if (!encoder_pointer) throw new Error('Could not create encoder');
 
   function getYUV () {
     if (_yuv_pointer == null && !ended) {
@@ -73,6 +194,15 @@ Module['create'] = function createEncoder(settings = {}) {
     return _yuv_pointer;
   }
 
+  function getAudio (size) {
+    if (_audio_capacity < size && !ended) {
+      if (_audio_pointer != null) Module['free_buffer'](_audio_pointer);
+      _audio_capacity = Math.max(size, 4096);
+      _audio_pointer = Module['create_buffer'](_audio_capacity);
+    }
+    return _audio_pointer;
+  }
+
   function getRGB () {
     if (_rgb_pointer == null && !ended) {
       _rgb_pointer = Module['create_buffer'](width * height * stride);
@@ -91,19 +221,33 @@ Module['create'] = function createEncoder(settings = {}) {
         throw new Error('Attempting to end() an encoder that is already finished');
       }
       ended = true;
+      if (settings['stats'] || settings['trace']) {
+        const muxer = Module['get_muxer'](encoder_pointer);
+        Module['close_muxer'](muxer);
+        _stats = Module['get_stats'](muxer);
+        _trace = Module['get_trace'](muxer);
+      }
       Module['finalize_encoder'](encoder_pointer);
       if (_yuv_pointer != null) Module['free_buffer'](_yuv_pointer);
       if (_rgb_pointer != null) Module['free_buffer'](_rgb_pointer);
-      return file['contents']();
+      if (_audio_pointer != null) Module['free_buffer'](_audio_pointer);
+      check();
+      return sink['close'] && sink['close']();
+    },
+    'ready': function () {
+      // resolves when the sink can take more output
+      return Promise.resolve(sink['ready'] && sink['ready']()).then(check);
     },
     'encodeRGBPointer': function () {
       const rgb = getRGB();
       const yuv = getYUV();
       Module['encode_rgb'](encoder_pointer, rgb, stride, yuv);
+      check();
     },
     'encodeYUVPointer': function () {
       const yuv = getYUV();
       Module['encode_yuv'](encoder_pointer, yuv);
+      check();
     },
     'encodeRGB': function (buffer) {
       if (buffer.length !== (width * height * stride)) {
@@ -113,6 +257,29 @@ Module['create'] = function createEncoder(settings = {}) {
       const yuv = getYUV();
       Module['HEAPU8'].set(buffer, rgb);
       Module['encode_rgb'](encoder_pointer, rgb, stride, yuv);
+      check();
+    },
+    'writeAudio': function (buffer) {
+      if (!settings['audio']) {
+        throw new Error('Expected encoder to be created with { audio } settings');
+      }
+      const ptr = getAudio(buffer.byteLength);
+      Module['HEAPU8'].set(buffer, ptr);
+      const err = Module['mux_aac'](Module['get_muxer'](encoder_pointer), ptr, buffer.byteLength);
+      check();
+      if (err) throw new Error('Could not mux AAC audio (error ' + err + ')');
+    },
+    'stats': function () {
+      return ended ? _stats : Module['get_stats'](Module['get_muxer'](encoder_pointer));
+    },
+    'trace': function () {
+      return ended ? _trace : Module['get_trace'](Module['get_muxer'](encoder_pointer));
+    },
+    'setFrameInfo': function (info) {
+      if (!settings['frameInfo']) {
+        throw new Error('Expected encoder to be created with { frameInfo: true } settings');
+      }
+      Module['set_frame_info'](encoder_pointer, info);
     },
     'encodeYUV': function (buffer) {
       if (buffer.length !== (width * height * 3) / 2) {
@@ -121,18 +288,240 @@ Module['create'] = function createEncoder(settings = {}) {
       const yuv = getYUV();
       Module['HEAPU8'].set(buffer, yuv);
       Module['encode_yuv'](encoder_pointer, yuv);
+      check();
     },
   };
 
   function write(pointer, size, offset) {
-    file['seek'](offset);
-    const data = Module['HEAPU8'].subarray(pointer, pointer + size);
-    return file['write'](data) !== data.byteLength;
+    if (sinkError) return 1;
+    try {
+      sink['write'](Module['HEAPU8'].subarray(pointer, pointer + size), offset);
+      return 0;
+    } catch (err) {
+      // thrown from the encoder call, rather than through WASM
+      sinkError = err;
+      return 1;
+    }
+  }
+
+  // extents: { u64 offset, u32 pointer, u32 size } records, written in order
+  function drain(extents, count) {
+    if (sinkError) return 1;
+    const heap = Module['HEAPU8'];
+    const view = new DataView(heap.buffer, extents, count * 16);
+    try {
+      for (let i = 0; i < count; i++) {
+        const offset = view.getUint32(i * 16, true) + view.getUint32(i * 16 + 4, true) * 0x100000000;
+        const pointer = view.getUint32(i * 16 + 8, true);
+        const size = view.getUint32(i * 16 + 12, true);
+        sink['write'](heap.subarray(pointer, pointer + size), offset);
+      }
+      return 0;
+    } catch (err) {
+      sinkError = err;
+      return 1;
+    }
+  }
+
+  function check () {
+    if (sinkError) throw sinkError;
+  }
+}
+
+// Expose simpler end-user API for demuxing
+Module['createDemuxer'] = function createDemuxer(data, settings = {}) {
+  const bytes = data instanceof Uint8Array ? data : new Uint8Array(data);
+  const options = {
+    'size': bytes.byteLength,
+    'lazyIndex': Boolean(settings['lazyIndex'])
+  };
+  const index = settings['index'];
+  if (index) {
+    options['indexPointer'] = Module['create_buffer'](index.byteLength);
+    options['indexSize'] = index.byteLength;
+    Module['HEAPU8'].set(index, options['indexPointer']);
+  }
+  const demuxer_pointer = Module['create_demuxer'](options, read);
+  if (index) Module['free_buffer'](options['indexPointer']);
+  if (!demuxer_pointer) throw new Error('Could not open MP4 file');
+
+  let _sample_pointer = null;
+  let _sample_capacity = 0;
+  let ended = false;
+
+  const tracks = [];
+  const trackCount = Module['get_track_count'](demuxer_pointer);
+  for (let i = 0; i < trackCount; i++) tracks.push(trackInfo(i));
+
+  function trackInfo (track) {
+    const info = Module['get_track_info'](demuxer_pointer, track);
+    const sps = [];
+    const pps = [];
+    let p;
+    // views point into the heap, so copy them out
+    for (let k = 0; (p = Module['get_sps'](demuxer_pointer, track, k)); k++) sps.push(p.slice());
+    for (let k = 0; (p = Module['get_pps'](demuxer_pointer, track, k)); k++) pps.push(p.slice());
+    info['sps'] = sps;
+    info['pps'] = pps;
+    if (info['objectType'] === 0x21 && sps.length && pps.length) {
+      // WebCodecs VideoDecoderConfig, { codec, description }
+      info['codec'] = 'avc1.' + Array.from(sps[0].subarray(1, 4), hex).join('');
+      info['description'] = avcC(sps, pps);
+    } else {
+      const dsi = Module['get_dsi'](demuxer_pointer, track);
+      if (dsi) info['description'] = dsi.slice();
+      if (info['objectType'] === 0x40) {
+        info['codec'] = 'mp4a.40.' + (dsi && dsi.length ? dsi[0] >> 3 : 2);
+      }
+    }
+    return info;
+  }
+
+  function getSample (size) {
+    if (_sample_capacity < size && !ended) {
+      if (_sample_pointer != null) Module['free_buffer'](_sample_pointer);
+      _sample_capacity = Math.max(size, 64 * 1024);
+      _sample_pointer = Module['create_buffer'](_sample_capacity);
+    }
+    return _sample_pointer;
+  }
+
+  function readSample (track, index, pointer, capacity) {
+    const info = Module['get_sample_info'](demuxer_pointer, track, index);
+    if (!info) throw new Error('No sample ' + index + ' in track ' + track);
+    if (pointer == null) {
+      pointer = getSample(info['size']);
+      capacity = _sample_capacity;
+    }
+    const size = Module['read_sample'](demuxer_pointer, track, index, pointer, capacity);
+    if (size < 0) throw new Error('Could not read sample ' + index + ' of track ' + track);
+    const timescale = tracks[track]['timescale'] || 1;
+    return {
+      'pointer': pointer,
+      'size': size,
+      // microseconds, as used by WebCodecs; timestamp is the presentation time
+      'timestamp': Math.round(((info['timestamp'] + info['compositionOffset']) * 1e6) / timescale),
+      'decodeTimestamp': Math.round((info['timestamp'] * 1e6) / timescale),
+      'duration': Math.round((info['duration'] * 1e6) / timescale),
+      'keyframe': tracks[track]['syncTable'] ? info['keyframe'] : isKeyframe(track, pointer, size),
+    };
+  }
+
+  function isKeyframe (track, pointer, size) {
+    // without sync sample table, all samples are key frames except H264 non-IDR
+    if (tracks[track]['objectType'] !== 0x21) return true;
+    // AVC sample: NAL units with 4 byte big-endian size prefix, IDR is type 5
+    const heap = Module['HEAPU8'];
+    for (let pos = pointer, end = pointer + size; pos + 4 < end; ) {
+      const nal_size = ((heap[pos] << 24) | (heap[pos + 1] << 16) | (heap[pos + 2] << 8) | heap[pos + 3]) >>> 0;
+      if ((heap[pos + 4] & 31) === 5) return true;
+      pos += 4 + nal_size;
+    }
+    return false;
+  }
+
+  return {
+    'tracks': tracks,
+    'memory': function () {
+      return Module['HEAPU8'];
+    },
+    'sampleInfo': function (track, index) {
+      return Module['get_sample_info'](demuxer_pointer, track, index);
+    },
+    'readSample': readSample,
+    'seek': function (track, timestamp, mode = 'previous') {
+      // timestamp in microseconds, returns sample index or -1
+      const time = (timestamp * (tracks[track]['timescale'] || 1)) / 1e6;
+      const modes = { 'previous': 0, 'next': 1, 'exact': 2 };
+      if (!(mode in modes)) throw new Error('Unknown seek mode ' + mode);
+      return Module['seek'](demuxer_pointer, track, Math.floor(time), modes[mode]);
+    },
+    'sample': function (track, index) {
+      const sample = readSample(track, index);
+      // a view into the heap, valid until the next read
+      sample['data'] = Module['HEAPU8'].subarray(sample['pointer'], sample['pointer'] + sample['size']);
+      return sample;
+    },
+    'saveIndex': function () {
+      const size = Module['save_index'](demuxer_pointer, 0, 0);
+      if (!size) throw new Error('Could not save the index');
+      const pointer = Module['create_buffer'](size);
+      Module['save_index'](demuxer_pointer, pointer, size);
+      const blob = Module['HEAPU8'].slice(pointer, pointer + size);
+      Module['free_buffer'](pointer);
+      return blob;
+    },
+    'end': function () {
+      if (ended) {
+        throw new Error('Attempting to end() a demuxer that is already finished');
+      }
+      ended = true;
+      Module['finalize_demuxer'](demuxer_pointer);
+      if (_sample_pointer != null) Module['free_buffer'](_sample_pointer);
+    },
+  };
+
+  function read (pointer, size, offset) {
+    if (offset + size > bytes.byteLength) return 1;
+    Module['HEAPU8'].set(bytes.subarray(offset, offset + size), pointer);
+    return 0;
+  }
+
+  function hex (x) {
+    return (x < 16 ? '0' : '') + x.toString(16);
+  }
+
+  // AVCDecoderConfigurationRecord from SPS and PPS
+  function avcC (sps, pps) {
+    let size = 7;
+    sps.forEach(x => { size += 2 + x.length; });
+    pps.forEach(x => { size += 2 + x.length; });
+    const out = new Uint8Array(size);
+    let pos = 0;
+    out[pos++] = 1;
+    out[pos++] = sps[0][1];
+    out[pos++] = sps[0][2];
+    out[pos++] = sps[0][3];
+    out[pos++] = 0xff; // 4 byte NAL unit size
+    out[pos++] = 0xe0 | sps.length;
+    sps.forEach(put);
+    out[pos++] = pps.length;
+    pps.forEach(put);
+    return out;
+
+    function put (x) {
+      out[pos++] = x.length >> 8;
+      out[pos++] = x.length & 0xff;
+      out.set(x, pos);
+      pos += x.length;
+    }
+  }
+}
+
+// Workers started by threaded builds (PTHREAD_POOL_SIZE), one per core unless
+// Module['threads'] is given; encoders use these and the calling thread at most
+var MP4_THREAD_POOL_SIZE = Module['threads'] ||
+  (typeof navigator !== 'undefined' && navigator['hardwareConcurrency']) ||
+  (typeof process === 'object' && typeof require === 'function' && require('os').cpus().length) ||
+  4;
+
+// WASM SIMD support, from validating a module using an i8x16 instruction
+function simdSupported () {
+  try {
+    return WebAssembly.validate(new Uint8Array([
+      0, 97, 115, 109, 1, 0, 0, 0, 1, 5, 1, 96, 0, 1, 123, 3, 2, 1, 0,
+      10, 10, 1, 8, 0, 65, 0, 253, 15, 253, 98, 11
+    ]));
+  } catch (err) {
+    return false;
   }
 }
 
+// Picks the .simd.wasm build unless Module['simd'] is false, or the runtime
+// has no SIMD; threaded builds always use SIMD and have a single .wasm
 Module['locateFile'] = function locateFileDefault (path, dir) {
-  if (Module['simd']) {
+  if (Module['simd'] == null) Module['simd'] = simdSupported();
+  if (Module['simd'] && !/\.(simd|threads)\.wasm$/i.test(path)) {
     path = path.replace(/\.wasm$/i, '.simd.wasm');
   }
   if (Module['getWasmPath']) {
@@ -140,4 +529,4 @@ Module['locateFile'] = function locateFileDefault (path, dir) {
   } else {
     return dir + path;
   }
-};
\ No newline at end of file
+};
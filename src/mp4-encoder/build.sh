@@ -25,9 +25,26 @@ cp mp4-encoder.js ../../../build/mp4-encoder.js
 cp mp4-encoder.wasm ../../../build/mp4-encoder.wasm
 cp mp4-encoder.simd.wasm ../../../build/mp4-encoder.simd.wasm
 
+cmake -DUSE_THREADS=ON -DWEB=ON -DCMAKE_TOOLCHAIN_FILE=$EMSCRIPTEN/cmake/Modules/Platform/Emscripten.cmake ..
+cmake --build .
+
+cp mp4-encoder.threads.js ../../../build/mp4-encoder.threads.js
+cp mp4-encoder.threads.wasm ../../../build/mp4-encoder.threads.wasm
+cp mp4-encoder.threads.worker.js ../../../build/mp4-encoder.threads.worker.js
+
+cmake -DUSE_SIMD=ON -DWEB=OFF -DCMAKE_TOOLCHAIN_FILE=$EMSCRIPTEN/cmake/Modules/Platform/Emscripten.cmake ..
+cmake --build .
+
 cmake -DUSE_SIMD=OFF -DWEB=OFF -DCMAKE_TOOLCHAIN_FILE=$EMSCRIPTEN/cmake/Modules/Platform/Emscripten.cmake ..
 cmake --build .
 cp mp4-encoder.node.js ../../../build/mp4-encoder.node.js
 cp mp4-encoder.node.wasm ../../../build/mp4-encoder.node.wasm
+cp mp4-encoder.node.simd.wasm ../../../build/mp4-encoder.node.simd.wasm
+
+cmake -DUSE_THREADS=ON -DWEB=OFF -DCMAKE_TOOLCHAIN_FILE=$EMSCRIPTEN/cmake/Modules/Platform/Emscripten.cmake ..
+cmake --build .
+cp mp4-encoder.node.threads.js ../../../build/mp4-encoder.node.threads.js
+cp mp4-encoder.node.threads.wasm ../../../build/mp4-encoder.node.threads.wasm
+cp mp4-encoder.node.threads.worker.js ../../../build/mp4-encoder.node.threads.worker.js
 
 
@@ -40,6 +40,18 @@ extern "C" {
 // This switch affect return type of MP4D_frame_offset() function
 #define MINIMP4_ALLOW_64BIT       1
 
+// Size of the output window, used to stream 'moov' box to the write callback
+#define MP4E_INDEX_WINDOW_BYTES   (32*1024)
+
+// Size of the read-ahead buffer, used by MP4D_open() to read boxes and
+// index tables in large blocks instead of byte by byte. 0 to disable
+#define MP4D_READ_BUFFER_BYTES    (64*1024)
+
+// Lazy index mode (MP4D_OPEN_LAZY_INDEX): number of table entries in a page,
+// and number of pages in the cache
+#define MP4D_LAZY_PAGE_ENTRIES    1024
+#define MP4D_LAZY_CACHE_PAGES     16
+
 #define MP4D_TRACE_SUPPORTED      0 // Debug trace
 #define MP4D_TRACE_TIMESTAMPS     1
 // Support parsing of supplementary information, not necessary for decoding:
@@ -166,6 +178,49 @@ typedef struct
 
 typedef struct MP4D_sample_to_chunk_t_tag MP4D_sample_to_chunk_t;
 
+/**
+*   Last sample found by MP4D_frame_offset(): makes sequential access O(1)
+*/
+typedef struct
+{
+    unsigned chunk;
+    unsigned chunk_first;       // first sample of the chunk
+    unsigned chunk_end;         // first sample of the next chunk, 0 if cache is empty
+    unsigned sample;            // sample within the chunk...
+    MP4D_file_offset_t offset;  // ...and it's offset
+} MP4D_sample_cache_t;
+
+/**
+*   Index table, which is not loaded in memory (MP4D_OPEN_LAZY_INDEX mode)
+*/
+typedef struct
+{
+    int64_t offset;         // file position of the 1st entry
+    unsigned count;         // number of entries
+    unsigned entry_bytes;   // 4 or 8; 0 if all entries are equal to 'value'
+    unsigned value;
+
+    // run-length tables ('stts', 'ctts'): 1st sample and time of each page, found so far
+    struct MP4D_lazy_checkpoint_tag
+    {
+        unsigned sample;
+        uint64_t timestamp;
+    } *checkpoint;
+    unsigned checkpoint_count;
+    unsigned checkpoint_capacity;
+} MP4D_lazy_table_t;
+
+/**
+*   Run of the time-to-sample ('stts') table: samples, starting from the given
+*   one up to the next run, have the same duration
+*/
+typedef struct
+{
+    unsigned sample;        // 1st sample of the run
+    unsigned delta;         // duration of each sample
+    uint64_t timestamp;     // decoding time of the 1st sample
+} MP4D_time_run_t;
+
 typedef struct
 {
     /************************************************************************/
@@ -181,6 +236,9 @@ typedef struct
     // DSI data size
     unsigned dsi_bytes;
 
+    // size of the NAL unit length prefixes in AVC samples, from 'avcC'
+    unsigned nal_length_bytes;
+
     // MP4 object type code
     // case 0x00: return "Forbidden";
     // case 0x01: return "Systems ISO/IEC 14496-1";
@@ -213,9 +271,8 @@ typedef struct
     // 'hint' Hint track
     unsigned handler_type;
 
-    // Track duration: 64-bit value split into 2 variables
-    unsigned duration_hi;
-    unsigned duration_lo;
+    // Track duration
+    uint64_t duration;
 
     // duration scale: duration = timescale*seconds
     unsigned timescale;
@@ -269,10 +326,45 @@ typedef struct
     MP4D_file_offset_t *chunk_offset;
 
 #if MP4D_TIMESTAMPS_SUPPORTED
-    unsigned *timestamp;
-    unsigned *duration;
+    // decoding times: 'stts' runs, extended with fragments
+    MP4D_time_run_t *time_run;
+    unsigned time_run_count;
+    unsigned time_run_capacity;
+
+    // composition time offset of each sample, NULL if there is no 'ctts' box;
+    // samples past composition_count have none
+    int *composition_offset;
+    unsigned composition_count;
 #endif
 
+    // sync samples in increasing order, counted from 0;
+    // if there is no 'stss' box, all samples are sync samples
+    int has_sync_table;
+    unsigned sync_count;
+    unsigned *sync_sample;
+    unsigned sync_capacity;
+
+    // lazy index: tables not loaded by MP4D_open()
+    MP4D_lazy_table_t lazy_stsz;
+    MP4D_lazy_table_t lazy_stco;
+    MP4D_lazy_table_t lazy_stts;
+    MP4D_lazy_table_t lazy_stss;
+    MP4D_lazy_table_t lazy_ctts;
+
+    // movie fragments: track_ID and defaults from 'trex' box
+    unsigned track_id;
+    unsigned default_sample_duration;
+    unsigned default_sample_size;
+    unsigned default_sample_flags;
+
+    // allocated entries of index arrays, extended with fragments
+    unsigned sample_capacity;
+    unsigned chunk_capacity;
+    unsigned sample_to_chunk_capacity;
+
+    // last sample found by MP4D_frame_offset()
+    MP4D_sample_cache_t cache;
+
 } MP4D_track_t;
 
 typedef struct MP4D_demux_tag
@@ -292,9 +384,8 @@ typedef struct MP4D_demux_tag
     /************************************************************************/
     /*                 informational public data                            */
     /************************************************************************/
-    // Movie duration: 64-bit value split into 2 variables
-    unsigned duration_hi;
-    unsigned duration_lo;
+    // Movie duration
+    uint64_t duration;
 
     // duration scale: duration = timescale*seconds
     unsigned timescale;
@@ -312,12 +403,55 @@ typedef struct MP4D_demux_tag
     } tag;
 #endif
 
+    /************************************************************************/
+    /*                 private data: read-ahead buffer of MP4D_open()       */
+    /************************************************************************/
+    unsigned char *read_buf;
+    int64_t read_buf_pos;   // file position of read_buf[0]
+    int read_buf_bytes;
+    int read_buf_failed;    // block read failed: byte reads until the next skip
+
+    /************************************************************************/
+    /*                 private data: lazy index page cache                  */
+    /************************************************************************/
+    int lazy_index;         // MP4D_OPEN_LAZY_INDEX flag
+    struct MP4D_lazy_page_tag *lazy_cache;
+    struct MP4D_lazy_page_tag *lazy_last;   // last used page
+    unsigned lazy_clock;
+
+    // position of the 'moov' box: key of the saved index
+    int64_t moov_pos;
+    int64_t moov_bytes;
+
 } MP4D_demux_t;
 
+/**
+*   Index shared by several readers (MP4D_index_create()). It is not changed
+*   after creation, and released when the last reference is released.
+*/
+typedef struct MP4D_index_tag
+{
+    MP4D_demux_t demux;     // read_callback is not used
+    volatile int refcount;
+} MP4D_index_t;
+
+/**
+*   Reader of the shared index, with it's own read callback and sample cache.
+*   Each thread uses it's own cursor.
+*/
+typedef struct
+{
+    MP4D_index_t *index;
+    int (*read_callback)(int64_t offset, void *buffer, size_t size, void *token);
+    void *token;
+    MP4D_sample_cache_t *cache;     // for each track
+} MP4D_cursor_t;
+
 struct MP4D_sample_to_chunk_t_tag
 {
     unsigned first_chunk;
     unsigned samples_per_chunk;
+    unsigned first_sample;  // calculated by MP4D_open(): first sample of the first_chunk
 };
 
 typedef struct
@@ -345,6 +479,50 @@ int mp4_h26x_write_init(mp4_h26x_writer_t *h, MP4E_mux_t *mux, int width, int he
 void mp4_h26x_write_close(mp4_h26x_writer_t *h);
 int mp4_h26x_write_nal(mp4_h26x_writer_t *h, const unsigned char *nal, int length, unsigned timeStamp90kHz_next);
 
+typedef struct mp4_aac_writer_tag
+{
+    MP4E_mux_t *mux;
+    int mux_track_id, need_dsi;
+    int adts_frequency_index;   // ADTS sampling_frequency_index of the track; -1 if DSI is given
+    unsigned samples_per_frame;
+} mp4_aac_writer_t;
+
+/**
+*   Add AAC audio track to the multiplexer.
+*   Track time scale is equal to the sample rate.
+*   dsi is AudioSpecificConfig; it may be NULL if frames are passed with ADTS
+*   headers, then it is taken from the 1st ADTS header, and sampling frequency
+*   of ADTS frames must be equal to the sample rate. Note that in
+*   'fragmentation' mode file headers are written before the 1st sample of any
+*   track, so DSI must be known by then.
+*/
+int mp4_aac_write_init(mp4_aac_writer_t *h, MP4E_mux_t *mux, int sample_rate, int channels, const void *dsi, int dsi_bytes);
+
+/**
+*   Write AAC frame: either one raw access unit, or one or more ADTS frames
+*   (detected by the sync word), each with a single raw data block.
+*/
+int mp4_aac_write_frame(mp4_aac_writer_t *h, const unsigned char *data, int length);
+
+// Output formats of mp4_transmux()
+#define MP4_TRANSMUX_FMP4       0   // fragmented MP4, all AVC, audio and private tracks
+#define MP4_TRANSMUX_ANNEXB     1   // H.264 elementary stream of the 1st AVC track
+
+/**
+*   Remux MP4 file without decoding. The input index is read on demand
+*   (MP4D_OPEN_LAZY_INDEX) and samples are copied one at a time in file order,
+*   so memory use does not depend on the file length. The output is written
+*   sequentially through write_callback.
+*   In fragmented output, samples keep their composition time offsets, but
+*   edit lists are not copied (e.g. one hiding the B-frame reordering delay),
+*   and tracks with zero time scale are skipped.
+*   In Annex B output, NAL size prefixes are replaced with start codes, and
+*   SPS/PPS are repeated before each IDR sample.
+*   return error code MP4E_STATUS_*
+*/
+int mp4_transmux(int (*read_callback)(int64_t offset, void *buffer, size_t size, void *token), void *read_token, int64_t file_size,
+    int (*write_callback)(int64_t offset, const void *buffer, size_t size, void *token), void *write_token, int mode);
+
 /************************************************************************/
 /*          API                                                         */
 /************************************************************************/
@@ -359,6 +537,22 @@ int mp4_h26x_write_nal(mp4_h26x_writer_t *h, const unsigned char *nal, int lengt
 */
 int MP4D_open(MP4D_demux_t *mp4, int (*read_callback)(int64_t offset, void *buffer, size_t size, void *token), void *token, int64_t file_size);
 
+// Flags for MP4D_open_ex()
+#define MP4D_OPEN_LAZY_INDEX 1
+
+/**
+*   Same as MP4D_open(), with MP4D_OPEN_... flags.
+*
+*   MP4D_OPEN_LAZY_INDEX: sample size, chunk offset, time-to-sample and sync
+*   sample tables are not loaded, only their position is recorded. Pages of
+*   MP4D_LAZY_PAGE_ENTRIES entries are read on demand through LRU cache of
+*   MP4D_LAZY_CACHE_PAGES pages, so open time and memory do not depend on
+*   the file length. read_callback is called after MP4D_open_ex() return, the
+*   token must remain valid until MP4D_close().
+*   Movie fragments are always loaded.
+*/
+int MP4D_open_ex(MP4D_demux_t *mp4, int (*read_callback)(int64_t offset, void *buffer, size_t size, void *token), void *token, int64_t file_size, int flags);
+
 /**
 *   Return position and size for given sample from given track. The 'sample' is a
 *   MP4 term for 'frame'
@@ -367,9 +561,55 @@ int MP4D_open(MP4D_demux_t *mp4, int (*read_callback)(int64_t offset, void *buff
 *   timestamp [OUT]     - return frame timestamp (in mp4->timescale units)
 *   duration [OUT]      - return frame duration (in mp4->timescale units)
 *
-*   function return offset for the frame
+*   function return offset for the frame. The demuxer is updated: the last found
+*   sample is cached in the track, which makes sequential access O(1)
+*/
+MP4D_file_offset_t MP4D_frame_offset(MP4D_demux_t *mp4, unsigned int ntrack, unsigned int nsample, unsigned int *frame_bytes, uint64_t *timestamp, unsigned *duration);
+
+/**
+*   Return 1 if given sample is a sync sample (key frame), 0 if not
+*/
+int MP4D_is_sync_sample(MP4D_demux_t *mp4, unsigned int ntrack, unsigned int nsample);
+
+#if MP4D_TIMESTAMPS_SUPPORTED
+/**
+*   Return composition time offset of given sample (presentation time minus
+*   decoding time), in track timescale units; 0 if there is no 'ctts' box
+*/
+int MP4D_composition_offset(MP4D_demux_t *mp4, unsigned int ntrack, unsigned int nsample);
+
+// Modes of MP4D_seek()
+#define MP4D_SEEK_PREVIOUS_SYNC 0   // sync sample at or before given time
+#define MP4D_SEEK_NEXT_SYNC     1   // sync sample at or after given time
+#define MP4D_SEEK_EXACT         2   // sample, which decoding time span contains given time
+
+/**
+*   Find sample for given decoding time, in track timescale units.
+*   MP4D_SEEK_PREVIOUS_SYNC returns the 1st sync sample if there is none
+*   before given time.
+*   return sample number, or -1 if there is no such sample
+*/
+int MP4D_seek(MP4D_demux_t *mp4, unsigned int ntrack, uint64_t time, int mode);
+#endif
+
+/**
+*   Save index of the opened file to a versioned binary blob, keyed by the file
+*   size and checksum of the 'moov' box. Tables, which are not loaded
+*   (MP4D_OPEN_LAZY_INDEX), are saved as their file positions.
+*   The 'moov' box is read again through read_callback to compute checksum.
+*   If blob is NULL or blob_bytes is too small, nothing is written.
+*   return size of the blob in bytes; 0 on failure
+*/
+size_t MP4D_save_index(const MP4D_demux_t *mp4, void *blob, size_t blob_bytes);
+
+/**
+*   Same as MP4D_open_ex(), but the index is restored from the blob, saved by
+*   MP4D_save_index(), instead of parsing the file. Only the 'moov' box is read
+*   to check that the file is not changed.
+*   return 1 on success; 0 if the blob does not match the file, MP4D_open()
+*   has to be used then
 */
-MP4D_file_offset_t MP4D_frame_offset(const MP4D_demux_t *mp4, unsigned int ntrack, unsigned int nsample, unsigned int *frame_bytes, unsigned *timestamp, unsigned *duration);
+int MP4D_open_index(MP4D_demux_t *mp4, int (*read_callback)(int64_t offset, void *buffer, size_t size, void *token), void *token, int64_t file_size, const void *blob, size_t blob_bytes);
 
 /**
 *   De-allocated memory
@@ -390,6 +630,49 @@ void MP4D_close(MP4D_demux_t *mp4);
 const void *MP4D_read_sps(const MP4D_demux_t *mp4, unsigned int ntrack, int nsps, int *sps_bytes);
 const void *MP4D_read_pps(const MP4D_demux_t *mp4, unsigned int ntrack, int npps, int *pps_bytes);
 
+/**
+*   Move index of the opened demuxer to a shared, reference-counted index.
+*   mp4 is cleared, and must not be closed. Lazy index (MP4D_OPEN_LAZY_INDEX)
+*   can't be shared: it is changed as the tables are read.
+*   Shared index is never lazy, so MP4D_is_sync_sample(), MP4D_composition_offset(),
+*   MP4D_seek(), MP4D_read_sps(), MP4D_read_pps() and MP4D_printf_info() only read
+*   it, and may be called for index->demux from any thread. MP4D_frame_offset()
+*   changes the sample cache of the track: use MP4D_cursor_frame_offset() instead.
+*   MP4D_save_index() can't be used, as index->demux has no read callback.
+*   return index with 1 reference; NULL on failure
+*/
+MP4D_index_t *MP4D_index_create(MP4D_demux_t *mp4);
+
+/**
+*   Add or release reference to the index. The index is de-allocated when the
+*   last reference is released. Thread-safe.
+*/
+void MP4D_index_retain(MP4D_index_t *index);
+void MP4D_index_release(MP4D_index_t *index);
+
+/**
+*   Create reader of the shared index, with given read callback, and add
+*   reference to the index.
+*   return 1 on success, 0 on failure
+*/
+int MP4D_cursor_open(MP4D_cursor_t *cursor, MP4D_index_t *index, int (*read_callback)(int64_t offset, void *buffer, size_t size, void *token), void *token);
+
+/**
+*   Same as MP4D_frame_offset(), for the cursor
+*/
+MP4D_file_offset_t MP4D_cursor_frame_offset(MP4D_cursor_t *cursor, unsigned int ntrack, unsigned int nsample, unsigned int *frame_bytes, uint64_t *timestamp, unsigned *duration);
+
+/**
+*   Read sample data through the cursor's read callback.
+*   return sample size; -1 if sample does not exist, does not fit in the buffer or can't be read
+*/
+int MP4D_cursor_read_sample(MP4D_cursor_t *cursor, unsigned int ntrack, unsigned int nsample, void *buffer, unsigned buffer_bytes);
+
+/**
+*   Release the cursor and it's reference to the index
+*/
+void MP4D_cursor_close(MP4D_cursor_t *cursor);
+
 #if MP4D_PRINT_INFO_SUPPORTED
 /**
 *   Print MP4 information to stdout.
@@ -411,6 +694,60 @@ void MP4D_printf_info(const MP4D_demux_t *mp4);
 MP4E_mux_t *MP4E_open(int sequential_mode_flag, int enable_fragmentation, void *token,
     int (*write_callback)(int64_t offset, const void *buffer, size_t size, void *token));
 
+/**
+*   Enable output buffer of given size (e.g. 256 KB .. 4 MB): sequential writes
+*   are coalesced and passed to the write callback in large blocks.
+*   Buffer is flushed when full, on out of order write, at the end of each
+*   fragment in 'fragmentation' mode, on MP4E_flush() call and on MP4E_close().
+*   Set bytes to 0 to disable buffering (default).
+*
+*   return error code MP4E_STATUS_*
+*/
+int MP4E_set_output_buffer(MP4E_mux_t *mux, int bytes);
+
+/**
+*   Pass all buffered output to the write callback
+*
+*   return error code MP4E_STATUS_*
+*/
+int MP4E_flush(MP4E_mux_t *mux);
+
+/**
+*   Enable time-based interleaving of tracks. Samples are queued per track and
+*   written in time order, in chunks of 'window_ms' milliseconds (e.g. 500):
+*   a chunk is written once every track fed so far have samples beyond its end.
+*   If more than 'max_bytes' of sample data is queued (e.g. track stopped
+*   receiving samples), the oldest chunk is written regardless (0 = no limit).
+*   Remaining samples are written on MP4E_close().
+*   Set window_ms to 0 to write queued samples and disable interleaving (default).
+*
+*   return error code MP4E_STATUS_*
+*/
+int MP4E_set_interleave(MP4E_mux_t *mux, int window_ms, int max_bytes);
+
+/**
+*   Preallocate memory of a track for the given number of samples, and for
+*   'buffer_bytes' of sample data held at once (the pending sample in
+*   sequential mode, or the interleaving queue), so that muxing within these
+*   limits does not reallocate. Optional, call after MP4E_add_track().
+*
+*   return error code MP4E_STATUS_*
+*/
+int MP4E_reserve(MP4E_mux_t *mux, int track_num, int samples, int buffer_bytes);
+
+// MP4E_set_hook() events
+#define MP4E_HOOK_PUT_SAMPLE    0   // MP4E_put_sample() call
+#define MP4E_HOOK_FLUSH_INDEX   1   // writing file headers and index ('moov' box)
+
+/**
+*   Set optional callback, called before (end = 0) and after (end = 1) each
+*   MP4E_HOOK_* event, e.g. to time it. 'token' is the one passed to
+*   MP4E_open(). Set NULL to remove.
+*
+*   return error code MP4E_STATUS_*
+*/
+int MP4E_set_hook(MP4E_mux_t *mux, void (*hook)(void *token, int event, int end));
+
 /**
 *   Add new track
 *   The track_data parameter does not referred by the multiplexer after function
@@ -433,6 +770,15 @@ int MP4E_add_track(MP4E_mux_t *mux, const MP4E_track_t *track_data);
 */
 int MP4E_put_sample(MP4E_mux_t *mux, int track_num, const void *data, int data_bytes, int duration, int kind);
 
+/**
+*   Same as MP4E_put_sample(), with the composition time offset of the sample
+*   (presentation minus decoding time, in track timescale units), written to
+*   the 'trun' box of its fragment, or to the 'ctts' box of the track
+*
+*   return error code MP4E_STATUS_*
+*/
+int MP4E_put_sample_ex(MP4E_mux_t *mux, int track_num, const void *data, int data_bytes, int duration, int kind, int composition_offset);
+
 /**
 *   Finalize MP4 file, de-allocated memory, and closes MP4 multiplexer.
 *   The close operation takes a time and disk space, since it writes MP4 file
@@ -664,6 +1010,7 @@ typedef struct
     boxsize_t offset;
     unsigned duration;
     unsigned flag_random_access;
+    int composition_offset;
 } sample_t;
 
 typedef struct {
@@ -682,6 +1029,11 @@ typedef struct
     minimp4_vector_t vpps;  // not used for audio
     minimp4_vector_t vvps;  // used for HEVC
 
+    // interleaving queue: last queued sample is open for continuations
+    minimp4_vector_t queue;         // queued sample descriptors
+    minimp4_vector_t queue_data;    // queued sample data
+    int64_t queue_time;             // time of 1st queued sample, in track time_scale units
+
 } track_t;
 
 typedef struct MP4E_mux_tag
@@ -697,6 +1049,20 @@ typedef struct MP4E_mux_tag
     int enable_fragmentation; // flag, indicating streaming-friendly 'fragmentation' mode
     int fragments_count;      // # of fragments in 'fragmentation' mode
 
+    // optional output buffer, coalescing sequential writes
+    unsigned char *out_buf;
+    int out_bytes;
+    int out_capacity;
+    int64_t out_pos;          // file position of the buffered data
+
+    // optional time-based interleaving of tracks
+    int interleave_ms;
+    int interleave_max_bytes;
+    int queued_bytes;         // sample data queued in all tracks
+
+    // optional callback around MP4E_HOOK_* events
+    void (*hook)(void *token, int event, int end);
+
 } MP4E_mux_t;
 
 static const unsigned char box_ftyp[] = {
@@ -791,6 +1157,22 @@ static unsigned char *minimp4_vector_alloc_tail(minimp4_vector_t *h, int bytes)
     return p;
 }
 
+/**
+    Reallocate vector memory to hold at least given number of bytes, return 1 on success, 0 on fail
+*/
+static int minimp4_vector_reserve(minimp4_vector_t *h, int capacity)
+{
+    void *p;
+    if (h->capacity >= capacity)
+        return 1;
+    p = realloc(h->data, capacity);
+    if (!p)
+        return 0;
+    h->data = (unsigned char*)p;
+    h->capacity = capacity;
+    return 1;
+}
+
 /**
     Append data to the end of the vector (accumulate ot enqueue)
 */
@@ -821,6 +1203,14 @@ MP4E_mux_t *MP4E_open(int sequential_mode_flag, int enable_fragmentation, void *
     mux->token = token;
     mux->text_comment = NULL;
     mux->write_pos = sizeof(box_ftyp);
+    mux->out_buf = NULL;
+    mux->out_bytes = 0;
+    mux->out_capacity = 0;
+    mux->out_pos = 0;
+    mux->interleave_ms = 0;
+    mux->interleave_max_bytes = 0;
+    mux->queued_bytes = 0;
+    mux->hook = NULL;
 
     if (!mux->sequential_mode_flag)
     {   // Write filler, which would be updated later
@@ -835,6 +1225,67 @@ MP4E_mux_t *MP4E_open(int sequential_mode_flag, int enable_fragmentation, void *
     return mux;
 }
 
+/**
+*   Pass buffered output to the write callback
+*/
+static int mp4e_flush_output(MP4E_mux_t *mux)
+{
+    int err = MP4E_STATUS_OK;
+    if (mux->out_bytes)
+        err = mux->write_callback(mux->out_pos, mux->out_buf, mux->out_bytes, mux->token);
+    mux->out_bytes = 0;
+    return err;
+}
+
+/**
+*   Write data at given file position. If output buffer is enabled, sequential
+*   writes are accumulated in the buffer; out of order write flushes the buffer
+*   first, so the write callback always see writes in the original order.
+*/
+static int mp4e_write(MP4E_mux_t *mux, int64_t offset, const void *buffer, size_t size)
+{
+    if (!mux->out_capacity)
+        return mux->write_callback(offset, buffer, size, mux->token);
+
+    if (mux->out_bytes && (offset != mux->out_pos + mux->out_bytes || mux->out_bytes + size > (size_t)mux->out_capacity))
+        ERR(mp4e_flush_output(mux));
+
+    if (size >= (size_t)mux->out_capacity)
+        return mux->write_callback(offset, buffer, size, mux->token);
+
+    if (!mux->out_bytes)
+        mux->out_pos = offset;
+    memcpy(mux->out_buf + mux->out_bytes, buffer, size);
+    mux->out_bytes += (int)size;
+    return MP4E_STATUS_OK;
+}
+
+int MP4E_set_output_buffer(MP4E_mux_t *mux, int bytes)
+{
+    if (!mux || bytes < 0)
+        return MP4E_STATUS_BAD_ARGUMENTS;
+    ERR(mp4e_flush_output(mux));
+    if (mux->out_buf)
+        free(mux->out_buf);
+    mux->out_buf = NULL;
+    mux->out_capacity = 0;
+    if (bytes)
+    {
+        mux->out_buf = (unsigned char*)malloc(bytes);
+        if (!mux->out_buf)
+            return MP4E_STATUS_NO_MEMORY;
+        mux->out_capacity = bytes;
+    }
+    return MP4E_STATUS_OK;
+}
+
+int MP4E_flush(MP4E_mux_t *mux)
+{
+    if (!mux)
+        return MP4E_STATUS_BAD_ARGUMENTS;
+    return mp4e_flush_output(mux);
+}
+
 /**
 *   Add new track
 */
@@ -856,6 +1307,8 @@ int MP4E_add_track(MP4E_mux_t *mux, const MP4E_track_t *track_data)
     minimp4_vector_init(&tr->vsps, 0);
     minimp4_vector_init(&tr->vpps, 0);
     minimp4_vector_init(&tr->pending_sample, 0);
+    minimp4_vector_init(&tr->queue, 0);
+    minimp4_vector_init(&tr->queue_data, 0);
     return ntr;
 }
 
@@ -956,7 +1409,7 @@ static int write_pending_data(MP4E_mux_t *mux, track_t *tr)
         assert(mux->sequential_mode_flag);      // Separate atom needed for sequential_mode only
         WRITE_4(tr->pending_sample.bytes + 8);
         WRITE_4(BOX_mdat);
-        ERR(mux->write_callback(mux->write_pos, base, p - base, mux->token));
+        ERR(mp4e_write(mux, mux->write_pos, base, p - base));
         mux->write_pos += p - base;
 
         // Update sample descriptor with size and offset
@@ -965,7 +1418,7 @@ static int write_pending_data(MP4E_mux_t *mux, track_t *tr)
         smpl_desc->offset = (boxsize_t)mux->write_pos;
 
         // Write data
-        ERR(mux->write_callback(mux->write_pos, tr->pending_sample.data, tr->pending_sample.bytes, mux->token));
+        ERR(mp4e_write(mux, mux->write_pos, tr->pending_sample.data, tr->pending_sample.bytes));
         mux->write_pos += tr->pending_sample.bytes;
 
         // reset buffer
@@ -974,13 +1427,14 @@ static int write_pending_data(MP4E_mux_t *mux, track_t *tr)
     return MP4E_STATUS_OK;
 }
 
-static int add_sample_descriptor(MP4E_mux_t *mux, track_t *tr, int data_bytes, int duration, int kind)
+static int add_sample_descriptor(MP4E_mux_t *mux, track_t *tr, int data_bytes, int duration, int kind, int composition_offset)
 {
     sample_t smp;
     smp.size = data_bytes;
     smp.offset = (boxsize_t)mux->write_pos;
     smp.duration = (duration ? duration : tr->info.default_duration);
     smp.flag_random_access = (kind == MP4E_SAMPLE_RANDOM_ACCESS);
+    smp.composition_offset = composition_offset;
     return NULL != minimp4_vector_put(&tr->smpl, &smp, sizeof(sample_t));
 }
 
@@ -989,7 +1443,7 @@ static int mp4e_flush_index(MP4E_mux_t *mux);
 /**
 *   Write Movie Fragment: 'moof' box
 */
-static int mp4e_write_fragment_header(MP4E_mux_t *mux, int track_num, int data_bytes, int duration, int kind
+static int mp4e_write_fragment_header(MP4E_mux_t *mux, int track_num, int data_bytes, int duration, int kind, int composition_offset
 #if MP4D_TFDT_SUPPORT
 , uint64_t timestamp
 #endif
@@ -1000,6 +1454,8 @@ static int mp4e_write_fragment_header(MP4E_mux_t *mux, int track_num, int data_b
     unsigned char **stack = stack_base;
     unsigned char *pdata_offset;
     unsigned flags;
+    // sample-composition-time-offsets-present, signed in version 1
+    unsigned cts_flags = composition_offset ? (composition_offset < 0 ? 0x1000800 : 0x800) : 0;
     enum
     {
         default_sample_duration_present = 0x000008,
@@ -1041,10 +1497,14 @@ static int mp4e_write_fragment_header(MP4E_mux_t *mux, int track_num, int data_b
                 flags  = 0;
                 flags |= 0x001;         // data-offset-present
                 flags |= 0x200;         // sample-size-present
-                ATOM_FULL(BOX_trun, flags)
+                ATOM_FULL(BOX_trun, flags | cts_flags)
                     WRITE_4(1);         // sample_count
                     pdata_offset = p; p += 4;  // save ptr to data_offset
                     WRITE_4(data_bytes);// sample_size
+                    if (cts_flags)
+                    {
+                        WRITE_4(composition_offset);
+                    }
                 END_ATOM
             } else if (kind == MP4E_SAMPLE_RANDOM_ACCESS)
             {
@@ -1053,12 +1513,16 @@ static int mp4e_write_fragment_header(MP4E_mux_t *mux, int track_num, int data_b
                 flags |= 0x004;         // first-sample-flags-present
                 flags |= 0x100;         // sample-duration-present
                 flags |= 0x200;         // sample-size-present
-                ATOM_FULL(BOX_trun, flags)
+                ATOM_FULL(BOX_trun, flags | cts_flags)
                     WRITE_4(1);         // sample_count
                     pdata_offset = p; p += 4;   // save ptr to data_offset
                     WRITE_4(0x2000000); // first_sample_flags
                     WRITE_4(duration);  // sample_duration
                     WRITE_4(data_bytes);// sample_size
+                    if (cts_flags)
+                    {
+                        WRITE_4(composition_offset);
+                    }
                 END_ATOM
             } else
             {
@@ -1066,18 +1530,22 @@ static int mp4e_write_fragment_header(MP4E_mux_t *mux, int track_num, int data_b
                 flags |= 0x001;         // data-offset-present
                 flags |= 0x100;         // sample-duration-present
                 flags |= 0x200;         // sample-size-present
-                ATOM_FULL(BOX_trun, flags)
+                ATOM_FULL(BOX_trun, flags | cts_flags)
                     WRITE_4(1);         // sample_count
                     pdata_offset = p; p += 4;   // save ptr to data_offset
                     WRITE_4(duration);  // sample_duration
                     WRITE_4(data_bytes);// sample_size
+                    if (cts_flags)
+                    {
+                        WRITE_4(composition_offset);
+                    }
                 END_ATOM
             }
         END_ATOM
     END_ATOM
     WR4(pdata_offset, (p - base) + 8);
 
-    ERR(mux->write_callback(mux->write_pos, base, p - base, mux->token));
+    ERR(mp4e_write(mux, mux->write_pos, base, p - base));
     mux->write_pos += p - base;
     return MP4E_STATUS_OK;
 }
@@ -1087,15 +1555,15 @@ static int mp4e_write_mdat_box(MP4E_mux_t *mux, uint32_t size)
     unsigned char base[8], *p = base;
     WRITE_4(size);
     WRITE_4(BOX_mdat);
-    ERR(mux->write_callback(mux->write_pos, base, p - base, mux->token));
+    ERR(mp4e_write(mux, mux->write_pos, base, p - base));
     mux->write_pos += p - base;
     return MP4E_STATUS_OK;
 }
 
 /**
-*   Add new sample to specified track
+*   Write sample to specified track (bypassing interleaving queue)
 */
-int MP4E_put_sample(MP4E_mux_t *mux, int track_num, const void *data, int data_bytes, int duration, int kind)
+static int mp4e_put_sample(MP4E_mux_t *mux, int track_num, const void *data, int data_bytes, int duration, int kind, int composition_offset)
 {
     track_t *tr;
     if (!mux || !data)
@@ -1104,6 +1572,8 @@ int MP4E_put_sample(MP4E_mux_t *mux, int track_num, const void *data, int data_b
 
     if (mux->enable_fragmentation)
     {
+        if (!duration)
+            duration = tr->info.default_duration;
         #if MP4D_TFDT_SUPPORT
         // NOTE: assume a constant `duration` to calculate current timestamp
         uint64_t timestamp = (uint64_t)mux->fragments_count * duration;
@@ -1111,23 +1581,24 @@ int MP4E_put_sample(MP4E_mux_t *mux, int track_num, const void *data, int data_b
         if (!mux->fragments_count++)
             ERR(mp4e_flush_index(mux)); // write file headers before 1st sample
         // write MOOF + MDAT + sample data
-        ERR(mp4e_write_fragment_header(mux, track_num, data_bytes, duration, kind
+        ERR(mp4e_write_fragment_header(mux, track_num, data_bytes, duration, kind, composition_offset
         #if MP4D_TFDT_SUPPORT
         , timestamp
         #endif
         ));
         // write MDAT box for each sample
         ERR(mp4e_write_mdat_box(mux, data_bytes + 8));
-        ERR(mux->write_callback(mux->write_pos, data, data_bytes, mux->token));
+        ERR(mp4e_write(mux, mux->write_pos, data, data_bytes));
         mux->write_pos += data_bytes;
-        return MP4E_STATUS_OK;
+        // fragment is complete: pass it to the write callback
+        return mp4e_flush_output(mux);
     }
 
     if (kind != MP4E_SAMPLE_CONTINUATION)
     {
         if (mux->sequential_mode_flag)
             ERR(write_pending_data(mux, tr));
-        if (!add_sample_descriptor(mux, tr, data_bytes, duration, kind))
+        if (!add_sample_descriptor(mux, tr, data_bytes, duration, kind, composition_offset))
             return MP4E_STATUS_NO_MEMORY;
     } else
     {
@@ -1148,109 +1619,328 @@ int MP4E_put_sample(MP4E_mux_t *mux, int track_num, const void *data, int data_b
             return MP4E_STATUS_NO_MEMORY;
     } else
     {
-        ERR(mux->write_callback(mux->write_pos, data, data_bytes, mux->token));
+        ERR(mp4e_write(mux, mux->write_pos, data, data_bytes));
         mux->write_pos += data_bytes;
     }
     return MP4E_STATUS_OK;
 }
 
-/**
-*   calculate size of length field of OD box
-*/
-static int od_size_of_size(int size)
+typedef struct
 {
-    int i, size_of_size = 1;
-    for (i = size; i > 0x7F; i -= 0x7F)
-        size_of_size++;
-    return size_of_size;
+    int bytes;
+    int duration;
+    int kind;
+    int composition_offset;
+} queued_sample_t;
+
+enum
+{
+    INTERLEAVE_WAIT,            // write chunks covered by all tracks
+    INTERLEAVE_MEMORY,          // write oldest chunks until queue fits memory limit
+    INTERLEAVE_ALL              // write all queued samples, including open ones
+};
+
+static int64_t queued_time_us(track_t *tr, int64_t time)
+{
+    return tr->info.time_scale ? time*1000000/tr->info.time_scale : 0;
 }
 
-/**
-*   Add or remove MP4 file text comment according to Apple specs:
-*   https://developer.apple.com/library/mac/documentation/QuickTime/QTFF/Metadata/Metadata.html#//apple_ref/doc/uid/TP40000939-CH1-SW1
-*   http://atomicparsley.sourceforge.net/mpeg-4files.html
-*   note that ISO did not specify comment format.
-*/
-int MP4E_set_text_comment(MP4E_mux_t *mux, const char *comment)
+static int queued_duration(track_t *tr, const queued_sample_t *qs)
 {
-    if (!mux || !comment)
-        return MP4E_STATUS_BAD_ARGUMENTS;
-    if (mux->text_comment)
-        free(mux->text_comment);
-    mux->text_comment = strdup(comment);
-    if (!mux->text_comment)
-        return MP4E_STATUS_NO_MEMORY;
-    return MP4E_STATUS_OK;
+    return qs->duration ? qs->duration : (int)tr->info.default_duration;
 }
 
 /**
-*   Write file index 'moov' box with all its boxes and indexes
+*   Write queued samples in time order, one chunk of 'interleave_ms' at a time
 */
-static int mp4e_flush_index(MP4E_mux_t *mux)
+static int mp4e_interleave_drain(MP4E_mux_t *mux, int mode)
 {
-    unsigned char *stack_base[20]; // atoms nesting stack
-    unsigned char **stack = stack_base;
-    unsigned char *base, *p;
-    unsigned int ntr, index_bytes, ntracks = mux->tracks.bytes / sizeof(track_t);
-    int i, err;
-
-    // How much memory needed for indexes
-    // Experimental data:
-    // file with 1 track = 560 bytes
-    // file with 2 tracks = 972 bytes
-    // track size = 412 bytes;
-    // file header size = 148 bytes
-#define FILE_HEADER_BYTES 256
-#define TRACK_HEADER_BYTES 512
-    index_bytes = FILE_HEADER_BYTES;
-    if (mux->text_comment)
-        index_bytes += 128 + strlen(mux->text_comment);
-    for (ntr = 0; ntr < ntracks; ntr++)
+    unsigned ntr, ntracks = mux->tracks.bytes / sizeof(track_t);
+    for (;;)
     {
-        track_t *tr = ((track_t*)mux->tracks.data) + ntr;
-        index_bytes += TRACK_HEADER_BYTES;          // fixed amount (implementation-dependent)
-        // may need extra 4 bytes for duration field + 4 bytes for worst-case random access box
-        index_bytes += tr->smpl.bytes * (sizeof(sample_t) + 4 + 4) / sizeof(sample_t);
-        index_bytes += tr->vsps.bytes;
-        index_bytes += tr->vpps.bytes;
-
-        ERR(write_pending_data(mux, tr));
-    }
+        int64_t t0 = -1, chunk_end;
+        for (ntr = 0; ntr < ntracks; ntr++)
+        {
+            track_t *tr = ((track_t*)mux->tracks.data) + ntr;
+            int n = tr->queue.bytes / sizeof(queued_sample_t) - (mode != INTERLEAVE_ALL);
+            int64_t t = queued_time_us(tr, tr->queue_time);
+            if (n > 0 && (t0 < 0 || t < t0))
+                t0 = t;
+        }
+        if (t0 < 0)
+            return MP4E_STATUS_OK;  // no complete samples
+        chunk_end = t0 + (int64_t)mux->interleave_ms*1000;
 
-    base = (unsigned char*)malloc(index_bytes);
-    if (!base)
-        return MP4E_STATUS_NO_MEMORY;
-    p = base;
+        if (mode == INTERLEAVE_WAIT)
+        {   // wait, until each track, which have samples, have complete samples beyond the chunk
+            for (ntr = 0; ntr < ntracks; ntr++)
+            {
+                track_t *tr = ((track_t*)mux->tracks.data) + ntr;
+                const queued_sample_t *qs = (const queued_sample_t *)tr->queue.data;
+                int i, n = tr->queue.bytes / sizeof(queued_sample_t) - 1;
+                int64_t t = tr->queue_time;
+                if (n < 0)
+                    continue;   // track not started
+                for (i = 0; i < n; i++)
+                    t += queued_duration(tr, qs + i);
+                if (queued_time_us(tr, t) < chunk_end)
+                    return MP4E_STATUS_OK;
+            }
+        }
 
-    if (!mux->sequential_mode_flag)
-    {
-        // update size of mdat box.
-        // One of 2 points, which requires random file access.
-        // Second is optonal duration update at beginning of file in fragmenatation mode.
-        // This can be avoided using "till eof" size code, but in this case indexes must be
-        // written before the mdat....
-        int64_t size = mux->write_pos - sizeof(box_ftyp);
-        const int64_t size_limit = (int64_t)(uint64_t)0xfffffffe;
-        if (size > size_limit)
-        {
-            WRITE_4(1);
-            WRITE_4(BOX_mdat);
-            WRITE_4((size >> 32) & 0xffffffff);
-            WRITE_4(size & 0xffffffff);
-        } else
+        for (ntr = 0; ntr < ntracks; ntr++)
         {
-            WRITE_4(8);
-            WRITE_4(BOX_free);
-            WRITE_4(size - 8);
-            WRITE_4(BOX_mdat);
+            track_t *tr = ((track_t*)mux->tracks.data) + ntr;
+            const queued_sample_t *qs = (const queued_sample_t *)tr->queue.data;
+            int i, pos = 0, n = tr->queue.bytes / sizeof(queued_sample_t) - (mode != INTERLEAVE_ALL);
+            for (i = 0; i < n && queued_time_us(tr, tr->queue_time) < chunk_end; i++)
+            {
+                ERR(mp4e_put_sample(mux, ntr, tr->queue_data.data + pos, qs[i].bytes, qs[i].duration, qs[i].kind, qs[i].composition_offset));
+                pos += qs[i].bytes;
+                tr->queue_time += queued_duration(tr, qs + i);
+            }
+            if (!i)
+                continue;
+            // remove written samples from the queue
+            memmove(tr->queue.data, tr->queue.data + i*sizeof(queued_sample_t), tr->queue.bytes - i*sizeof(queued_sample_t));
+            tr->queue.bytes -= i*sizeof(queued_sample_t);
+            memmove(tr->queue_data.data, tr->queue_data.data + pos, tr->queue_data.bytes - pos);
+            tr->queue_data.bytes -= pos;
+            mux->queued_bytes -= pos;
         }
-        ERR(mux->write_callback(sizeof(box_ftyp), base, p - base, mux->token));
-        p = base;
+
+        if (mode == INTERLEAVE_MEMORY && mux->queued_bytes <= mux->interleave_max_bytes)
+            return MP4E_STATUS_OK;
     }
+}
 
-    // Write index atoms; order taken from Table 1 of [1]
-#define MOOV_TIMESCALE 1000
-    ATOM(BOX_moov);
+int MP4E_set_interleave(MP4E_mux_t *mux, int window_ms, int max_bytes)
+{
+    if (!mux || window_ms < 0 || max_bytes < 0)
+        return MP4E_STATUS_BAD_ARGUMENTS;
+    if (!window_ms)
+        ERR(mp4e_interleave_drain(mux, INTERLEAVE_ALL));
+    mux->interleave_ms = window_ms;
+    mux->interleave_max_bytes = max_bytes;
+    return MP4E_STATUS_OK;
+}
+
+int MP4E_reserve(MP4E_mux_t *mux, int track_num, int samples, int buffer_bytes)
+{
+    track_t *tr;
+    if (!mux || track_num < 0 || track_num >= mux->tracks.bytes / (int)sizeof(track_t) || samples < 0 || buffer_bytes < 0)
+        return MP4E_STATUS_BAD_ARGUMENTS;
+    tr = ((track_t*)mux->tracks.data) + track_num;
+    // in fragmentation mode the index holds only the current fragment
+    if (!mux->enable_fragmentation && !minimp4_vector_reserve(&tr->smpl, samples*(int)sizeof(sample_t)))
+        return MP4E_STATUS_NO_MEMORY;
+    if (mux->sequential_mode_flag && !minimp4_vector_reserve(&tr->pending_sample, buffer_bytes))
+        return MP4E_STATUS_NO_MEMORY;
+    if (mux->interleave_ms && !minimp4_vector_reserve(&tr->queue_data, buffer_bytes))
+        return MP4E_STATUS_NO_MEMORY;
+    return MP4E_STATUS_OK;
+}
+
+int MP4E_set_hook(MP4E_mux_t *mux, void (*hook)(void *token, int event, int end))
+{
+    if (!mux)
+        return MP4E_STATUS_BAD_ARGUMENTS;
+    mux->hook = hook;
+    return MP4E_STATUS_OK;
+}
+
+/**
+*   Add new sample to specified track, or queue it when interleaving
+*/
+static int mp4e_queue_sample(MP4E_mux_t *mux, int track_num, const void *data, int data_bytes, int duration, int kind, int composition_offset)
+{
+    track_t *tr;
+    if (!mux->interleave_ms)
+        return mp4e_put_sample(mux, track_num, data, data_bytes, duration, kind, composition_offset);
+    tr = ((track_t*)mux->tracks.data) + track_num;
+
+    if (kind != MP4E_SAMPLE_CONTINUATION)
+    {
+        queued_sample_t qs;
+        qs.bytes = 0;
+        qs.duration = duration;
+        qs.kind = kind;
+        qs.composition_offset = composition_offset;
+        if (!minimp4_vector_put(&tr->queue, &qs, sizeof(qs)))
+            return MP4E_STATUS_NO_MEMORY;
+    } else if (!tr->queue.bytes)
+    {   // continuation of already written sample
+        return mp4e_put_sample(mux, track_num, data, data_bytes, duration, kind, 0);
+    }
+
+    // accumulate data in the last (open) sample
+    if (!minimp4_vector_put(&tr->queue_data, data, data_bytes))
+        return MP4E_STATUS_NO_MEMORY;
+    ((queued_sample_t*)(tr->queue.data + tr->queue.bytes) - 1)->bytes += data_bytes;
+    mux->queued_bytes += data_bytes;
+
+    if (kind == MP4E_SAMPLE_CONTINUATION)
+        return MP4E_STATUS_OK;
+    if (mux->interleave_max_bytes && mux->queued_bytes > mux->interleave_max_bytes)
+        return mp4e_interleave_drain(mux, INTERLEAVE_MEMORY);
+    return mp4e_interleave_drain(mux, INTERLEAVE_WAIT);
+}
+
+/**
+*   Add new sample to specified track
+*/
+int MP4E_put_sample(MP4E_mux_t *mux, int track_num, const void *data, int data_bytes, int duration, int kind)
+{
+    return MP4E_put_sample_ex(mux, track_num, data, data_bytes, duration, kind, 0);
+}
+
+/**
+*   Add new sample with composition time offset to specified track
+*/
+int MP4E_put_sample_ex(MP4E_mux_t *mux, int track_num, const void *data, int data_bytes, int duration, int kind, int composition_offset)
+{
+    int err;
+    if (!mux || !data)
+        return MP4E_STATUS_BAD_ARGUMENTS;
+    if (!mux->hook)
+        return mp4e_queue_sample(mux, track_num, data, data_bytes, duration, kind, composition_offset);
+    mux->hook(mux->token, MP4E_HOOK_PUT_SAMPLE, 0);
+    err = mp4e_queue_sample(mux, track_num, data, data_bytes, duration, kind, composition_offset);
+    mux->hook(mux->token, MP4E_HOOK_PUT_SAMPLE, 1);
+    return err;
+}
+
+/**
+*   calculate size of length field of OD box
+*/
+static int od_size_of_size(int size)
+{
+    int i, size_of_size = 1;
+    for (i = size; i > 0x7F; i -= 0x7F)
+        size_of_size++;
+    return size_of_size;
+}
+
+/**
+*   Add or remove MP4 file text comment according to Apple specs:
+*   https://developer.apple.com/library/mac/documentation/QuickTime/QTFF/Metadata/Metadata.html#//apple_ref/doc/uid/TP40000939-CH1-SW1
+*   http://atomicparsley.sourceforge.net/mpeg-4files.html
+*   note that ISO did not specify comment format.
+*/
+int MP4E_set_text_comment(MP4E_mux_t *mux, const char *comment)
+{
+    if (!mux || !comment)
+        return MP4E_STATUS_BAD_ARGUMENTS;
+    if (mux->text_comment)
+        free(mux->text_comment);
+    mux->text_comment = strdup(comment);
+    if (!mux->text_comment)
+        return MP4E_STATUS_NO_MEMORY;
+    return MP4E_STATUS_OK;
+}
+
+/************************************************************************/
+/*      Index writer                                                    */
+/************************************************************************/
+
+/**
+*   The 'moov' box is streamed to the write callback through a fixed-size
+*   window, so index size does not affect peak memory at close.
+*   Since atom sizes can't be patched after the window is flushed, the
+*   index is generated twice: the first (measure) pass only collects
+*   atom sizes, the second pass writes atoms with known sizes.
+*/
+#define MP4E_INDEX_MAX_DEPTH 20
+
+typedef struct
+{
+    unsigned char *base, *end;  // output window
+    int64_t pos;                // file position of the window start
+    int measure;                // 1 = measure pass: collect atom sizes, no output
+    minimp4_vector_t atom_size; // sizes of all atoms, in order of appearance
+    int natom;                  // # of atoms started in the current pass
+    int depth;                  // open atoms stack (measure pass only)
+    struct
+    {
+        int64_t pos;
+        int natom;
+    } stack[MP4E_INDEX_MAX_DEPTH];
+} mp4e_index_writer_t;
+
+/**
+*   Pass window content to the write callback (or just count it in the
+*   measure pass), and rewind the write pointer
+*/
+static int mp4e_index_flush(MP4E_mux_t *mux, mp4e_index_writer_t *w, unsigned char **pp)
+{
+    int bytes = (int)(*pp - w->base);
+    if (!w->measure && bytes)
+        ERR(mp4e_write(mux, w->pos, w->base, bytes));
+    w->pos += bytes;
+    *pp = w->base;
+    return MP4E_STATUS_OK;
+}
+
+/**
+*   Begin atom: write size field, measured by the first pass
+*/
+static int mp4e_index_atom_begin(MP4E_mux_t *mux, mp4e_index_writer_t *w, unsigned char **pp)
+{
+    unsigned size = 0;
+    if (*pp + 4 > w->end)
+        ERR(mp4e_index_flush(mux, w, pp));
+    if (w->measure)
+    {
+        if (w->depth >= MP4E_INDEX_MAX_DEPTH)
+            return MP4E_STATUS_BAD_ARGUMENTS;
+        w->stack[w->depth].pos = w->pos + (*pp - w->base);
+        w->stack[w->depth].natom = w->natom;
+        w->depth++;
+        if (!minimp4_vector_put(&w->atom_size, &size, sizeof(size)))
+            return MP4E_STATUS_NO_MEMORY;
+    } else
+    {
+        size = ((unsigned *)w->atom_size.data)[w->natom];
+    }
+    w->natom++;
+    WR4(*pp, size);
+    *pp += 4;
+    return MP4E_STATUS_OK;
+}
+
+/**
+*   Finish atom: in the measure pass, save atom size
+*/
+static void mp4e_index_atom_end(mp4e_index_writer_t *w, const unsigned char *p)
+{
+    if (w->measure)
+    {
+        w->depth--;
+        ((unsigned *)w->atom_size.data)[w->stack[w->depth].natom] =
+            (unsigned)(w->pos + (p - w->base) - w->stack[w->depth].pos);
+    }
+}
+
+// Index writer variants of byte-write and atom macros: flush the window when it is full
+#undef WR
+#undef ATOM
+#undef END_ATOM
+#define WR(x, n) if (p == w->end) ERR(mp4e_index_flush(mux, w, &p)); *p++ = (unsigned char)((x) >> 8*n)
+#define ATOM(x)  ERR(mp4e_index_atom_begin(mux, w, &p)); WRITE_4(x);
+#define END_ATOM mp4e_index_atom_end(w, p);
+
+/**
+*   Write file index 'moov' box with all its boxes and indexes
+*/
+static int mp4e_write_index(MP4E_mux_t *mux, mp4e_index_writer_t *w)
+{
+    unsigned char *p = w->base;
+    unsigned int ntr, ntracks = mux->tracks.bytes / sizeof(track_t);
+    int i;
+
+    // Write index atoms; order taken from Table 1 of [1]
+#define MOOV_TIMESCALE 1000
+    ATOM(BOX_moov);
         ATOM_FULL(BOX_mvhd, 0);
         WRITE_4(0); // creation_time
         WRITE_4(0); // modification_time
@@ -1484,6 +2174,8 @@ static int mp4e_flush_index(MP4E_mux_t *mux)
                         {
                             int numOfSequenceParameterSets = items_count(&tr->vsps);
                             int numOfPictureParameterSets  = items_count(&tr->vpps);
+                            if (!tr->vsps.bytes)
+                                return MP4E_STATUS_BAD_ARGUMENTS;   // no SPS yet (e.g. 1st fragment is from another track)
                             if (MP4_OBJECT_TYPE_AVC == tr->info.object_type_indication)
                             {
                                 ATOM(BOX_avc1);
@@ -1587,9 +2279,13 @@ static int mp4e_flush_index(MP4E_mux_t *mux)
                         // Time to Sample Box
                         ATOM_FULL(BOX_stts, 0);
                         {
-                            unsigned char *pentry_count = p;
                             int cnt = 1, entry_count = 0;
-                            WRITE_4(0);
+                            for (i = 0; i < samples_count; i++)
+                            {
+                                if (i == (samples_count - 1) || sample[i].duration != sample[i + 1].duration)
+                                    entry_count++;
+                            }
+                            WRITE_4(entry_count);
                             for (i = 0; i < samples_count; i++, cnt++)
                             {
                                 if (i == (samples_count - 1) || sample[i].duration != sample[i + 1].duration)
@@ -1597,13 +2293,38 @@ static int mp4e_flush_index(MP4E_mux_t *mux)
                                     WRITE_4(cnt);
                                     WRITE_4(sample[i].duration);
                                     cnt = 0;
-                                    entry_count++;
                                 }
                             }
-                            WR4(pentry_count, entry_count);
                         }
                         END_ATOM;
 
+                        // Composition Time to Sample Box, if any sample has an offset
+                        {
+                            int cnt = 1, entry_count = 0, has_offsets = 0, negative = 0;
+                            for (i = 0; i < samples_count; i++)
+                            {
+                                has_offsets |= sample[i].composition_offset != 0;
+                                negative |= sample[i].composition_offset < 0;
+                                if (i == (samples_count - 1) || sample[i].composition_offset != sample[i + 1].composition_offset)
+                                    entry_count++;
+                            }
+                            if (has_offsets)
+                            {
+                                ATOM_FULL(BOX_ctts, negative ? 0x01000000 : 0); // signed offsets in version 1
+                                WRITE_4(entry_count);
+                                for (i = 0; i < samples_count; i++, cnt++)
+                                {
+                                    if (i == (samples_count - 1) || sample[i].composition_offset != sample[i + 1].composition_offset)
+                                    {
+                                        WRITE_4(cnt);
+                                        WRITE_4(sample[i].composition_offset);
+                                        cnt = 0;
+                                    }
+                                }
+                                END_ATOM;
+                            }
+                        }
+
                         // Sample To Chunk Box
                         ATOM_FULL(BOX_stsc, 0);
                         if (mux->enable_fragmentation)
@@ -1731,11 +2452,94 @@ static int mp4e_flush_index(MP4E_mux_t *mux)
     }
     END_ATOM;   // moov atom
 
-    assert((unsigned)(p - base) <= index_bytes);
+    return mp4e_index_flush(mux, w, &p);
+}
 
-    err = mux->write_callback(mux->write_pos, base, p - base, mux->token);
-    mux->write_pos += p - base;
-    free(base);
+// Restore default byte-write and atom macros
+#undef WR
+#undef ATOM
+#undef END_ATOM
+#define WR(x, n) *p++ = (unsigned char)((x) >> 8*n)
+#define ATOM(x)  *stack++ = p; p += 4; WRITE_4(x);
+#define END_ATOM --stack; WR4((unsigned char*)*stack, p - *stack);
+
+/**
+*   Flush pending samples, update 'mdat' size and write 'moov' box
+*/
+static int mp4e_write_headers(MP4E_mux_t *mux)
+{
+    mp4e_index_writer_t w;
+    unsigned int ntr, ntracks = mux->tracks.bytes / sizeof(track_t);
+    int err;
+
+    for (ntr = 0; ntr < ntracks; ntr++)
+    {
+        track_t *tr = ((track_t*)mux->tracks.data) + ntr;
+        ERR(write_pending_data(mux, tr));
+    }
+
+    if (!mux->sequential_mode_flag)
+    {
+        // update size of mdat box.
+        // One of 2 points, which requires random file access.
+        // Second is optonal duration update at beginning of file in fragmenatation mode.
+        // This can be avoided using "till eof" size code, but in this case indexes must be
+        // written before the mdat....
+        unsigned char base[16], *p = base;
+        int64_t size = mux->write_pos - sizeof(box_ftyp);
+        const int64_t size_limit = (int64_t)(uint64_t)0xfffffffe;
+        if (size > size_limit)
+        {
+            WRITE_4(1);
+            WRITE_4(BOX_mdat);
+            WRITE_4((size >> 32) & 0xffffffff);
+            WRITE_4(size & 0xffffffff);
+        } else
+        {
+            WRITE_4(8);
+            WRITE_4(BOX_free);
+            WRITE_4(size - 8);
+            WRITE_4(BOX_mdat);
+        }
+        ERR(mp4e_write(mux, sizeof(box_ftyp), base, p - base));
+    }
+
+    memset(&w, 0, sizeof(w));
+    w.base = (unsigned char*)malloc(MP4E_INDEX_WINDOW_BYTES);
+    if (!w.base)
+        return MP4E_STATUS_NO_MEMORY;
+    w.end = w.base + MP4E_INDEX_WINDOW_BYTES;
+
+    // measure pass: collect atom sizes
+    w.measure = 1;
+    w.pos = mux->write_pos;
+    err = mp4e_write_index(mux, &w);
+
+    // write pass
+    if (!err)
+    {
+        w.measure = 0;
+        w.natom = 0;
+        w.pos = mux->write_pos;
+        err = mp4e_write_index(mux, &w);
+        mux->write_pos = w.pos;
+    }
+    minimp4_vector_reset(&w.atom_size);
+    free(w.base);
+    return err;
+}
+
+/**
+*   Write headers and index, between MP4E_HOOK_FLUSH_INDEX hook calls
+*/
+static int mp4e_flush_index(MP4E_mux_t *mux)
+{
+    int err;
+    if (!mux->hook)
+        return mp4e_write_headers(mux);
+    mux->hook(mux->token, MP4E_HOOK_FLUSH_INDEX, 0);
+    err = mp4e_write_headers(mux);
+    mux->hook(mux->token, MP4E_HOOK_FLUSH_INDEX, 1);
     return err;
 }
 
@@ -1745,8 +2549,13 @@ int MP4E_close(MP4E_mux_t *mux)
     unsigned ntr, ntracks;
     if (!mux)
         return MP4E_STATUS_BAD_ARGUMENTS;
-    if (!mux->enable_fragmentation)
+    err = mp4e_interleave_drain(mux, INTERLEAVE_ALL);
+    if (!err && !mux->enable_fragmentation)
         err = mp4e_flush_index(mux);
+    if (!err)
+        err = mp4e_flush_output(mux);
+    if (mux->out_buf)
+        free(mux->out_buf);
     if (mux->text_comment)
         free(mux->text_comment);
     ntracks = mux->tracks.bytes / sizeof(track_t);
@@ -1757,6 +2566,8 @@ int MP4E_close(MP4E_mux_t *mux)
         minimp4_vector_reset(&tr->vpps);
         minimp4_vector_reset(&tr->smpl);
         minimp4_vector_reset(&tr->pending_sample);
+        minimp4_vector_reset(&tr->queue);
+        minimp4_vector_reset(&tr->queue_data);
     }
     minimp4_vector_reset(&mux->tracks);
     free(mux);
@@ -2461,6 +3272,90 @@ exit_with_free:
     return err;
 }
 
+int mp4_aac_write_init(mp4_aac_writer_t *h, MP4E_mux_t *mux, int sample_rate, int channels, const void *dsi, int dsi_bytes)
+{
+    static const int adts_frequency[] = { 96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050, 16000, 12000, 11025, 8000, 7350 };
+    MP4E_track_t tr;
+    int i;
+    if (!mux || sample_rate <= 0 || channels <= 0)
+        return MP4E_STATUS_BAD_ARGUMENTS;
+    tr.track_media_kind = e_audio;
+    tr.language[0] = 'u';
+    tr.language[1] = 'n';
+    tr.language[2] = 'd';
+    tr.language[3] = 0;
+    tr.object_type_indication = MP4_OBJECT_TYPE_AUDIO_ISO_IEC_14496_3;
+    tr.time_scale = sample_rate;
+    tr.default_duration = 0;
+    tr.u.a.channelcount = channels;
+    h->mux_track_id = MP4E_add_track(mux, &tr);
+    if (h->mux_track_id < 0)
+        return h->mux_track_id;
+    h->mux = mux;
+    h->samples_per_frame = 1024;
+    h->need_dsi = 1;
+    h->adts_frequency_index = 16;   // sample rate can not be coded by ADTS: no frame matches
+    for (i = 0; i < (int)(sizeof(adts_frequency)/sizeof(adts_frequency[0])); i++)
+    {
+        if (adts_frequency[i] == sample_rate)
+            h->adts_frequency_index = i;
+    }
+    if (dsi && dsi_bytes > 0)
+    {
+        ERR(MP4E_set_dsi(mux, h->mux_track_id, dsi, dsi_bytes));
+        h->need_dsi = 0;
+        h->adts_frequency_index = -1;
+    }
+    return MP4E_STATUS_OK;
+}
+
+int mp4_aac_write_frame(mp4_aac_writer_t *h, const unsigned char *data, int length)
+{
+    if (!h->mux || !data || length <= 0)
+        return MP4E_STATUS_BAD_ARGUMENTS;
+
+    if (length < 7 || data[0] != 0xFF || (data[1] & 0xF6) != 0xF0)
+    {
+        // raw access unit
+        if (h->need_dsi)
+            return MP4E_STATUS_BAD_ARGUMENTS;   // AudioSpecificConfig is unknown
+        return MP4E_put_sample(h->mux, h->mux_track_id, data, length, h->samples_per_frame, MP4E_SAMPLE_RANDOM_ACCESS);
+    }
+
+    while (length >= 7 && data[0] == 0xFF && (data[1] & 0xF6) == 0xF0)
+    {
+        // ADTS fixed + variable header
+        int header_bytes = (data[1] & 1) ? 7 : 9;   // protection_absent ? no CRC : CRC
+        int profile = data[2] >> 6;
+        int sampling_frequency_index = (data[2] >> 2) & 15;
+        int channel_configuration = ((data[2] & 1) << 2) | (data[3] >> 6);
+        int frame_length = ((data[3] & 3) << 11) | (data[4] << 3) | (data[5] >> 5);
+        int raw_data_blocks = (data[6] & 3) + 1;
+
+        if (frame_length <= header_bytes || frame_length > length)
+            return MP4E_STATUS_BAD_ARGUMENTS;
+        if (raw_data_blocks > 1)
+            return MP4E_STATUS_BAD_ARGUMENTS;   // several raw data blocks can not be muxed as one sample
+        if (h->adts_frequency_index >= 0 && sampling_frequency_index != h->adts_frequency_index)
+            return MP4E_STATUS_BAD_ARGUMENTS;   // time scale of the track is the sample rate
+        if (h->need_dsi)
+        {
+            // AudioSpecificConfig: audioObjectType(5), samplingFrequencyIndex(4), channelConfiguration(4), GASpecificConfig(3)
+            unsigned char dsi[2];
+            int audio_object_type = profile + 1;
+            dsi[0] = (unsigned char)((audio_object_type << 3) | (sampling_frequency_index >> 1));
+            dsi[1] = (unsigned char)(((sampling_frequency_index & 1) << 7) | (channel_configuration << 3));
+            ERR(MP4E_set_dsi(h->mux, h->mux_track_id, dsi, sizeof(dsi)));
+            h->need_dsi = 0;
+        }
+        ERR(MP4E_put_sample(h->mux, h->mux_track_id, data + header_bytes, frame_length - header_bytes,
+            h->samples_per_frame, MP4E_SAMPLE_RANDOM_ACCESS));
+        data   += frame_length;
+        length -= frame_length;
+    }
+    return MP4E_STATUS_OK;
+}
+
 #if MP4D_TRACE_SUPPORTED
 #   define TRACE(x) printf x
 #else
@@ -2469,9 +3364,47 @@ exit_with_free:
 
 #define NELEM(x)  (sizeof(x) / sizeof((x)[0]))
 
+/**
+*   Return number of bytes available in the read-ahead buffer at read position
+*/
+static int minimp4_buffered(MP4D_demux_t *mp4)
+{
+    int64_t pos = mp4->read_pos - mp4->read_buf_pos;
+    return (pos >= 0 && pos < mp4->read_buf_bytes) ? (int)(mp4->read_buf_bytes - pos) : 0;
+}
+
+/**
+*   Fill read-ahead buffer with data at read position
+*   return 0 if buffer is not available (disabled, EOF or read error since the last skip)
+*/
+static int minimp4_fill(MP4D_demux_t *mp4)
+{
+#if MP4D_READ_BUFFER_BYTES
+    int64_t bytes = mp4->read_size - mp4->read_pos;
+    if (!mp4->read_buf || mp4->read_buf_failed || bytes <= 0)
+        return 0;
+    if (bytes > MP4D_READ_BUFFER_BYTES)
+        bytes = MP4D_READ_BUFFER_BYTES;
+    mp4->read_buf_pos = mp4->read_pos;
+    mp4->read_buf_bytes = 0;
+    if (mp4->read_callback(mp4->read_pos, mp4->read_buf, (size_t)bytes, mp4->token))
+    {
+        mp4->read_buf_failed = 1;   // fallback to byte reads, without retrying the block for each byte
+        return 0;
+    }
+    mp4->read_buf_bytes = (int)bytes;
+    return 1;
+#else
+    (void)mp4;
+    return 0;
+#endif
+}
+
 static int minimp4_fgets(MP4D_demux_t *mp4)
 {
     uint8_t c;
+    if (minimp4_buffered(mp4) || minimp4_fill(mp4))
+        return mp4->read_buf[mp4->read_pos++ - mp4->read_buf_pos];
     if (mp4->read_callback(mp4->read_pos, &c, 1, mp4->token))
         return -1;
     mp4->read_pos++;
@@ -2485,6 +3418,14 @@ static int minimp4_fgets(MP4D_demux_t *mp4)
 static unsigned minimp4_read(MP4D_demux_t *mp4, int nb, int *eof_flag)
 {
     uint32_t v = 0; int last_byte;
+    if (nb >= 1 && nb <= 4 && minimp4_buffered(mp4) >= nb)
+    {
+        const unsigned char *p = mp4->read_buf + (mp4->read_pos - mp4->read_buf_pos);
+        mp4->read_pos += nb;
+        while (nb--)
+            v = (v << 8) | *p++;
+        return v;
+    }
     switch (nb)
     {
     case 4: v = (v << 8) | minimp4_fgets(mp4);
@@ -2517,14 +3458,45 @@ static uint32_t read_payload(MP4D_demux_t *mp4, unsigned nb, boxsize_t *payload_
 }
 
 /**
-*   Skips given number of bytes.
-*   Avoid math operations with fpos_t
+*   Read table of 'count' big-endian 32-bit values from box payload
 */
-static void my_fseek(MP4D_demux_t *mp4, boxsize_t pos, int *eof_flag)
+static void read_payload_table(MP4D_demux_t *mp4, unsigned *dst, unsigned count, boxsize_t *payload_bytes, int *eof_flag)
 {
-    mp4->read_pos += pos;
-    if (mp4->read_pos >= mp4->read_size)
-        *eof_flag = 1;
+    while (count)
+    {
+        const unsigned char *p;
+        unsigned i, n = minimp4_buffered(mp4)/4;
+        if (!n || *payload_bytes < 4)
+        {   // value crosses buffer boundary, or no buffer
+            *dst++ = read_payload(mp4, 4, payload_bytes, eof_flag);
+            count--;
+            continue;
+        }
+        n = MINIMP4_MIN(n, count);
+        n = (unsigned)MINIMP4_MIN(n, *payload_bytes/4);
+        p = mp4->read_buf + (mp4->read_pos - mp4->read_buf_pos);
+        for (i = 0; i < n; i++, p += 4)
+        {
+            dst[i] = ((unsigned)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+        }
+        dst += n;
+        count -= n;
+        mp4->read_pos += 4*n;
+        *payload_bytes -= 4*n;
+    }
+}
+
+/**
+*   Skips given number of bytes.
+*   Avoid math operations with fpos_t
+*/
+static void my_fseek(MP4D_demux_t *mp4, boxsize_t pos, int *eof_flag)
+{
+    mp4->read_pos += pos;
+    if (mp4->read_pos >= mp4->read_size)
+        *eof_flag = 1;
+    else
+        mp4->read_buf_failed = 0;   // retry block reads at the new position
 }
 
 #define READ(n) read_payload(mp4, n, &payload_bytes, &eof_flag)
@@ -2551,7 +3523,216 @@ static void my_fseek(MP4D_demux_t *mp4, boxsize_t pos, int *eof_flag)
 
 typedef enum { BOX_ATOM, BOX_OD } boxtype_t;
 
-int MP4D_open(MP4D_demux_t *mp4, int (*read_callback)(int64_t offset, void *buffer, size_t size, void *token), void *token, int64_t file_size)
+/**
+*   Calculate first sample for each sample-to-chunk run, used for binary search
+*/
+static void index_sample_to_chunk(MP4D_track_t *tr)
+{
+    unsigned i, first_sample = 0;
+    MP4D_sample_to_chunk_t *s2c = tr->sample_to_chunk;
+    for (i = 0; i < tr->sample_to_chunk_count; i++)
+    {
+        if (!i)
+            s2c[i].first_chunk = 1; // chunks counted starting with '1'
+        else if (s2c[i].first_chunk < s2c[i - 1].first_chunk)
+            s2c[i].first_chunk = s2c[i - 1].first_chunk;   // broken file?
+        if (i)
+            first_sample += (s2c[i].first_chunk - s2c[i - 1].first_chunk)*s2c[i - 1].samples_per_chunk;
+        s2c[i].first_sample = first_sample;
+    }
+}
+
+/**
+*   Find track by track_ID, used by movie fragments
+*/
+static MP4D_track_t *find_track(MP4D_demux_t *mp4, unsigned track_id)
+{
+    unsigned i;
+    for (i = 0; i < mp4->track_count; i++)
+    {
+        if (mp4->track[i].track_id == track_id)
+            return mp4->track + i;
+    }
+    return NULL;
+}
+
+/**
+*   Grow array memory to hold at least given number of items
+*/
+static int grow_array(void **p, unsigned *capacity, unsigned count, unsigned item_bytes)
+{
+    void *mem;
+    unsigned n = *capacity*2 + 256;
+    if (count <= *capacity)
+        return 1;
+    if (n < count || n > ~(size_t)0/item_bytes)
+        n = count;
+    if (n > ~(size_t)0/item_bytes)
+        return 0;   // size would wrap on 32-bit targets
+    mem = realloc(*p, (size_t)n*item_bytes);
+    if (!mem)
+        return 0;
+    *p = mem;
+    *capacity = n;
+    return 1;
+}
+
+#if MP4D_TIMESTAMPS_SUPPORTED
+/**
+*   Add samples of given duration, starting at given sample and decoding time.
+*   The last run is extended, if the samples continue it with the same duration.
+*/
+static int append_time_run(MP4D_track_t *tr, unsigned sample, uint64_t timestamp, unsigned delta)
+{
+    MP4D_time_run_t *run;
+    if (tr->time_run_count)
+    {
+        run = tr->time_run + tr->time_run_count - 1;
+        if (run->delta == delta && run->timestamp + (uint64_t)(sample - run->sample)*delta == timestamp)
+            return 1;
+    }
+    if (!grow_array((void**)&tr->time_run, &tr->time_run_capacity, tr->time_run_count + 1, sizeof(tr->time_run[0])))
+        return 0;
+    run = tr->time_run + tr->time_run_count++;
+    run->sample = sample;
+    run->delta = delta;
+    run->timestamp = timestamp;
+    return 1;
+}
+
+/**
+*   Decoding time after the last sample
+*/
+static uint64_t track_end_time(const MP4D_track_t *tr)
+{
+    const MP4D_time_run_t *run;
+    if (!tr->time_run_count)
+        return 0;
+    run = tr->time_run + tr->time_run_count - 1;
+    return run->timestamp + (uint64_t)(tr->sample_count - run->sample)*run->delta;
+}
+#endif
+
+#if MP4D_INFO_SUPPORTED
+/**
+*   Set durations of fragmented movie, which 'mvhd' and 'mdhd' do not count:
+*   from the end time of track fragments, or from 'mehd' if present
+*/
+static void set_fragment_durations(MP4D_demux_t *mp4, uint64_t fragment_duration)
+{
+    unsigned i;
+    for (i = 0; i < mp4->track_count; i++)
+    {
+        MP4D_track_t *tr = mp4->track + i;
+        uint64_t duration = 0;
+#if MP4D_TIMESTAMPS_SUPPORTED
+        duration = track_end_time(tr);
+#endif
+        if (!duration && mp4->timescale)
+            duration = fragment_duration*tr->timescale/mp4->timescale;
+        if (tr->duration < duration)
+            tr->duration = duration;
+        // without 'mehd', movie lasts as long as the longest track
+        if (!fragment_duration && tr->timescale && mp4->duration < tr->duration*mp4->timescale/tr->timescale)
+            mp4->duration = tr->duration*mp4->timescale/tr->timescale;
+    }
+    if (mp4->duration < fragment_duration)
+        mp4->duration = fragment_duration;
+}
+#endif
+
+/**
+*   Grow sample arrays to hold at least given number of samples
+*/
+static int grow_samples(MP4D_track_t *tr, unsigned count)
+{
+    unsigned capacity = tr->sample_capacity;
+    if (!grow_array((void**)&tr->entry_size, &capacity, count, sizeof(tr->entry_size[0])))
+        return 0;
+#if MP4D_TIMESTAMPS_SUPPORTED
+    if (tr->composition_offset)
+    {
+        capacity = tr->sample_capacity;
+        if (!grow_array((void**)&tr->composition_offset, &capacity, count, sizeof(tr->composition_offset[0])))
+            return 0;
+    }
+#endif
+    tr->sample_capacity = capacity;
+    return 1;
+}
+
+/**
+*   Start sync sample table before the 1st track fragment run: if there is no
+*   'stss' box, all samples in 'moov' are sync samples
+*/
+static int start_sync_table(MP4D_track_t *tr)
+{
+    unsigned i;
+    if (tr->has_sync_table)
+        return 1;
+    if (!grow_array((void**)&tr->sync_sample, &tr->sync_capacity, tr->sample_count, sizeof(tr->sync_sample[0])))
+        return 0;
+    for (i = 0; i < tr->sample_count; i++)
+        tr->sync_sample[i] = i;
+    tr->sync_count = tr->sample_count;
+    tr->has_sync_table = 1;
+    return 1;
+}
+
+/**
+*   Add sync sample of the track fragment run
+*/
+static int append_sync_sample(MP4D_track_t *tr, unsigned nsample)
+{
+    if (!grow_array((void**)&tr->sync_sample, &tr->sync_capacity, tr->sync_count + 1, sizeof(tr->sync_sample[0])))
+        return 0;
+    tr->sync_sample[tr->sync_count++] = nsample;
+    return 1;
+}
+
+/**
+*   Append chunk of given number of samples: one chunk for each track fragment run
+*/
+static int append_chunk(MP4D_track_t *tr, unsigned samples, MP4D_file_offset_t offset)
+{
+    MP4D_sample_to_chunk_t *s2c = tr->sample_to_chunk_count ? tr->sample_to_chunk + tr->sample_to_chunk_count - 1 : NULL;
+    if (!grow_array((void**)&tr->chunk_offset, &tr->chunk_capacity, tr->chunk_count + 1, sizeof(tr->chunk_offset[0])))
+        return 0;
+    tr->chunk_offset[tr->chunk_count++] = offset;
+    if (!s2c || s2c->samples_per_chunk != samples)
+    {   // last sample-to-chunk run does not match: start new one
+        if (!grow_array((void**)&tr->sample_to_chunk, &tr->sample_to_chunk_capacity, tr->sample_to_chunk_count + 1, sizeof(tr->sample_to_chunk[0])))
+            return 0;
+        s2c = tr->sample_to_chunk + tr->sample_to_chunk_count++;
+        s2c->first_chunk = tr->chunk_count;   // Chunks counted starting with '1'
+        s2c->samples_per_chunk = samples;
+    }
+    return 1;
+}
+
+/**
+*   Return 1 if track have tables, which are not loaded
+*/
+static int is_lazy_track(const MP4D_track_t *tr)
+{
+    return tr->lazy_stsz.count || tr->lazy_stco.count || tr->lazy_stts.count;
+}
+
+/**
+*   Record position of the table of 'count' entries, and skip it
+*   return 0 if the table does not fit in the box payload
+*/
+static int lazy_table(MP4D_demux_t *mp4, MP4D_lazy_table_t *t, unsigned count, unsigned entry_bytes, boxsize_t payload_bytes)
+{
+    if ((uint64_t)count*entry_bytes > (uint64_t)payload_bytes)
+        return 0;
+    t->offset = mp4->read_pos;
+    t->count = count;
+    t->entry_bytes = entry_bytes;
+    return 1;
+}
+
+int MP4D_open_ex(MP4D_demux_t *mp4, int (*read_callback)(int64_t offset, void *buffer, size_t size, void *token), void *token, int64_t file_size, int flags)
 {
     // box stack size
     int depth = 0;
@@ -2575,6 +3756,13 @@ int MP4D_open(MP4D_demux_t *mp4, int (*read_callback)(int64_t offset, void *buff
     unsigned i;
     MP4D_track_t *tr = NULL;
 
+    // movie fragment state: position of 'moof', data base and defaults of current track fragment
+    MP4D_file_offset_t moof_pos = 0, traf_base = 0, traf_data_pos = 0;
+    unsigned traf_duration = 0, traf_size = 0, traf_flags = 0;
+    uint64_t traf_time = 0;
+    int fragmented = 0;
+    uint64_t fragment_duration = 0;     // from 'mehd', in movie time scale
+
     if (!mp4 || !read_callback)
     {
         TRACE(("\nERROR: invlaid arguments!"));
@@ -2585,6 +3773,10 @@ int MP4D_open(MP4D_demux_t *mp4, int (*read_callback)(int64_t offset, void *buff
     mp4->read_callback = read_callback;
     mp4->token = token;
     mp4->read_size = file_size;
+    mp4->lazy_index = flags & MP4D_OPEN_LAZY_INDEX;
+#if MP4D_READ_BUFFER_BYTES
+    mp4->read_buf = (unsigned char *)malloc(MP4D_READ_BUFFER_BYTES);   // no buffer: fallback to byte reads
+#endif
 
     stack[0].format = BOX_ATOM;   // start with atom box
     stack[0].bytes = 0;           // never accessed
@@ -2604,19 +3796,26 @@ int MP4D_open(MP4D_demux_t *mp4, int (*read_callback)(int64_t offset, void *buff
 #if MP4D_INFO_SUPPORTED
             {BOX_mdhd, 1, 1},
             {BOX_mvhd, 1, 0},
+            {BOX_mehd, 1, 0},
             {BOX_hdlr, 0, 0},
             {BOX_meta, 0, 0},   // Android can produce meta box without 'FullBox' field, comment this line to simulate the bug
 #endif
 #if MP4D_TRACE_TIMESTAMPS
             {BOX_stts, 0, 0},
-            {BOX_ctts, 0, 0},
+            {BOX_ctts, 1, 1},
 #endif
             {BOX_stz2, 0, 1},
             {BOX_stsz, 0, 1},
             {BOX_stsc, 0, 1},
             {BOX_stco, 0, 1},
             {BOX_co64, 0, 1},
+            {BOX_stss, 0, 1},
             {BOX_stsd, 0, 0},
+            {BOX_tkhd, 1, 1},
+            {BOX_trex, 0, 0},
+            {BOX_tfhd, 0, 0},
+            {BOX_tfdt, 1, 0},
+            {BOX_trun, 1, 0},
             {BOX_esds, 0, 1}    // esds does not use track, but switches to OD mode. Check here, to avoid OD check
         };
 
@@ -2636,7 +3835,9 @@ int MP4D_open(MP4D_demux_t *mp4, int (*read_callback)(int64_t offset, void *buff
             {OD_DSI,   BOX_OD},
             {BOX_trak, BOX_ATOM},
             {BOX_moov, BOX_ATOM},
-            //{BOX_moof, BOX_ATOM},
+            {BOX_mvex, BOX_ATOM},
+            {BOX_moof, BOX_ATOM},
+            {BOX_traf, BOX_ATOM},
             {BOX_mdia, BOX_ATOM},
             {BOX_tref, BOX_ATOM},
             {BOX_minf, BOX_ATOM},
@@ -2811,7 +4012,27 @@ broken_android_meta_hack:
                 int size = 0;
                 uint32_t sample_size = READ(4);
                 tr->sample_count = READ(4);
+#if MP4D_TIMESTAMPS_SUPPORTED
+                if (tr->composition_count > tr->sample_count)
+                {
+                    ERROR("broken file structure!");    // 'ctts' covers more samples
+                }
+#endif
+                if (mp4->lazy_index && box_name == BOX_stsz && tr->sample_count)
+                {
+                    if (!lazy_table(mp4, &tr->lazy_stsz, tr->sample_count, sample_size ? 0 : 4, payload_bytes))
+                    {
+                        ERROR("broken file structure!");
+                    }
+                    tr->lazy_stsz.value = sample_size;
+                    break;  // table is skipped below
+                }
                 MALLOC(unsigned int*, tr->entry_size, tr->sample_count*4);
+                if (box_name == BOX_stsz && !sample_size)
+                {
+                    read_payload_table(mp4, tr->entry_size, tr->sample_count, &payload_bytes, &eof_flag);
+                    break;
+                }
                 for (i = 0; i < tr->sample_count; i++)
                 {
                     if (box_name == BOX_stsz)
@@ -2857,44 +4078,86 @@ broken_android_meta_hack:
         case BOX_stts:
             {
                 unsigned count = READ(4);
-                unsigned j, k = 0, ts = 0, ts_count = count;
+                unsigned k = 0;
+                uint64_t ts = 0;
 #if MP4D_TIMESTAMPS_SUPPORTED
-                MALLOC(unsigned int*, tr->timestamp, ts_count*4);
-                MALLOC(unsigned int*, tr->duration, ts_count*4);
+                if (mp4->lazy_index && count)
+                {
+                    if (!lazy_table(mp4, &tr->lazy_stts, count, 8, payload_bytes))
+                    {
+                        ERROR("broken file structure!");
+                    }
+                    break;
+                }
 #endif
+                if (count > payload_bytes/8)
+                {
+                    ERROR("broken file structure!");
+                }
 
                 for (i = 0; i < count; i++)
                 {
                     unsigned sc = READ(4);
-                    int d =  READ(4);
+                    unsigned d = READ(4);
                     TRACE(("sample %8d count %8d duration %8d\n", i, sc, d));
 #if MP4D_TIMESTAMPS_SUPPORTED
-                    if (k + sc > ts_count)
-                    {
-                        ts_count = k + sc;
-                        tr->timestamp = (unsigned int*)realloc(tr->timestamp, ts_count * sizeof(unsigned));
-                        tr->duration  = (unsigned int*)realloc(tr->duration,  ts_count * sizeof(unsigned));
-                    }
-                    for (j = 0; j < sc; j++)
+                    if (sc && !append_time_run(tr, k, ts, d))
                     {
-                        tr->duration[k] = d;
-                        tr->timestamp[k++] = ts;
-                        ts += d;
+                        ERROR("out of memory");
                     }
 #endif
+                    k += sc;
+                    ts += (uint64_t)sc*d;
                 }
             }
             break;
-        case BOX_ctts:
+        case BOX_ctts:  //ISO/IEC 14496-12 Section 8.6.1.3 - Composition Time to Sample Box.
             {
                 unsigned count = READ(4);
+                unsigned j, k = 0, capacity = 0;
+                // samples are counted by 'stsz', which usually follows: until then, only bound the size
+                unsigned limit = tr->sample_count ? tr->sample_count : ~0u;
+#if MP4D_TIMESTAMPS_SUPPORTED
+                if (mp4->lazy_index && count)
+                {
+                    if (!lazy_table(mp4, &tr->lazy_ctts, count, 8, payload_bytes))
+                    {
+                        ERROR("broken file structure!");
+                    }
+                    break;
+                }
+                if (tr->composition_offset)
+                {
+                    ERROR("broken file structure!");
+                }
+#endif
+                if (count > payload_bytes/8)
+                {
+                    ERROR("broken file structure!");
+                }
                 for (i = 0; i < count; i++)
                 {
-                    int sc = READ(4);
-                    int d =  READ(4);
-                    (void)sc;
-                    (void)d;
+                    unsigned sc = READ(4);
+                    int d =  READ(4);   // signed in version 1, and in practice
                     TRACE(("sample %8d count %8d decoding to composition offset %8d\n", i, sc, d));
+                    if (sc > limit - k)
+                    {
+                        ERROR("broken file structure!");
+                    }
+#if MP4D_TIMESTAMPS_SUPPORTED
+                    if (!grow_array((void**)&tr->composition_offset, &capacity, k + sc, sizeof(int)))
+                    {
+                        ERROR("out of memory");
+                    }
+                    for (j = 0; j < sc; j++)
+                    {
+                        tr->composition_offset[k++] = d;
+                    }
+                    tr->composition_count = k;
+#else
+                    (void)j; (void)capacity;
+                    k += sc;
+#endif
                 }
             }
             break;
@@ -2902,6 +4165,14 @@ broken_android_meta_hack:
         case BOX_stco:  //ISO/IEC 14496-12 Page 39. Section 8.19 - Chunk Offset Box.
         case BOX_co64:
             tr->chunk_count = READ(4);
+            if (mp4->lazy_index && tr->chunk_count)
+            {
+                if (!lazy_table(mp4, &tr->lazy_stco, tr->chunk_count, box_name == BOX_co64 ? 8 : 4, payload_bytes))
+                {
+                    ERROR("broken file structure!");
+                }
+                break;
+            }
             MALLOC(MP4D_file_offset_t*, tr->chunk_offset, tr->chunk_count*sizeof(MP4D_file_offset_t));
             for (i = 0; i < tr->chunk_count; i++)
             {
@@ -2920,20 +4191,209 @@ broken_android_meta_hack:
             }
             break;
 
+        case BOX_stss:  //ISO/IEC 14496-12 Section 8.6.2 - Sync Sample Box.
+            if (tr)
+            {
+                unsigned count = READ(4);
+                tr->has_sync_table = 1;
+                if (mp4->lazy_index)
+                {
+                    if (!lazy_table(mp4, &tr->lazy_stss, count, 4, payload_bytes))
+                    {
+                        ERROR("broken file structure!");
+                    }
+                    break;
+                }
+                if (!count)
+                    break;
+                MALLOC(unsigned int*, tr->sync_sample, count*4);
+                read_payload_table(mp4, tr->sync_sample, count, &payload_bytes, &eof_flag);
+                for (i = 0; i < count; i++)
+                {
+                    tr->sync_sample[i]--;   // sample numbers start with 1
+                }
+                tr->sync_count = tr->sync_capacity = count;
+            }
+            break;
+
+        case BOX_tkhd:
+            SKIP(((FullAtomVersionAndFlags >> 24) == 1) ? 8 + 8 : 4 + 4);
+            tr->track_id = READ(4);
+            break;
+
+        case BOX_trex:
+            {
+                MP4D_track_t *trex = find_track(mp4, READ(4));
+                SKIP(4);    // default_sample_description_index
+                if (trex)
+                {
+                    trex->default_sample_duration = READ(4);
+                    trex->default_sample_size = READ(4);
+                    trex->default_sample_flags = READ(4);
+                }
+            }
+            break;
+
+        case BOX_moov:
+            mp4->moov_pos = mp4->read_pos - (box_bytes - payload_bytes);
+            mp4->moov_bytes = box_bytes;
+            break;
+
+        case BOX_moof:
+            moof_pos = mp4->read_pos - (box_bytes - payload_bytes);
+            fragmented = 1;
+            traf_data_pos = moof_pos;   // 1st track fragment data base, if not specified
+            tr = NULL;
+            break;
+
+        case BOX_tfhd:
+            tr = find_track(mp4, READ(4));
+            if (!tr)
+            {
+                TRACE(("track fragment of unknown track\n"));
+                break;
+            }
+            if (FullAtomVersionAndFlags & 0x01)         // base-data-offset-present
+            {
+                traf_base = READ(4);
+#if MP4D_64BIT_SUPPORTED
+                traf_base <<= 32;
+                traf_base |= READ(4);
+#else
+                if (traf_base)
+                {
+                    ERROR("UNSUPPORTED FEATURE: 64-bit base_data_offset not supported!");
+                }
+                traf_base = READ(4);
+#endif
+            } else if (FullAtomVersionAndFlags & 0x020000)  // default-base-is-moof
+            {
+                traf_base = moof_pos;
+            } else
+            {
+                traf_base = traf_data_pos;  // end of data of the previous track fragment
+            }
+            traf_data_pos = traf_base;
+            if (FullAtomVersionAndFlags & 0x02)         // sample-description-index-present
+                SKIP(4);
+            traf_duration = (FullAtomVersionAndFlags & 0x08) ? READ(4) : tr->default_sample_duration;
+            traf_size = (FullAtomVersionAndFlags & 0x10) ? READ(4) : tr->default_sample_size;
+            traf_flags = (FullAtomVersionAndFlags & 0x20) ? READ(4) : tr->default_sample_flags;
+            traf_time = 0;
+#if MP4D_TIMESTAMPS_SUPPORTED
+            traf_time = track_end_time(tr);
+#endif
+            break;
+
+        case BOX_tfdt:
+            if (tr)
+            {
+                traf_time = READ(4);
+                if ((FullAtomVersionAndFlags >> 24) == 1)
+                    traf_time = (traf_time << 32) | READ(4);    // 64-bit baseMediaDecodeTime
+            }
+            break;
+
+        case BOX_trun:  //ISO/IEC 14496-12 Section 8.8.8 - Track Fragment Run Box.
+            if (tr)
+            {
+                unsigned flags = FullAtomVersionAndFlags, count = READ(4), n = tr->sample_count;
+                unsigned entry_bytes = ((flags >> 8) & 1) + ((flags >> 9) & 1) + ((flags >> 10) & 1) + ((flags >> 11) & 1);
+                unsigned first_flags = traf_flags;
+                MP4D_file_offset_t data_pos = traf_data_pos;
+                if (flags & 0x001)      // data-offset-present
+                    data_pos = traf_base + (int32_t)READ(4);
+                if (flags & 0x004)      // first-sample-flags-present
+                    first_flags = READ(4);
+                if (!count)
+                    break;
+                if (is_lazy_track(tr))
+                {
+                    ERROR("UNSUPPORTED FEATURE: movie fragments of the track with lazy index!");
+                }
+                if (count > ~0u - n || (boxsize_t)count*entry_bytes*4 > payload_bytes)
+                {
+                    ERROR("broken file structure!");
+                }
+                if (!(flags & 0x200) && ((uint64_t)count > (uint64_t)mp4->read_size || (uint64_t)count*traf_size > (uint64_t)mp4->read_size))
+                {   // run without sample sizes: its samples must still fit in the file
+                    ERROR("broken file structure!");
+                }
+                if (!grow_samples(tr, n + count) || !append_chunk(tr, count, data_pos) || !start_sync_table(tr))
+                {
+                    ERROR("out of memory");
+                }
+#if MP4D_TIMESTAMPS_SUPPORTED
+                if ((flags & 0x800) && !tr->composition_offset)
+                {   // 1st run with composition offsets: earlier samples have none
+                    tr->composition_offset = (int*)calloc(tr->sample_capacity, sizeof(int));
+                    if (!tr->composition_offset)
+                    {
+                        ERROR("out of memory");
+                    }
+                }
+                if (tr->composition_offset)
+                {   // samples between 'ctts' and this run have none
+                    if (tr->composition_count < n)
+                        memset(tr->composition_offset + tr->composition_count, 0, (n - tr->composition_count)*sizeof(int));
+                    tr->composition_count = n + count;
+                }
+#endif
+                for (i = 0; i < count; i++)
+                {
+                    unsigned d = (flags & 0x100) ? READ(4) : traf_duration;
+                    unsigned sample_flags = i ? traf_flags : first_flags;
+                    int cts = 0;
+                    tr->entry_size[n + i] = (flags & 0x200) ? READ(4) : traf_size;
+                    if (flags & 0x400)  // sample-flags-present
+                        sample_flags = READ(4);
+                    if (flags & 0x800)  // sample-composition-time-offsets-present
+                        cts = READ(4);
+                    // sync sample, unless sample_is_non_sync_sample is set
+                    if (!(sample_flags & 0x10000) && !append_sync_sample(tr, n + i))
+                    {
+                        ERROR("out of memory");
+                    }
+#if MP4D_TIMESTAMPS_SUPPORTED
+                    if (!append_time_run(tr, n + i, traf_time, d))
+                    {
+                        ERROR("out of memory");
+                    }
+                    if (tr->composition_offset)
+                        tr->composition_offset[n + i] = cts;
+#else
+                    (void)cts;
+#endif
+                    traf_time += d;
+                    data_pos += tr->entry_size[n + i];
+                }
+                tr->sample_count = n + count;
+                traf_data_pos = data_pos;   // next run data follows, if data offset is not specified
+            }
+            break;
+
 #if MP4D_INFO_SUPPORTED
         case BOX_mvhd:
             SKIP(((FullAtomVersionAndFlags >> 24) == 1) ? 8 + 8 : 4 + 4);
             mp4->timescale = READ(4);
-            mp4->duration_hi = ((FullAtomVersionAndFlags >> 24) == 1) ? READ(4) : 0;
-            mp4->duration_lo = READ(4);
+            mp4->duration = READ(4);
+            if ((FullAtomVersionAndFlags >> 24) == 1)
+                mp4->duration = (mp4->duration << 32) | READ(4);
             SKIP(4 + 2 + 2 + 4*2 + 4*9 + 4*6 + 4);
             break;
 
+        case BOX_mehd:
+            fragment_duration = READ(4);
+            if ((FullAtomVersionAndFlags >> 24) == 1)
+                fragment_duration = (fragment_duration << 32) | READ(4);
+            break;
+
         case BOX_mdhd:
             SKIP(((FullAtomVersionAndFlags >> 24) == 1) ? 8 + 8 : 4 + 4);
             tr->timescale = READ(4);
-            tr->duration_hi = ((FullAtomVersionAndFlags >> 24) == 1) ? READ(4) : 0;
-            tr->duration_lo = READ(4);
+            tr->duration = READ(4);
+            if ((FullAtomVersionAndFlags >> 24) == 1)
+                tr->duration = (tr->duration << 32) | READ(4);
 
             {
                 int ISO_639_2_T = READ(2);
@@ -3049,7 +4509,7 @@ broken_android_meta_hack:
                 (void)AVCProfileIndication;
                 (void)profile_compatibility;
                 (void)AVCLevelIndication;
-                (void)lengthSizeMinusOne;
+                tr->nal_length_bytes = lengthSizeMinusOne + 1;
 
                 for (spspps = 0; spspps < 2; spspps++)
                 {
@@ -3207,82 +4667,453 @@ broken_android_meta_hack:
     {
         RETURN_ERROR("no tracks found");
     }
+    for (i = 0; i < mp4->track_count; i++)
+    {
+        index_sample_to_chunk(mp4->track + i);
+    }
+#if MP4D_INFO_SUPPORTED
+    if (fragmented)
+        set_fragment_durations(mp4, fragment_duration);
+#else
+    (void)fragmented; (void)fragment_duration;
+#endif
+    free(mp4->read_buf);    // not needed after open
+    mp4->read_buf = NULL;
+    mp4->read_buf_bytes = 0;
     return 1;
 }
 
-/**
-*   Find chunk, containing given sample.
-*   Returns chunk number, and first sample in this chunk.
+int MP4D_open(MP4D_demux_t *mp4, int (*read_callback)(int64_t offset, void *buffer, size_t size, void *token), void *token, int64_t file_size)
+{
+    return MP4D_open_ex(mp4, read_callback, token, file_size, 0);
+}
+
+struct MP4D_lazy_page_tag
+{
+    const MP4D_lazy_table_t *table; // NULL for empty page
+    unsigned page;
+    unsigned last_used;
+    uint64_t entry[MP4D_LAZY_PAGE_ENTRIES];
+};
+
+/**
+*   Find page of the table in the cache, or read it in place of least recently used page
 */
-static int sample_to_chunk(MP4D_track_t *tr, unsigned nsample, unsigned *nfirst_sample_in_chunk)
+static struct MP4D_lazy_page_tag *lazy_page(MP4D_demux_t *mp4, const MP4D_lazy_table_t *t, unsigned page)
 {
-    unsigned chunk_group = 0, nc;
-    unsigned sum = 0;
-    *nfirst_sample_in_chunk = 0;
-    if (tr->chunk_count <= 1)
+    struct MP4D_lazy_page_tag *pg, *lru;
+    unsigned i, entries;
+    unsigned char *raw;
+    if (!mp4->lazy_cache)
+    {
+        mp4->lazy_cache = (struct MP4D_lazy_page_tag *)calloc(MP4D_LAZY_CACHE_PAGES, sizeof(struct MP4D_lazy_page_tag));
+        if (!mp4->lazy_cache)
+            return NULL;
+    }
+    lru = mp4->lazy_cache;
+    for (i = 0; i < MP4D_LAZY_CACHE_PAGES; i++)
+    {
+        pg = mp4->lazy_cache + i;
+        if (pg->table == t && pg->page == page)
+            return pg;
+        if (pg->last_used < lru->last_used)
+            lru = pg;
+    }
+
+    pg = lru;
+    pg->table = NULL;
+    entries = MINIMP4_MIN(MP4D_LAZY_PAGE_ENTRIES, t->count - page*MP4D_LAZY_PAGE_ENTRIES);
+    raw = (unsigned char *)pg->entry;
+    if (mp4->read_callback(t->offset + (int64_t)page*MP4D_LAZY_PAGE_ENTRIES*t->entry_bytes, raw, entries*t->entry_bytes, mp4->token))
+        return NULL;
+    // decode big-endian entries in place, starting from the last one
+    for (i = entries; i-- > 0;)
     {
+        const unsigned char *p = raw + i*t->entry_bytes;
+        uint64_t v = 0;
+        unsigned k;
+        for (k = 0; k < t->entry_bytes; k++)
+            v = (v << 8) | p[k];
+        pg->entry[i] = v;
+    }
+    pg->table = t;
+    pg->page = page;
+    return pg;
+}
+
+/**
+*   Return entry of the table, which is not loaded in memory
+*/
+static uint64_t lazy_entry(MP4D_demux_t *mp4, const MP4D_lazy_table_t *t, unsigned n)
+{
+    unsigned page = n / MP4D_LAZY_PAGE_ENTRIES;
+    struct MP4D_lazy_page_tag *pg = mp4->lazy_last;
+    if (!t->entry_bytes)
+        return t->value;
+    if (n >= t->count)
         return 0;
+    if (!pg || pg->table != t || pg->page != page)
+    {
+        pg = lazy_page(mp4, t, page);
+        if (!pg)
+            return 0;
+        mp4->lazy_last = pg;
     }
-    for (nc = 0; nc < tr->chunk_count; nc++)
+    pg->last_used = ++mp4->lazy_clock;
+    return pg->entry[n % MP4D_LAZY_PAGE_ENTRIES];
+}
+
+static unsigned get_sample_size(MP4D_demux_t *mp4, MP4D_track_t *tr, unsigned n)
+{
+    return tr->entry_size ? tr->entry_size[n] : (unsigned)lazy_entry(mp4, &tr->lazy_stsz, n);
+}
+
+static MP4D_file_offset_t get_chunk_offset(MP4D_demux_t *mp4, MP4D_track_t *tr, unsigned n)
+{
+    return tr->chunk_offset ? tr->chunk_offset[n] : (MP4D_file_offset_t)lazy_entry(mp4, &tr->lazy_stco, n);
+}
+
+#if MP4D_TIMESTAMPS_SUPPORTED
+/**
+*   Find run of the run-length table ('stts' or 'ctts'), which is not loaded in
+*   memory, containing given sample, or given decoding time if by_time is set.
+*   Checkpoints, with the 1st sample and time of each page, are added as the
+*   pages are read for the first time.
+*   return 1 and the 1st sample, it's time and value (duration or offset) of the run; 0 if not found
+*/
+static int lazy_find_run(MP4D_demux_t *mp4, MP4D_lazy_table_t *t, int by_time, uint64_t key, unsigned *run_sample, uint64_t *run_time, unsigned *run_value)
+{
+    unsigned lo = 0, hi, i, n, sample;
+    uint64_t ts;
+    if (!t->count)
+        return 0;
+    if (!t->checkpoint_count)
+    {
+        if (!grow_array((void**)&t->checkpoint, &t->checkpoint_capacity, 1, sizeof(t->checkpoint[0])))
+            return 0;
+        t->checkpoint[0].sample = 0;
+        t->checkpoint[0].timestamp = 0;
+        t->checkpoint_count = 1;
+    }
+    // find last page, starting at or before given key
+    hi = t->checkpoint_count;
+    while (hi - lo > 1)
+    {
+        unsigned mid = (lo + hi) >> 1;
+        if ((by_time ? t->checkpoint[mid].timestamp : t->checkpoint[mid].sample) <= key)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    for (;;)
     {
-        if (chunk_group + 1 < tr->sample_to_chunk_count     // stuck at last entry till EOF
-            && nc + 1 ==    // Chunks counted starting with '1'
-            tr->sample_to_chunk[chunk_group + 1].first_chunk)    // next group?
+        if (!lazy_page(mp4, t, lo))
+            return 0;   // read error: entries of the page are not known
+        sample = t->checkpoint[lo].sample;
+        ts = t->checkpoint[lo].timestamp;
+        n = MINIMP4_MIN(MP4D_LAZY_PAGE_ENTRIES, t->count - lo*MP4D_LAZY_PAGE_ENTRIES);
+        for (i = 0; i < n; i++)
         {
-            chunk_group++;
+            uint64_t e = lazy_entry(mp4, t, lo*MP4D_LAZY_PAGE_ENTRIES + i);
+            unsigned count = (unsigned)(e >> 32), value = (unsigned)e;
+            if (by_time ? key - ts < (uint64_t)count*value : key - sample < count)
+            {
+                *run_sample = sample;
+                *run_time = ts;
+                *run_value = value;
+                return 1;
+            }
+            sample += count;
+            ts += (uint64_t)count*value;
         }
+        // key is after this page: go to the next one
+        if ((lo + 1)*MP4D_LAZY_PAGE_ENTRIES >= t->count)
+            return 0;
+        if (++lo == t->checkpoint_count)
+        {
+            if (!grow_array((void**)&t->checkpoint, &t->checkpoint_capacity, lo + 1, sizeof(t->checkpoint[0])))
+                return 0;
+            t->checkpoint[lo].sample = sample;
+            t->checkpoint[lo].timestamp = ts;
+            t->checkpoint_count++;
+        }
+    }
+}
 
-        sum += tr->sample_to_chunk[chunk_group].samples_per_chunk;
-        if (nsample < sum)
-            return nc;
+/**
+*   Find 'stts' run, containing given sample, or the last one starting at or
+*   before given decoding time if by_time is set: binary search over runs
+*/
+static unsigned find_time_run(const MP4D_track_t *tr, int by_time, uint64_t key)
+{
+    unsigned lo = 0, hi = tr->time_run_count;
+    while (hi - lo > 1)
+    {
+        unsigned mid = (lo + hi) >> 1;
+        if ((by_time ? tr->time_run[mid].timestamp : tr->time_run[mid].sample) <= key)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return lo;
+}
 
-        // TODO: this can be calculated once per file
-        *nfirst_sample_in_chunk = sum;
+/**
+*   Find decoding time and duration of the sample
+*/
+static void sample_time(MP4D_demux_t *mp4, MP4D_track_t *tr, unsigned nsample, uint64_t *timestamp, unsigned *duration)
+{
+    unsigned sample, delta;
+    uint64_t ts;
+    *timestamp = 0;
+    *duration = 0;
+    if (tr->time_run_count)
+    {
+        const MP4D_time_run_t *run = tr->time_run + find_time_run(tr, 0, nsample);
+        if (run->sample <= nsample)
+        {
+            *timestamp = run->timestamp + (uint64_t)(nsample - run->sample)*run->delta;
+            *duration = run->delta;
+        }
+    } else if (lazy_find_run(mp4, &tr->lazy_stts, 0, nsample, &sample, &ts, &delta))
+    {
+        *timestamp = ts + (uint64_t)(nsample - sample)*delta;
+        *duration = delta;
     }
-    return -1;
+}
+#endif
+
+/**
+*   Find chunk, containing given sample.
+*   Returns chunk number, first sample in this chunk and first sample in the next chunk.
+*   Binary search over sample-to-chunk runs: O(log(sample_to_chunk_count))
+*/
+static int sample_to_chunk(MP4D_track_t *tr, unsigned nsample, unsigned *nfirst_sample_in_chunk, unsigned *nfirst_sample_in_next_chunk)
+{
+    const MP4D_sample_to_chunk_t *s2c = tr->sample_to_chunk;
+    unsigned lo = 0, hi = tr->sample_to_chunk_count, nc;
+    *nfirst_sample_in_chunk = 0;
+    *nfirst_sample_in_next_chunk = ~0u;
+    if (tr->chunk_count <= 1)
+    {
+        return 0;
+    }
+    if (!hi)
+    {
+        return -1;
+    }
+    // find last run, starting at or before given sample
+    while (hi - lo > 1)
+    {
+        unsigned mid = (lo + hi) >> 1;
+        if (s2c[mid].first_sample <= nsample)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    if (!s2c[lo].samples_per_chunk)
+    {
+        return -1;
+    }
+    nc = (nsample - s2c[lo].first_sample)/s2c[lo].samples_per_chunk;
+    *nfirst_sample_in_chunk = s2c[lo].first_sample + nc*s2c[lo].samples_per_chunk;
+    *nfirst_sample_in_next_chunk = *nfirst_sample_in_chunk + s2c[lo].samples_per_chunk;
+    nc += s2c[lo].first_chunk - 1;    // Chunks counted starting with '1'
+    return nc < tr->chunk_count ? (int)nc : -1;
 }
 
 // Exported API function
-MP4D_file_offset_t MP4D_frame_offset(const MP4D_demux_t *mp4, unsigned ntrack, unsigned nsample, unsigned *frame_bytes, unsigned *timestamp, unsigned *duration)
+/**
+*   Find sample offset, starting from the cached sample
+*/
+static MP4D_file_offset_t frame_offset(MP4D_demux_t *demux, MP4D_track_t *tr, MP4D_sample_cache_t *cache, unsigned nsample, unsigned *frame_bytes, uint64_t *timestamp, unsigned *duration)
 {
-    MP4D_track_t *tr = mp4->track + ntrack;
     unsigned ns;
-    int nchunk = sample_to_chunk(tr, nsample, &ns);
     MP4D_file_offset_t offset;
 
-    if (nchunk < 0)
+    if (cache->chunk_end && nsample >= cache->chunk_first && nsample < cache->chunk_end)
+    {   // same chunk as in previous call: start from cached sample
+        ns = cache->chunk_first;
+        offset = cache->offset;
+        if (nsample >= cache->sample)
+            ns = cache->sample;
+        else
+            offset = get_chunk_offset(demux, tr, cache->chunk);
+    } else
     {
-        *frame_bytes = 0;
-        return 0;
+        int nchunk = sample_to_chunk(tr, nsample, &ns, &cache->chunk_end);
+        if (nchunk < 0)
+        {
+            cache->chunk_end = 0;
+            *frame_bytes = 0;
+            return 0;
+        }
+        cache->chunk = nchunk;
+        cache->chunk_first = ns;
+        offset = get_chunk_offset(demux, tr, nchunk);
     }
 
-    offset = tr->chunk_offset[nchunk];
     for (; ns < nsample; ns++)
     {
-        offset += tr->entry_size[ns];
+        offset += get_sample_size(demux, tr, ns);
     }
+    cache->sample = ns;
+    cache->offset = offset;
 
-    *frame_bytes = tr->entry_size[ns];
+    *frame_bytes = get_sample_size(demux, tr, ns);
 
-    if (timestamp)
+    if (timestamp || duration)
     {
+        uint64_t ts = 0;
+        unsigned dur = 0;
 #if MP4D_TIMESTAMPS_SUPPORTED
-        *timestamp = tr->timestamp[ns];
-#else
-        *timestamp = 0;
+        sample_time(demux, tr, ns, &ts, &dur);
 #endif
+        if (timestamp)
+            *timestamp = ts;
+        if (duration)
+            *duration = dur;
     }
-    if (duration)
+
+    return offset;
+}
+
+// Exported API function
+MP4D_file_offset_t MP4D_frame_offset(MP4D_demux_t *mp4, unsigned ntrack, unsigned nsample, unsigned *frame_bytes, uint64_t *timestamp, unsigned *duration)
+{
+    MP4D_track_t *tr = mp4->track + ntrack;
+    return frame_offset(mp4, tr, &tr->cache, nsample, frame_bytes, timestamp, duration);
+}
+
+static unsigned get_sync_count(const MP4D_track_t *tr)
+{
+    return tr->sync_sample ? tr->sync_count : tr->lazy_stss.count;
+}
+
+static unsigned get_sync_sample(MP4D_demux_t *mp4, MP4D_track_t *tr, unsigned n)
+{
+    // sample numbers in 'stss' start with 1
+    return tr->sync_sample ? tr->sync_sample[n] : (unsigned)lazy_entry(mp4, &tr->lazy_stss, n) - 1;
+}
+
+/**
+*   Find the 1st sync sample at or after given sample: binary search over sync samples.
+*   return it's position in the sync sample table; number of sync samples if there is none
+*/
+static unsigned find_sync_sample(MP4D_demux_t *mp4, MP4D_track_t *tr, unsigned nsample)
+{
+    unsigned lo = 0, hi = get_sync_count(tr);
+    while (lo < hi)
     {
+        unsigned mid = (lo + hi) >> 1;
+        if (get_sync_sample(mp4, tr, mid) < nsample)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// Exported API function
+int MP4D_is_sync_sample(MP4D_demux_t *mp4, unsigned ntrack, unsigned nsample)
+{
+    MP4D_track_t *tr;
+    unsigned i;
+    if (ntrack >= mp4->track_count)
+        return 0;
+    tr = mp4->track + ntrack;
+    if (!tr->has_sync_table)
+        return 1;
+    i = find_sync_sample(mp4, tr, nsample);
+    return i < get_sync_count(tr) && get_sync_sample(mp4, tr, i) == nsample;
+}
+
 #if MP4D_TIMESTAMPS_SUPPORTED
-        *duration = tr->duration[ns];
-#else
-        *duration = 0;
-#endif
+// Exported API function
+int MP4D_composition_offset(MP4D_demux_t *mp4, unsigned ntrack, unsigned nsample)
+{
+    MP4D_track_t *tr;
+    unsigned sample, offset;
+    uint64_t ts;
+    if (ntrack >= mp4->track_count || nsample >= mp4->track[ntrack].sample_count)
+        return 0;
+    tr = mp4->track + ntrack;
+    if (tr->composition_offset)
+        return nsample < tr->composition_count ? tr->composition_offset[nsample] : 0;
+    if (lazy_find_run(mp4, &tr->lazy_ctts, 0, nsample, &sample, &ts, &offset))
+        return (int)offset;
+    return 0;
+}
+
+/**
+*   Find sample, which decoding time span contains given time: binary search over 'stts' runs.
+*   return sample number; number of samples if time is after the last sample
+*/
+static unsigned find_sample_by_time(MP4D_demux_t *mp4, MP4D_track_t *tr, uint64_t time, uint64_t *timestamp)
+{
+    unsigned sample, delta;
+    uint64_t ts, k;
+    if (tr->time_run_count)
+    {
+        unsigned r = find_time_run(tr, 1, time);
+        const MP4D_time_run_t *run = tr->time_run + r;
+        unsigned end = (r + 1 < tr->time_run_count) ? run[1].sample : tr->sample_count;
+        *timestamp = run->timestamp;
+        if (time < run->timestamp || end <= run->sample)
+            return MINIMP4_MIN(run->sample, tr->sample_count);  // before the 1st sample
+        k = run->delta ? (time - run->timestamp)/run->delta : end - run->sample;
+        if (k >= end - run->sample)
+        {
+            if (r + 1 == tr->time_run_count)
+                return tr->sample_count;
+            k = end - run->sample - 1;  // in the gap before the next run
+        }
+        *timestamp = run->timestamp + k*run->delta;
+        return MINIMP4_MIN(run->sample + (unsigned)k, tr->sample_count);
+    }
+    if (!lazy_find_run(mp4, &tr->lazy_stts, 1, time, &sample, &ts, &delta))
+        return tr->sample_count;
+    k = (time - ts)/delta;  // delta is not 0 in the found run
+    *timestamp = ts + k*delta;
+    return (unsigned)MINIMP4_MIN(sample + k, tr->sample_count);
+}
+
+// Exported API function
+int MP4D_seek(MP4D_demux_t *mp4, unsigned ntrack, uint64_t time, int mode)
+{
+    MP4D_track_t *tr;
+    unsigned nsample, i;
+    uint64_t timestamp = 0;
+    if (ntrack >= mp4->track_count || !mp4->track[ntrack].sample_count)
+        return -1;
+    tr = mp4->track + ntrack;
+    nsample = find_sample_by_time(mp4, tr, time, &timestamp);
+
+    if (mode == MP4D_SEEK_EXACT)
+        return nsample < tr->sample_count ? (int)nsample : -1;
+
+    if (mode == MP4D_SEEK_NEXT_SYNC)
+    {
+        if (nsample < tr->sample_count && timestamp < time)
+            nsample++;  // sample starts before given time
+        if (nsample >= tr->sample_count)
+            return -1;
+        if (!tr->has_sync_table)
+            return nsample;
+        i = find_sync_sample(mp4, tr, nsample);
+        return i < get_sync_count(tr) ? (int)get_sync_sample(mp4, tr, i) : -1;
     }
 
-    return offset;
+    if (nsample >= tr->sample_count)
+        nsample = tr->sample_count - 1;
+    if (!tr->has_sync_table)
+        return nsample;
+    if (!get_sync_count(tr))
+        return -1;
+    i = find_sync_sample(mp4, tr, nsample + 1);   // 1st sync sample after given one
+    return (int)get_sync_sample(mp4, tr, i ? i - 1 : 0);
 }
+#endif
 
 #define FREE(x) if (x) {free(x); x = NULL;}
 
@@ -3294,12 +5125,15 @@ void MP4D_close(MP4D_demux_t *mp4)
         MP4D_track_t *tr = mp4->track + --mp4->track_count;
         FREE(tr->entry_size);
 #if MP4D_TIMESTAMPS_SUPPORTED
-        FREE(tr->timestamp);
-        FREE(tr->duration);
+        FREE(tr->time_run);
+        FREE(tr->composition_offset);
 #endif
         FREE(tr->sample_to_chunk);
         FREE(tr->chunk_offset);
         FREE(tr->dsi);
+        FREE(tr->sync_sample);
+        FREE(tr->lazy_stts.checkpoint);
+        FREE(tr->lazy_ctts.checkpoint);
     }
     FREE(mp4->track);
 #if MP4D_INFO_SUPPORTED
@@ -3310,6 +5144,10 @@ void MP4D_close(MP4D_demux_t *mp4)
     FREE(mp4->tag.comment);
     FREE(mp4->tag.genre);
 #endif
+    FREE(mp4->read_buf);
+    mp4->read_buf_bytes = 0;
+    FREE(mp4->lazy_cache);
+    mp4->lazy_last = NULL;
 }
 
 static int skip_spspps(const unsigned char *p, int nbytes, int nskip)
@@ -3369,6 +5207,853 @@ const void *MP4D_read_pps(const MP4D_demux_t *mp4, unsigned int ntrack, int npps
     return MP4D_read_spspps(mp4, ntrack, 1, npps, pps_bytes);
 }
 
+#if defined(__GNUC__) || defined(__clang__)
+#define MINIMP4_ATOMIC_ADD(p, x) __atomic_add_fetch(p, x, __ATOMIC_ACQ_REL)
+#elif defined(_MSC_VER)
+#include <intrin.h>
+#define MINIMP4_ATOMIC_ADD(p, x) (_InterlockedExchangeAdd((volatile long *)(p), x) + (x))
+#else
+#define MINIMP4_ATOMIC_ADD(p, x) (*(p) += (x))  // not thread-safe
+#endif
+
+// Exported API function
+MP4D_index_t *MP4D_index_create(MP4D_demux_t *mp4)
+{
+    MP4D_index_t *index;
+    if (mp4->lazy_index)
+        return NULL;
+    index = (MP4D_index_t *)malloc(sizeof(MP4D_index_t));
+    if (!index)
+        return NULL;
+    index->demux = *mp4;
+    index->demux.read_callback = NULL;
+    index->demux.token = NULL;
+    index->refcount = 1;
+    memset(mp4, 0, sizeof(MP4D_demux_t));
+    return index;
+}
+
+// Exported API function
+void MP4D_index_retain(MP4D_index_t *index)
+{
+    MINIMP4_ATOMIC_ADD(&index->refcount, 1);
+}
+
+// Exported API function
+void MP4D_index_release(MP4D_index_t *index)
+{
+    if (index && !MINIMP4_ATOMIC_ADD(&index->refcount, -1))
+    {
+        MP4D_close(&index->demux);
+        free(index);
+    }
+}
+
+// Exported API function
+int MP4D_cursor_open(MP4D_cursor_t *cursor, MP4D_index_t *index, int (*read_callback)(int64_t offset, void *buffer, size_t size, void *token), void *token)
+{
+    memset(cursor, 0, sizeof(MP4D_cursor_t));
+    cursor->cache = (MP4D_sample_cache_t *)calloc(index->demux.track_count + 1, sizeof(MP4D_sample_cache_t));
+    if (!cursor->cache)
+        return 0;
+    MP4D_index_retain(index);
+    cursor->index = index;
+    cursor->read_callback = read_callback;
+    cursor->token = token;
+    return 1;
+}
+
+// Exported API function
+MP4D_file_offset_t MP4D_cursor_frame_offset(MP4D_cursor_t *cursor, unsigned ntrack, unsigned nsample, unsigned *frame_bytes, uint64_t *timestamp, unsigned *duration)
+{
+    MP4D_demux_t *demux = &cursor->index->demux;    // only the cursor's cache is changed
+    return frame_offset(demux, demux->track + ntrack, cursor->cache + ntrack, nsample, frame_bytes, timestamp, duration);
+}
+
+// Exported API function
+int MP4D_cursor_read_sample(MP4D_cursor_t *cursor, unsigned ntrack, unsigned nsample, void *buffer, unsigned buffer_bytes)
+{
+    const MP4D_demux_t *demux = &cursor->index->demux;
+    MP4D_file_offset_t offset;
+    unsigned bytes = 0;
+    if (ntrack >= demux->track_count || nsample >= demux->track[ntrack].sample_count)
+        return -1;
+    offset = MP4D_cursor_frame_offset(cursor, ntrack, nsample, &bytes, NULL, NULL);
+    if (bytes > buffer_bytes || cursor->read_callback(offset, buffer, bytes, cursor->token))
+        return -1;
+    return (int)bytes;
+}
+
+// Exported API function
+void MP4D_cursor_close(MP4D_cursor_t *cursor)
+{
+    FREE(cursor->cache);
+    MP4D_index_release(cursor->index);
+    cursor->index = NULL;
+}
+
+// Saved index: magic, version and configuration
+#define MP4D_INDEX_MAGIC    FOUR_CHAR_INT('M', 'P', '4', 'I')
+#define MP4D_INDEX_VERSION  4
+#define MP4D_INDEX_CONFIG   ((MP4D_INFO_SUPPORTED ? 1 : 0) | (MP4D_TIMESTAMPS_SUPPORTED ? 2 : 0))
+
+// Table in the saved index
+enum
+{
+    INDEX_TABLE_NONE,
+    INDEX_TABLE_ARRAY,      // entries follow
+    INDEX_TABLE_LAZY        // table is in the file
+};
+
+typedef struct
+{
+    unsigned char *p;       // NULL: size is counted only
+    size_t bytes;
+} index_writer_t;
+
+typedef struct
+{
+    const unsigned char *p;
+    const unsigned char *end;
+    int error;
+} index_reader_t;
+
+static void index_put(index_writer_t *w, uint64_t x, int bytes)
+{
+    w->bytes += bytes;
+    if (w->p)
+    {
+        while (bytes--)
+            *w->p++ = (unsigned char)(x >> (8*bytes));
+    }
+}
+
+static void index_put_data(index_writer_t *w, const void *data, unsigned bytes)
+{
+    index_put(w, bytes, 4);
+    w->bytes += bytes;
+    if (w->p && bytes)
+    {
+        memcpy(w->p, data, bytes);
+        w->p += bytes;
+    }
+}
+
+/**
+*   Save table of 4-byte or MP4D_file_offset_t entries, or the file position of the table
+*/
+static void index_put_table(index_writer_t *w, const void *data, unsigned count, int offsets, const MP4D_lazy_table_t *lazy)
+{
+    unsigned i;
+    if (data)
+    {
+        index_put(w, INDEX_TABLE_ARRAY, 1);
+        index_put(w, count, 4);
+        for (i = 0; i < count; i++)
+        {
+            if (offsets)
+                index_put(w, ((const MP4D_file_offset_t *)data)[i], 8);
+            else
+                index_put(w, ((const unsigned *)data)[i], 4);
+        }
+    } else if (lazy && lazy->count)
+    {
+        index_put(w, INDEX_TABLE_LAZY, 1);
+        index_put(w, lazy->offset, 8);
+        index_put(w, lazy->count, 4);
+        index_put(w, lazy->entry_bytes, 1);
+        index_put(w, lazy->value, 4);
+    } else
+    {
+        index_put(w, INDEX_TABLE_NONE, 1);
+    }
+}
+
+static uint64_t index_get(index_reader_t *r, int bytes)
+{
+    uint64_t x = 0;
+    if (r->end - r->p < bytes)
+    {
+        r->error = 1;
+        return 0;
+    }
+    while (bytes--)
+        x = (x << 8) | *r->p++;
+    return x;
+}
+
+/**
+*   Restore data saved by index_put_data(); NUL-terminated for tags
+*/
+static unsigned char *index_get_data(index_reader_t *r, unsigned *bytes)
+{
+    unsigned char *data;
+    unsigned n = (unsigned)index_get(r, 4);
+    if (bytes)
+        *bytes = n;
+    if (r->error || !n)
+        return NULL;
+    if ((size_t)(r->end - r->p) < n || !(data = (unsigned char *)malloc(n + 1)))
+    {
+        r->error = 1;
+        return NULL;
+    }
+    memcpy(data, r->p, n);
+    data[n] = 0;
+    r->p += n;
+    return data;
+}
+
+/**
+*   Restore table saved by index_put_table()
+*/
+static void *index_get_table(index_reader_t *r, unsigned *count, int offsets, MP4D_lazy_table_t *lazy)
+{
+    unsigned i, n;
+    void *data;
+    switch (index_get(r, 1))
+    {
+    case INDEX_TABLE_NONE:
+        return NULL;
+    case INDEX_TABLE_LAZY:
+        if (!lazy)
+            break;
+        lazy->offset = (int64_t)index_get(r, 8);
+        lazy->count = (unsigned)index_get(r, 4);
+        lazy->entry_bytes = (unsigned)index_get(r, 1);
+        lazy->value = (unsigned)index_get(r, 4);
+        return NULL;
+    case INDEX_TABLE_ARRAY:
+        n = (unsigned)index_get(r, 4);
+        if (count)
+            *count = n;
+        if (r->error || (size_t)(r->end - r->p)/(offsets ? 8 : 4) < n)
+            break;
+        data = malloc((size_t)n*(offsets ? sizeof(MP4D_file_offset_t) : sizeof(unsigned)) + 1);
+        if (!data)
+            break;
+        for (i = 0; i < n; i++)
+        {
+            if (offsets)
+                ((MP4D_file_offset_t *)data)[i] = (MP4D_file_offset_t)index_get(r, 8);
+            else
+                ((unsigned *)data)[i] = (unsigned)index_get(r, 4);
+        }
+        return data;
+    }
+    r->error = 1;
+    return NULL;
+}
+
+/**
+*   Save sample-to-chunk runs
+*/
+static void index_put_sample_to_chunk(index_writer_t *w, const MP4D_track_t *tr)
+{
+    unsigned i;
+    index_put(w, tr->sample_to_chunk_count, 4);
+    for (i = 0; i < tr->sample_to_chunk_count; i++)
+    {
+        index_put(w, tr->sample_to_chunk[i].first_chunk, 4);
+        index_put(w, tr->sample_to_chunk[i].samples_per_chunk, 4);
+        index_put(w, tr->sample_to_chunk[i].first_sample, 4);
+    }
+}
+
+/**
+*   Restore runs saved by index_put_sample_to_chunk()
+*/
+static void index_get_sample_to_chunk(index_reader_t *r, MP4D_track_t *tr)
+{
+    unsigned i, n = (unsigned)index_get(r, 4);
+    if (r->error || (size_t)(r->end - r->p)/12 < n ||
+        !grow_array((void**)&tr->sample_to_chunk, &tr->sample_to_chunk_capacity, n, sizeof(tr->sample_to_chunk[0])))
+    {
+        r->error = 1;
+        return;
+    }
+    for (i = 0; i < n; i++)
+    {
+        tr->sample_to_chunk[i].first_chunk = (unsigned)index_get(r, 4);
+        tr->sample_to_chunk[i].samples_per_chunk = (unsigned)index_get(r, 4);
+        tr->sample_to_chunk[i].first_sample = (unsigned)index_get(r, 4);
+    }
+    tr->sample_to_chunk_count = n;
+}
+
+#if MP4D_TIMESTAMPS_SUPPORTED
+/**
+*   Save 'stts' runs, or position of the table for lazy index
+*/
+static void index_put_time_runs(index_writer_t *w, const MP4D_track_t *tr)
+{
+    unsigned i;
+    if (!tr->time_run_count)
+    {
+        index_put_table(w, NULL, 0, 0, &tr->lazy_stts);
+        return;
+    }
+    index_put(w, INDEX_TABLE_ARRAY, 1);
+    index_put(w, tr->time_run_count, 4);
+    for (i = 0; i < tr->time_run_count; i++)
+    {
+        index_put(w, tr->time_run[i].sample, 4);
+        index_put(w, tr->time_run[i].delta, 4);
+        index_put(w, tr->time_run[i].timestamp, 8);
+    }
+}
+
+/**
+*   Restore runs saved by index_put_time_runs()
+*/
+static void index_get_time_runs(index_reader_t *r, MP4D_track_t *tr)
+{
+    unsigned i, n;
+    if (r->end - r->p < 1 || *r->p != INDEX_TABLE_ARRAY)
+    {
+        index_get_table(r, NULL, 0, &tr->lazy_stts);
+        return;
+    }
+    r->p++;
+    n = (unsigned)index_get(r, 4);
+    if (r->error || (size_t)(r->end - r->p)/16 < n ||
+        !grow_array((void**)&tr->time_run, &tr->time_run_capacity, n, sizeof(tr->time_run[0])))
+    {
+        r->error = 1;
+        return;
+    }
+    for (i = 0; i < n; i++)
+    {
+        tr->time_run[i].sample = (unsigned)index_get(r, 4);
+        tr->time_run[i].delta = (unsigned)index_get(r, 4);
+        tr->time_run[i].timestamp = index_get(r, 8);
+    }
+    tr->time_run_count = n;
+}
+#endif
+
+/**
+*   Return 1 if restored table, which is not loaded, have valid entry size and lies within 'moov'
+*/
+static int index_check_lazy(const MP4D_demux_t *mp4, const MP4D_lazy_table_t *t, unsigned entry_bytes, unsigned alt_entry_bytes)
+{
+    if (!t->count)
+        return 1;
+    if (t->entry_bytes != entry_bytes && t->entry_bytes != alt_entry_bytes)
+        return 0;
+    return t->offset >= mp4->moov_pos && t->offset <= mp4->moov_pos + mp4->moov_bytes &&
+        (uint64_t)t->count*t->entry_bytes <= (uint64_t)(mp4->moov_pos + mp4->moov_bytes - t->offset);
+}
+
+/**
+*   Check restored tables of the track against it's sample count, so a
+*   corrupted blob can not make lookups read past the tables.
+*   return 1 if the track is consistent
+*/
+static int index_check_track(const MP4D_demux_t *mp4, const MP4D_track_t *tr, unsigned entry_size_count)
+{
+    const MP4D_sample_to_chunk_t *s2c = tr->sample_to_chunk;
+    unsigned i;
+    if (tr->nal_length_bytes > 4)
+        return 0;
+
+    // sample sizes: one for each sample
+    if ((tr->entry_size && entry_size_count != tr->sample_count) ||
+        (tr->lazy_stsz.count && tr->lazy_stsz.count != tr->sample_count) ||
+        !index_check_lazy(mp4, &tr->lazy_stsz, 4, 0))
+        return 0;
+
+    // chunks: sample-to-chunk runs must refer to existing chunks, in order
+    if ((tr->sample_count && !tr->chunk_count) || !index_check_lazy(mp4, &tr->lazy_stco, 4, 8))
+        return 0;
+    for (i = 0; i < tr->sample_to_chunk_count; i++)
+    {
+        if (!s2c[i].first_chunk || s2c[i].first_chunk > tr->chunk_count)
+            return 0;
+        if (i && (s2c[i].first_chunk < s2c[i - 1].first_chunk || s2c[i].first_sample < s2c[i - 1].first_sample))
+            return 0;
+    }
+
+#if MP4D_TIMESTAMPS_SUPPORTED
+    // decoding times: runs start at increasing samples
+    for (i = 0; i < tr->time_run_count; i++)
+    {
+        if (tr->time_run[i].sample >= tr->sample_count || (i && tr->time_run[i].sample <= tr->time_run[i - 1].sample))
+            return 0;
+    }
+    if (!index_check_lazy(mp4, &tr->lazy_stts, 8, 8))
+        return 0;
+
+    // composition offsets: none past the last sample
+    if (tr->composition_count > tr->sample_count || !index_check_lazy(mp4, &tr->lazy_ctts, 8, 8))
+        return 0;
+#endif
+
+    // sync samples: increasing sample numbers
+    if (tr->sync_count > tr->sample_count || !index_check_lazy(mp4, &tr->lazy_stss, 4, 4))
+        return 0;
+    for (i = 0; i < tr->sync_count; i++)
+    {
+        if (tr->sync_sample[i] >= tr->sample_count || (i && tr->sync_sample[i] <= tr->sync_sample[i - 1]))
+            return 0;
+    }
+    return 1;
+}
+
+/**
+*   Checksum of the 'moov' box (FNV-1a), which is the key of the saved index
+*/
+static int moov_checksum(const MP4D_demux_t *mp4, uint64_t *checksum)
+{
+    int64_t pos = mp4->moov_pos, end = mp4->moov_pos + mp4->moov_bytes;
+    uint64_t h = 14695981039346656037ULL;
+    unsigned char *buf;
+    if (mp4->moov_bytes < 8 || end > mp4->read_size)
+        return 0;
+    buf = (unsigned char *)malloc(64*1024);
+    if (!buf)
+        return 0;
+    while (pos < end)
+    {
+        size_t i, bytes = (size_t)MINIMP4_MIN(end - pos, 64*1024);
+        if (mp4->read_callback(pos, buf, bytes, mp4->token))
+        {
+            free(buf);
+            return 0;
+        }
+        if (pos == mp4->moov_pos && (buf[4] != 'm' || buf[5] != 'o' || buf[6] != 'o' || buf[7] != 'v'))
+        {
+            free(buf);
+            return 0;
+        }
+        for (i = 0; i < bytes; i++)
+            h = (h ^ buf[i])*1099511628211ULL;
+        pos += bytes;
+    }
+    free(buf);
+    *checksum = h;
+    return 1;
+}
+
+static void index_put_demux(index_writer_t *w, const MP4D_demux_t *mp4, uint64_t checksum)
+{
+    unsigned i;
+    index_put(w, MP4D_INDEX_MAGIC, 4);
+    index_put(w, MP4D_INDEX_VERSION, 4);
+    index_put(w, MP4D_INDEX_CONFIG, 4);
+    index_put(w, mp4->read_size, 8);
+    index_put(w, mp4->moov_pos, 8);
+    index_put(w, mp4->moov_bytes, 8);
+    index_put(w, checksum, 8);
+    index_put(w, mp4->lazy_index, 1);
+    index_put(w, mp4->track_count, 4);
+#if MP4D_INFO_SUPPORTED
+    index_put(w, mp4->duration, 8);
+    index_put(w, mp4->timescale, 4);
+#define PUT_TAG(name) index_put_data(w, mp4->tag.name, mp4->tag.name ? (unsigned)strlen((const char *)mp4->tag.name) : 0)
+    PUT_TAG(title);
+    PUT_TAG(artist);
+    PUT_TAG(album);
+    PUT_TAG(year);
+    PUT_TAG(comment);
+    PUT_TAG(genre);
+#undef PUT_TAG
+#endif
+    for (i = 0; i < mp4->track_count; i++)
+    {
+        const MP4D_track_t *tr = mp4->track + i;
+        index_put(w, tr->sample_count, 4);
+        index_put_data(w, tr->dsi, tr->dsi ? tr->dsi_bytes : 0);
+        index_put(w, tr->object_type_indication, 4);
+        index_put(w, tr->nal_length_bytes, 1);
+#if MP4D_INFO_SUPPORTED
+        index_put(w, tr->handler_type, 4);
+        index_put(w, tr->duration, 8);
+        index_put(w, tr->timescale, 4);
+        index_put(w, tr->avg_bitrate_bps, 4);
+        index_put(w, ((unsigned)tr->language[0] << 24) | ((unsigned)tr->language[1] << 16) | ((unsigned)tr->language[2] << 8) | tr->language[3], 4);
+        index_put(w, tr->stream_type, 4);
+        index_put(w, tr->SampleDescription.video.width, 4);     // or audio.channelcount
+        index_put(w, tr->SampleDescription.video.height, 4);    // or audio.samplerate_hz
+#endif
+        index_put(w, tr->track_id, 4);
+        index_put(w, tr->default_sample_duration, 4);
+        index_put(w, tr->default_sample_size, 4);
+        index_put(w, tr->default_sample_flags, 4);
+        index_put(w, tr->has_sync_table, 1);
+        index_put_table(w, tr->entry_size, tr->sample_count, 0, &tr->lazy_stsz);
+        index_put_sample_to_chunk(w, tr);
+        index_put_table(w, tr->chunk_offset, tr->chunk_count, 1, &tr->lazy_stco);
+#if MP4D_TIMESTAMPS_SUPPORTED
+        index_put_time_runs(w, tr);
+        index_put_table(w, tr->composition_offset, tr->composition_count, 0, &tr->lazy_ctts);
+#endif
+        index_put_table(w, tr->sync_sample, tr->sync_count, 0, &tr->lazy_stss);
+    }
+}
+
+// Exported API function
+size_t MP4D_save_index(const MP4D_demux_t *mp4, void *blob, size_t blob_bytes)
+{
+    index_writer_t w;
+    uint64_t checksum;
+    if (!moov_checksum(mp4, &checksum))
+        return 0;
+    memset(&w, 0, sizeof(w));
+    index_put_demux(&w, mp4, checksum);     // count size
+    if (blob && blob_bytes >= w.bytes)
+    {
+        w.p = (unsigned char *)blob;
+        w.bytes = 0;
+        index_put_demux(&w, mp4, checksum);
+    }
+    return w.bytes;
+}
+
+// Exported API function
+int MP4D_open_index(MP4D_demux_t *mp4, int (*read_callback)(int64_t offset, void *buffer, size_t size, void *token), void *token, int64_t file_size, const void *blob, size_t blob_bytes)
+{
+    index_reader_t r;
+    uint64_t checksum, saved_checksum;
+    unsigned i, n;
+
+    memset(mp4, 0, sizeof(MP4D_demux_t));
+    mp4->read_callback = read_callback;
+    mp4->token = token;
+    mp4->read_size = file_size;
+    r.p = (const unsigned char *)blob;
+    r.end = r.p + blob_bytes;
+    r.error = 0;
+    if (!blob || index_get(&r, 4) != MP4D_INDEX_MAGIC || index_get(&r, 4) != MP4D_INDEX_VERSION ||
+        index_get(&r, 4) != MP4D_INDEX_CONFIG || (int64_t)index_get(&r, 8) != file_size)
+        return 0;
+    mp4->moov_pos = (int64_t)index_get(&r, 8);
+    mp4->moov_bytes = (int64_t)index_get(&r, 8);
+    saved_checksum = index_get(&r, 8);
+    if (r.error || !moov_checksum(mp4, &checksum) || checksum != saved_checksum)
+        return 0;
+
+    mp4->lazy_index = (int)index_get(&r, 1);
+    n = (unsigned)index_get(&r, 4);
+#if MP4D_INFO_SUPPORTED
+    mp4->duration = index_get(&r, 8);
+    mp4->timescale = (unsigned)index_get(&r, 4);
+    mp4->tag.title = index_get_data(&r, NULL);
+    mp4->tag.artist = index_get_data(&r, NULL);
+    mp4->tag.album = index_get_data(&r, NULL);
+    mp4->tag.year = index_get_data(&r, NULL);
+    mp4->tag.comment = index_get_data(&r, NULL);
+    mp4->tag.genre = index_get_data(&r, NULL);
+#endif
+    if (r.error || (size_t)(r.end - r.p) < (size_t)n)
+    {
+        MP4D_close(mp4);
+        return 0;
+    }
+    mp4->track = (MP4D_track_t *)calloc(n + 1, sizeof(MP4D_track_t));
+    if (!mp4->track)
+    {
+        MP4D_close(mp4);
+        return 0;
+    }
+    for (i = 0; i < n && !r.error; i++)
+    {
+        MP4D_track_t *tr = mp4->track + i;
+        unsigned language, entry_size_count = 0;
+        mp4->track_count = i + 1;   // released by MP4D_close() on error
+        tr->sample_count = (unsigned)index_get(&r, 4);
+        tr->dsi = index_get_data(&r, &tr->dsi_bytes);
+        tr->object_type_indication = (unsigned)index_get(&r, 4);
+        tr->nal_length_bytes = (unsigned)index_get(&r, 1);
+#if MP4D_INFO_SUPPORTED
+        tr->handler_type = (unsigned)index_get(&r, 4);
+        tr->duration = index_get(&r, 8);
+        tr->timescale = (unsigned)index_get(&r, 4);
+        tr->avg_bitrate_bps = (unsigned)index_get(&r, 4);
+        language = (unsigned)index_get(&r, 4);
+        tr->language[0] = (unsigned char)(language >> 24);
+        tr->language[1] = (unsigned char)(language >> 16);
+        tr->language[2] = (unsigned char)(language >> 8);
+        tr->language[3] = (unsigned char)language;
+        tr->stream_type = (unsigned)index_get(&r, 4);
+        tr->SampleDescription.video.width = (unsigned)index_get(&r, 4);
+        tr->SampleDescription.video.height = (unsigned)index_get(&r, 4);
+#else
+        (void)language;
+#endif
+        tr->track_id = (unsigned)index_get(&r, 4);
+        tr->default_sample_duration = (unsigned)index_get(&r, 4);
+        tr->default_sample_size = (unsigned)index_get(&r, 4);
+        tr->default_sample_flags = (unsigned)index_get(&r, 4);
+        tr->has_sync_table = (int)index_get(&r, 1);
+        tr->entry_size = (unsigned *)index_get_table(&r, &entry_size_count, 0, &tr->lazy_stsz);
+        index_get_sample_to_chunk(&r, tr);
+        tr->chunk_offset = (MP4D_file_offset_t *)index_get_table(&r, &tr->chunk_count, 1, &tr->lazy_stco);
+        if (tr->lazy_stco.count)
+            tr->chunk_count = tr->lazy_stco.count;
+#if MP4D_TIMESTAMPS_SUPPORTED
+        index_get_time_runs(&r, tr);
+        tr->composition_offset = (int *)index_get_table(&r, &tr->composition_count, 0, &tr->lazy_ctts);
+#endif
+        tr->sync_sample = (unsigned *)index_get_table(&r, &tr->sync_count, 0, &tr->lazy_stss);
+        tr->sync_capacity = tr->sync_count;
+        if (!r.error && !index_check_track(mp4, tr, entry_size_count))
+            r.error = 1;
+    }
+    if (r.error)
+    {
+        MP4D_close(mp4);
+        return 0;
+    }
+    return 1;
+}
+
+/**
+*   Return size of the NAL unit at given position of AVC sample, after its
+*   length prefix, or -1 if the prefix or the NAL unit is truncated
+*/
+static int64_t transmux_nal_bytes(const unsigned char *p, unsigned pos, unsigned bytes, unsigned length_bytes)
+{
+    unsigned i, nal_bytes = 0;
+    if (bytes - pos < length_bytes)
+        return -1;
+    for (i = 0; i < length_bytes; i++)
+        nal_bytes = (nal_bytes << 8) | p[pos + i];
+    return nal_bytes > bytes - pos - length_bytes ? -1 : (int64_t)nal_bytes;
+}
+
+/**
+*   Return 1 if AVC sample contains IDR slice
+*/
+static int transmux_is_idr(const unsigned char *p, unsigned bytes, unsigned length_bytes)
+{
+    unsigned pos = 0;
+    while (pos < bytes)
+    {
+        int64_t nal_bytes = transmux_nal_bytes(p, pos, bytes, length_bytes);
+        if (nal_bytes < 0)
+            break;
+        if (nal_bytes && (p[pos + length_bytes] & 31) == 5)
+            return 1;
+        pos += length_bytes + (unsigned)nal_bytes;
+    }
+    return 0;
+}
+
+/**
+*   Write AVC sample with start codes in place of NAL unit length prefixes;
+*   nothing is written if a NAL unit is truncated
+*/
+static int transmux_write_annexb(const unsigned char *p, unsigned bytes, unsigned length_bytes,
+    int (*write_callback)(int64_t offset, const void *buffer, size_t size, void *token), void *token, int64_t *pos)
+{
+    static const unsigned char start_code[4] = { 0, 0, 0, 1 };
+    unsigned i;
+    int64_t nal_bytes;
+    for (i = 0; i < bytes; i += length_bytes + (unsigned)nal_bytes)
+    {
+        if ((nal_bytes = transmux_nal_bytes(p, i, bytes, length_bytes)) < 0)
+            return MP4E_STATUS_BAD_ARGUMENTS;
+    }
+    for (i = 0; i < bytes; i += length_bytes + (unsigned)nal_bytes)
+    {
+        nal_bytes = transmux_nal_bytes(p, i, bytes, length_bytes);
+        if (write_callback(*pos, start_code, 4, token) || write_callback(*pos + 4, p + i + length_bytes, (size_t)nal_bytes, token))
+            return MP4E_STATUS_FILE_WRITE_ERROR;
+        *pos += 4 + nal_bytes;
+    }
+    return MP4E_STATUS_OK;
+}
+
+/**
+*   Write SPS or PPS list of the track with start codes
+*/
+static int transmux_write_spspps(const MP4D_demux_t *mp4, int ntrack, int pps_flag,
+    int (*write_callback)(int64_t offset, const void *buffer, size_t size, void *token), void *token, int64_t *pos)
+{
+    static const unsigned char start_code[4] = { 0, 0, 0, 1 };
+    const void *p;
+    int i, bytes;
+    for (i = 0; (p = pps_flag ? MP4D_read_pps(mp4, ntrack, i, &bytes) : MP4D_read_sps(mp4, ntrack, i, &bytes)); i++)
+    {
+        if (write_callback(*pos, start_code, 4, token) || write_callback(*pos + 4, p, bytes, token))
+            return MP4E_STATUS_FILE_WRITE_ERROR;
+        *pos += 4 + bytes;
+    }
+    return MP4E_STATUS_OK;
+}
+
+int mp4_transmux(int (*read_callback)(int64_t offset, void *buffer, size_t size, void *token), void *read_token, int64_t file_size,
+    int (*write_callback)(int64_t offset, const void *buffer, size_t size, void *token), void *write_token, int mode)
+{
+    MP4D_demux_t mp4;
+    MP4E_mux_t *mux = NULL;
+    int *map = NULL;                // output track of each input track, -1 if skipped
+    unsigned *next = NULL;          // next sample of each input track
+    unsigned char *buf = NULL;
+    unsigned buf_bytes = 0, ntrack;
+    int64_t pos = 0;
+    int err = MP4E_STATUS_OK, annexb_track = -1;
+
+    if (!MP4D_open_ex(&mp4, read_callback, read_token, file_size, MP4D_OPEN_LAZY_INDEX))
+        return MP4E_STATUS_BAD_ARGUMENTS;
+
+    map  = (int *)malloc(mp4.track_count*sizeof(map[0]) + 1);
+    next = (unsigned *)calloc(mp4.track_count + 1, sizeof(next[0]));
+    if (!map || !next)
+    {
+        err = MP4E_STATUS_NO_MEMORY;
+        goto exit;
+    }
+    if (mode == MP4_TRANSMUX_FMP4)
+    {
+        mux = MP4E_open(0, 1, write_token, write_callback);
+        if (!mux)
+        {
+            err = MP4E_STATUS_NO_MEMORY;
+            goto exit;
+        }
+    }
+
+    for (ntrack = 0; ntrack < mp4.track_count; ntrack++)
+    {
+        const MP4D_track_t *tr = mp4.track + ntrack;
+        int is_avc = tr->object_type_indication == MP4_OBJECT_TYPE_AVC;
+        map[ntrack] = -1;
+        if (mode == MP4_TRANSMUX_ANNEXB)
+        {
+            if (is_avc && annexb_track < 0 && tr->nal_length_bytes)
+                map[ntrack] = annexb_track = ntrack;
+        } else if (tr->timescale && (is_avc || (tr->handler_type != MP4D_HANDLER_TYPE_VIDE && tr->dsi)))
+        {
+            // other video codecs keep parameter sets in sample entries, which are not parsed;
+            // a zero time scale would divide by zero in the output index
+            MP4E_track_t t;
+            memset(&t, 0, sizeof(t));
+            memcpy(t.language, tr->language, 4);
+            t.object_type_indication = tr->object_type_indication;
+            t.time_scale = tr->timescale;
+            if (tr->handler_type == MP4D_HANDLER_TYPE_VIDE)
+            {
+                t.track_media_kind = e_video;
+                t.u.v.width  = tr->SampleDescription.video.width;
+                t.u.v.height = tr->SampleDescription.video.height;
+            } else if (tr->handler_type == MP4D_HANDLER_TYPE_SOUN)
+            {
+                t.track_media_kind = e_audio;
+                t.u.a.channelcount = tr->SampleDescription.audio.channelcount;
+            } else
+            {
+                t.track_media_kind = e_private;
+            }
+            map[ntrack] = MP4E_add_track(mux, &t);
+            if (map[ntrack] < 0)
+            {
+                err = map[ntrack];
+                goto exit;
+            }
+            if (is_avc)
+            {
+                const void *p;
+                int i, bytes;
+                for (i = 0; (p = MP4D_read_sps(&mp4, ntrack, i, &bytes)); i++)
+                    MP4E_set_sps(mux, map[ntrack], p, bytes);
+                for (i = 0; (p = MP4D_read_pps(&mp4, ntrack, i, &bytes)); i++)
+                    MP4E_set_pps(mux, map[ntrack], p, bytes);
+            } else if ((err = MP4E_set_dsi(mux, map[ntrack], tr->dsi, tr->dsi_bytes)) != MP4E_STATUS_OK)
+            {
+                goto exit;
+            }
+        }
+    }
+    if (mode == MP4_TRANSMUX_ANNEXB && annexb_track < 0)
+    {
+        err = MP4E_STATUS_BAD_ARGUMENTS;
+        goto exit;
+    }
+
+    for (;;)
+    {
+        // next sample in file order
+        MP4D_file_offset_t offset = 0, sample_offset;
+        unsigned bytes = 0, sample_bytes, duration;
+        uint64_t timestamp;
+        int best = -1, kind;
+        for (ntrack = 0; ntrack < mp4.track_count; ntrack++)
+        {
+            if (map[ntrack] < 0 || next[ntrack] >= mp4.track[ntrack].sample_count)
+                continue;
+            sample_offset = MP4D_frame_offset(&mp4, ntrack, next[ntrack], &sample_bytes, NULL, NULL);
+            if (best < 0 || sample_offset < offset)
+            {
+                best = ntrack;
+                offset = sample_offset;
+                bytes = sample_bytes;
+            }
+        }
+        if (best < 0)
+            break;
+        MP4D_frame_offset(&mp4, best, next[best], &bytes, &timestamp, &duration);
+        next[best]++;
+
+        if (bytes > buf_bytes)
+        {
+            unsigned char *p = (unsigned char *)realloc(buf, bytes);
+            if (!p)
+            {
+                err = MP4E_STATUS_NO_MEMORY;
+                goto exit;
+            }
+            buf = p;
+            buf_bytes = bytes;
+        }
+        if (read_callback(offset, buf, bytes, read_token))
+        {
+            err = MP4E_STATUS_BAD_ARGUMENTS;
+            goto exit;
+        }
+        if (mp4.track[best].has_sync_table)
+            kind = MP4D_is_sync_sample(&mp4, best, next[best] - 1) ? MP4E_SAMPLE_RANDOM_ACCESS : MP4E_SAMPLE_DEFAULT;
+        else if (mp4.track[best].object_type_indication == MP4_OBJECT_TYPE_AVC)
+            kind = transmux_is_idr(buf, bytes, mp4.track[best].nal_length_bytes) ? MP4E_SAMPLE_RANDOM_ACCESS : MP4E_SAMPLE_DEFAULT;
+        else
+            kind = MP4E_SAMPLE_RANDOM_ACCESS;
+
+        if (mode == MP4_TRANSMUX_FMP4)
+        {
+            int composition_offset = 0;
+#if MP4D_TIMESTAMPS_SUPPORTED
+            composition_offset = MP4D_composition_offset(&mp4, best, next[best] - 1);
+#endif
+            if ((err = MP4E_put_sample_ex(mux, map[best], buf, bytes, duration, kind, composition_offset)) != MP4E_STATUS_OK)
+                goto exit;
+        } else
+        {
+            if (kind == MP4E_SAMPLE_RANDOM_ACCESS)
+            {
+                if ((err = transmux_write_spspps(&mp4, best, 0, write_callback, write_token, &pos)) != MP4E_STATUS_OK ||
+                    (err = transmux_write_spspps(&mp4, best, 1, write_callback, write_token, &pos)) != MP4E_STATUS_OK)
+                    goto exit;
+            }
+            if ((err = transmux_write_annexb(buf, bytes, mp4.track[best].nal_length_bytes, write_callback, write_token, &pos)) != MP4E_STATUS_OK)
+                goto exit;
+        }
+    }
+
+exit:
+    if (mux)
+    {
+        int close_err = MP4E_close(mux);
+        if (err == MP4E_STATUS_OK)
+            err = close_err;
+    }
+    free(buf);
+    free(next);
+    free(map);
+    MP4D_close(&mp4);
+    return err;
+}
+
 #if MP4D_PRINT_INFO_SUPPORTED
 /************************************************************************/
 /*  Purely informational part, may be removed for embedded applications */
@@ -3468,7 +6153,7 @@ No|type|lng| duration           | bitrate| Stream type            | Object type
 void MP4D_printf_info(const MP4D_demux_t *mp4)
 {
     unsigned i;
-    printf("\nMP4 FILE: %d tracks found. Movie time %.2f sec\n", mp4->track_count, (4294967296.0*mp4->duration_hi + mp4->duration_lo) / mp4->timescale);
+    printf("\nMP4 FILE: %d tracks found. Movie time %.2f sec\n", mp4->track_count, (double)mp4->duration / mp4->timescale);
 #define STR_TAG(name) if (mp4->tag.name)  printf("%10s = %s\n", #name, mp4->tag.name)
     STR_TAG(title);
     STR_TAG(artist);
@@ -3484,7 +6169,7 @@ void MP4D_printf_info(const MP4D_demux_t *mp4)
         printf("\n%2d|%c%c%c%c|%c%c%c|%7.2f s %6d frm| %7d|", i,
             (tr->handler_type >> 24), (tr->handler_type >> 16), (tr->handler_type >> 8), (tr->handler_type >> 0),
             tr->language[0], tr->language[1], tr->language[2],
-            (65536.0*65536.0*tr->duration_hi + tr->duration_lo) / tr->timescale,
+            (double)tr->duration / tr->timescale,
             tr->sample_count,
             tr->avg_bitrate_bps);
 
@@ -0,0 +1,306 @@
+#define MINIMP4_IMPLEMENTATION
+#include "minimp4.h"
+#define VIDEO_FPS 24
+
+// Demuxer check: mux an h264 elementary stream in memory, then compare sample
+// lookups of the full index, lazy index, index restored from MP4D_save_index()
+// and shared index cursor.
+
+typedef struct
+{
+    uint8_t *buffer;
+    int64_t size;
+    int64_t capacity;
+} MEMORY_FILE;
+
+static uint8_t *preload(const char *path, int32_t *data_size)
+{
+    FILE *file = fopen(path, "rb");
+    uint8_t *data;
+    *data_size = 0;
+    if (!file)
+        return 0;
+    if (fseek(file, 0, SEEK_END))
+        exit(1);
+    *data_size = (int32_t)ftell(file);
+    if (*data_size < 0)
+        exit(1);
+    if (fseek(file, 0, SEEK_SET))
+        exit(1);
+    data = (unsigned char*)malloc(*data_size);
+    if (!data)
+        exit(1);
+    if ((int32_t)fread(data, 1, *data_size, file) != *data_size)
+        exit(1);
+    fclose(file);
+    return data;
+}
+
+static int32_t get_nal_size(uint8_t *buf, int32_t size)
+{
+    int32_t pos = 3;
+    while ((size - pos) > 3)
+    {
+        if (buf[pos] == 0 && buf[pos + 1] == 0 && buf[pos + 2] == 1)
+            return pos;
+        if (buf[pos] == 0 && buf[pos + 1] == 0 && buf[pos + 2] == 0 && buf[pos + 3] == 1)
+            return pos;
+        pos++;
+    }
+    return size;
+}
+
+static int write_callback(int64_t offset, const void *buffer, size_t size, void *token)
+{
+    MEMORY_FILE *f = (MEMORY_FILE*)token;
+    if (offset + (int64_t)size > f->capacity)
+    {
+        int64_t capacity = f->capacity*2 + (int64_t)size + 4096;
+        uint8_t *p = (uint8_t*)realloc(f->buffer, (size_t)capacity);
+        if (!p)
+            return 1;
+        f->buffer = p;
+        f->capacity = capacity;
+    }
+    memcpy(f->buffer + offset, buffer, size);
+    if (offset + (int64_t)size > f->size)
+        f->size = offset + (int64_t)size;
+    return 0;
+}
+
+static int read_callback(int64_t offset, void *buffer, size_t size, void *token)
+{
+    MEMORY_FILE *f = (MEMORY_FILE*)token;
+    if (offset < 0 || offset + (int64_t)size > f->size)
+        return 1;
+    memcpy(buffer, f->buffer + offset, size);
+    return 0;
+}
+
+static int mux(MEMORY_FILE *mp4, uint8_t *buf_h264, int32_t h264_size, int sequential_mode, int fragmentation_mode)
+{
+    MP4E_mux_t *mux;
+    mp4_h26x_writer_t mp4wr;
+    memset(mp4, 0, sizeof(*mp4));
+    mux = MP4E_open(sequential_mode, fragmentation_mode, mp4, write_callback);
+    if (MP4E_STATUS_OK != mp4_h26x_write_init(&mp4wr, mux, 352, 288, 0))
+        return 0;
+    while (h264_size > 0)
+    {
+        int32_t nal_size = get_nal_size(buf_h264, h264_size);
+        if (nal_size < 4)
+        {
+            buf_h264  += 1;
+            h264_size -= 1;
+            continue;
+        }
+        if (MP4E_STATUS_OK != mp4_h26x_write_nal(&mp4wr, buf_h264, nal_size, 90000/VIDEO_FPS))
+            return 0;
+        buf_h264  += nal_size;
+        h264_size -= nal_size;
+    }
+    MP4E_close(mux);
+    mp4_h26x_write_close(&mp4wr);
+    return 1;
+}
+
+static int check(const char *name, const char *what, unsigned ntrack, unsigned nsample, int64_t expected, int64_t actual)
+{
+    if (expected == actual)
+        return 0;
+    printf("error: %s: %s of track %u sample %u is %lld, expected %lld\n", name, what, ntrack, nsample, (long long)actual, (long long)expected);
+    return 1;
+}
+
+// compare every lookup of the demuxer against the full index
+static int compare(const char *name, MP4D_demux_t *expected, MP4D_demux_t *actual, MP4D_cursor_t *cursor)
+{
+    static const int modes[] = { MP4D_SEEK_PREVIOUS_SYNC, MP4D_SEEK_NEXT_SYNC, MP4D_SEEK_EXACT };
+    unsigned ntrack, i;
+    int errors = 0, m;
+    if (expected->track_count != actual->track_count)
+    {
+        printf("error: %s: %u tracks, expected %u\n", name, actual->track_count, expected->track_count);
+        return 1;
+    }
+    for (ntrack = 0; ntrack < expected->track_count && !errors; ntrack++)
+    {
+        MP4D_track_t *tr = expected->track + ntrack;
+        uint64_t end = 0, time;
+        errors += check(name, "sample count", ntrack, 0, tr->sample_count, actual->track[ntrack].sample_count);
+        for (i = 0; i < tr->sample_count && !errors; i++)
+        {
+            unsigned bytes, actual_bytes, duration, actual_duration;
+            uint64_t timestamp, actual_timestamp;
+            MP4D_file_offset_t ofs = MP4D_frame_offset(expected, ntrack, i, &bytes, &timestamp, &duration);
+            MP4D_file_offset_t actual_ofs = cursor ?
+                MP4D_cursor_frame_offset(cursor, ntrack, i, &actual_bytes, &actual_timestamp, &actual_duration) :
+                MP4D_frame_offset(actual, ntrack, i, &actual_bytes, &actual_timestamp, &actual_duration);
+            errors += check(name, "offset", ntrack, i, ofs, actual_ofs);
+            errors += check(name, "size", ntrack, i, bytes, actual_bytes);
+            errors += check(name, "timestamp", ntrack, i, timestamp, actual_timestamp);
+            errors += check(name, "duration", ntrack, i, duration, actual_duration);
+            errors += check(name, "sync", ntrack, i, MP4D_is_sync_sample(expected, ntrack, i), MP4D_is_sync_sample(actual, ntrack, i));
+            errors += check(name, "composition offset", ntrack, i, MP4D_composition_offset(expected, ntrack, i), MP4D_composition_offset(actual, ntrack, i));
+            end = timestamp + duration;
+        }
+        // probe every frame boundary and the middle of each frame, in reverse
+        // order, so that the lookups do not follow the sample cache
+        for (time = end + 1; time-- > 0 && !errors; )
+        {
+            if (tr->sample_count && time % ((end/tr->sample_count)/2 + 1))
+                continue;
+            for (m = 0; m < 3; m++)
+                errors += check(name, "seek", ntrack, (unsigned)time, MP4D_seek(expected, ntrack, time, modes[m]), MP4D_seek(actual, ntrack, time, modes[m]));
+        }
+    }
+    return errors;
+}
+
+static int test_file(const char *name, MEMORY_FILE *file)
+{
+    MP4D_demux_t eager, lazy, restored, restored_lazy, shared;
+    MP4D_index_t *index;
+    MP4D_cursor_t cursor;
+    size_t blob_bytes, lazy_blob_bytes;
+    void *blob, *lazy_blob;
+    char label[64];
+    int errors = 0;
+
+    if (!MP4D_open(&eager, read_callback, file, file->size) ||
+        !MP4D_open_ex(&lazy, read_callback, file, file->size, MP4D_OPEN_LAZY_INDEX))
+    {
+        printf("error: %s: can't open mp4 file\n", name);
+        return 1;
+    }
+    if (!eager.track_count || !eager.track[0].sample_count)
+    {
+        printf("error: %s: no samples\n", name);
+        return 1;
+    }
+
+    blob_bytes = MP4D_save_index(&eager, NULL, 0);
+    lazy_blob_bytes = MP4D_save_index(&lazy, NULL, 0);
+    blob = malloc(blob_bytes);
+    lazy_blob = malloc(lazy_blob_bytes);
+    if (!blob_bytes || !lazy_blob_bytes ||
+        MP4D_save_index(&eager, blob, blob_bytes) != blob_bytes ||
+        MP4D_save_index(&lazy, lazy_blob, lazy_blob_bytes) != lazy_blob_bytes ||
+        !MP4D_open_index(&restored, read_callback, file, file->size, blob, blob_bytes) ||
+        !MP4D_open_index(&restored_lazy, read_callback, file, file->size, lazy_blob, lazy_blob_bytes))
+    {
+        printf("error: %s: can't save or restore index\n", name);
+        return 1;
+    }
+    // index of another file size must be rejected
+    if (MP4D_open_index(&shared, read_callback, file, file->size - 1, blob, blob_bytes))
+    {
+        printf("error: %s: stale index restored\n", name);
+        MP4D_close(&shared);
+        errors++;
+    }
+
+    if (!MP4D_open(&shared, read_callback, file, file->size) ||
+        !(index = MP4D_index_create(&shared)) ||
+        !MP4D_cursor_open(&cursor, index, read_callback, file))
+    {
+        printf("error: %s: can't create shared index\n", name);
+        return 1;
+    }
+    MP4D_index_release(index);
+
+    sprintf(label, "%s lazy", name);
+    errors += compare(label, &eager, &lazy, NULL);
+    sprintf(label, "%s restored", name);
+    errors += compare(label, &eager, &restored, NULL);
+    sprintf(label, "%s restored lazy", name);
+    errors += compare(label, &eager, &restored_lazy, NULL);
+    sprintf(label, "%s cursor", name);
+    errors += compare(label, &eager, &index->demux, &cursor);
+
+    MP4D_cursor_close(&cursor);
+    MP4D_close(&restored_lazy);
+    MP4D_close(&restored);
+    MP4D_close(&lazy);
+    MP4D_close(&eager);
+    free(lazy_blob);
+    free(blob);
+    if (!errors)
+        printf("%s: OK\n", name);
+    return errors;
+}
+
+int main(int argc, char **argv)
+{
+    MEMORY_FILE mp4, fmp4, sequential, fragmented;
+    int errors = 0;
+    if (argc < 2)
+    {
+        printf("Usage: minimp4_test-demux input.264\n");
+        return 0;
+    }
+    int32_t h264_size;
+    uint8_t *buf_h264 = preload(argv[1], &h264_size);
+    if (!buf_h264)
+    {
+        printf("error: can't open h264 file\n");
+        exit(1);
+    }
+
+    if (!mux(&mp4, buf_h264, h264_size, 0, 0) || !mux(&sequential, buf_h264, h264_size, 1, 0) ||
+        !mux(&fragmented, buf_h264, h264_size, 0, 1))
+    {
+        printf("error: mux failed\n");
+        exit(1);
+    }
+    errors += test_file("mp4", &mp4);
+    errors += test_file("sequential", &sequential);
+    errors += test_file("fragmented", &fragmented);
+
+    // transmuxed file must have the same samples
+    memset(&fmp4, 0, sizeof(fmp4));
+    if (MP4E_STATUS_OK != mp4_transmux(read_callback, &mp4, mp4.size, write_callback, &fmp4, MP4_TRANSMUX_FMP4))
+    {
+        printf("error: transmux failed\n");
+        errors++;
+    } else
+    {
+        MP4D_demux_t a, b;
+        unsigned i;
+        errors += test_file("transmuxed", &fmp4);
+        if (MP4D_open(&a, read_callback, &mp4, mp4.size) && MP4D_open(&b, read_callback, &fmp4, fmp4.size))
+        {
+            for (i = 0; i < a.track[0].sample_count; i++)
+            {
+                unsigned bytes, fmp4_bytes, duration, fmp4_duration;
+                uint64_t timestamp, fmp4_timestamp;
+                MP4D_file_offset_t ofs = MP4D_frame_offset(&a, 0, i, &bytes, &timestamp, &duration);
+                MP4D_file_offset_t fmp4_ofs = MP4D_frame_offset(&b, 0, i, &fmp4_bytes, &fmp4_timestamp, &fmp4_duration);
+                if (check("transmuxed", "size", 0, i, bytes, fmp4_bytes) ||
+                    check("transmuxed", "timestamp", 0, i, timestamp, fmp4_timestamp) ||
+                    check("transmuxed", "duration", 0, i, duration, fmp4_duration) ||
+                    check("transmuxed", "data", 0, i, 0, memcmp(mp4.buffer + ofs, fmp4.buffer + fmp4_ofs, bytes)))
+                {
+                    errors++;
+                    break;
+                }
+            }
+            MP4D_close(&b);
+            MP4D_close(&a);
+        } else
+        {
+            printf("error: can't open transmuxed file\n");
+            errors++;
+        }
+    }
+
+    free(fmp4.buffer);
+    free(fragmented.buffer);
+    free(sequential.buffer);
+    free(mp4.buffer);
+    free(buf_h264);
+    if (errors)
+        return 1;
+    printf("OK\n");
+    return 0;
+}
@@ -1,354 +1,507 @@
+#include <emscripten.h>
 #include <emscripten/bind.h>
 #include <emscripten/val.h>
 
-#define ALIGNED_ALLOC(n, size) aligned_alloc(n, (size + n - 1) / n * n)
-#define TIMESCALE 90000
-
-#define H264E_MAX_THREADS 0
-
-#ifdef EMSCRIPTEN_SIMD_ENABLED
-  #define MINIH264_ONLY_SIMD 1
-  #define H264E_ENABLE_NEON 0
-#endif
-
-#define MINIH264_IMPLEMENTATION
-#define MINIMP4_IMPLEMENTATION
-
 #include <string>
+#include <vector>
 #include <stdint.h>
-#include <functional>
+#include <stdlib.h>
+#include <string.h>
 
-// Removed due to patent concerns
-// #include "minih264e.h"
+#include "mp4core.h"
 
-#include "minimp4.h"
+// Emscripten bindings: converts JS options and callbacks for the C API in mp4core.h
 
 using namespace emscripten;
 
-typedef struct MP4Muxer {
-  MP4E_mux_t *mux = nullptr;
-  mp4_h26x_writer_t writer;
-  float fps;
-  std::function<int(const void *buffer, size_t size, int64_t offset)> callback;
-} MP4Muxer;
-
-typedef struct Encoder {
-  uint32_t width;
-  uint32_t height;
-  bool rgb_flip_y;
+bool option_exists (val options, std::string key)
+{
+  return options[key].typeOf().as<std::string>() != "undefined";
+}
 
-  H264E_io_yuv_t yuv_planes;
-  H264E_run_param_t run_param;
+// JS callbacks are held by the muxer or demuxer as token, and deleted with it
+static int js_write (int64_t offset, const void *buffer, size_t size, void *token)
+{
+  val &write_fn = *(val *)token;
+  return write_fn(
+    val((uintptr_t)buffer),
+    val((uint32_t)size),
+    val((double)offset)
+  ).as<int>();
+}
 
-  uint32_t muxer_handle;
+static int js_read (int64_t offset, void *buffer, size_t size, void *token)
+{
+  val &read_fn = *(val *)token;
+  return read_fn(
+    val((uintptr_t)buffer),
+    val((uint32_t)size),
+    val((double)offset)
+  ).as<int>();
+}
 
-  H264E_persist_t *enc = nullptr;
-  H264E_scratch_t *scratch = nullptr;
-} Encoder;
+static int js_drain (const mp4_output_extent_t *extents, size_t count, void *token)
+{
+  val &write_fn = *(val *)token;
+  return write_fn(
+    val((uintptr_t)extents),
+    val((uint32_t)count)
+  ).as<int>();
+}
 
+static void js_release (void *token)
+{
+  delete (val *)token;
+}
 
-static std::map<uint32_t, Encoder*> mapEncoder;
-static uint32_t mapEncoderHandle = 1;
+// times are given in milliseconds (e.g. performance.now()) and stored in microseconds
+static void _read_frame_info (val options, mp4_frame_info_t *info)
+{
+  memset(info, 0, sizeof(*info));
+  if (options["frame"].isNumber())
+  {
+    info->frame = options["frame"].as<uint32_t>();
+    info->flags |= MP4_FRAME_INFO_FRAME;
+  }
+  if (options["captureTime"].isNumber())
+  {
+    info->capture_us = (uint64_t)(options["captureTime"].as<double>() * 1000.0);
+    info->flags |= MP4_FRAME_INFO_CAPTURE;
+  }
+  if (options["renderTime"].isNumber())
+  {
+    info->render_us = (uint32_t)(options["renderTime"].as<double>() * 1000.0);
+    info->flags |= MP4_FRAME_INFO_RENDER;
+  }
+  if (options["encodeTime"].isNumber())
+  {
+    info->encode_us = (uint32_t)(options["encodeTime"].as<double>() * 1000.0);
+    info->flags |= MP4_FRAME_INFO_ENCODE;
+  }
+  // hash is either a Number or a BigInt for full 64 bits
+  if (options["hash"].isNumber())
+  {
+    info->hash = (uint64_t)options["hash"].as<double>();
+    info->flags |= MP4_FRAME_INFO_HASH;
+  }
+  else if (options["hash"].typeOf().as<std::string>() == "bigint")
+  {
+    info->hash = strtoull(options["hash"].call<std::string>("toString").c_str(), nullptr, 10);
+    info->flags |= MP4_FRAME_INFO_HASH;
+  }
+}
 
-static std::map<uint32_t, MP4Muxer*> mapMuxer;
-static uint32_t mapMuxerHandle = 1;
+void mux_nal (uint32_t muxer_handle, uintptr_t nalu_ptr, int nalu_size)
+{
+  mp4_mux_nal(muxer_handle, reinterpret_cast<const uint8_t*>(nalu_ptr), nalu_size);
+}
 
-static void _write_nal (MP4Muxer *muxer, const uint8_t *data, size_t size)
+int add_audio_track (uint32_t muxer_handle, val options)
 {
-  mp4_h26x_write_nal(&muxer->writer, data, size, TIMESCALE/(muxer->fps));
+  uint32_t sampleRate = options["sampleRate"].isNumber() ? options["sampleRate"].as<uint32_t>() : 44100;
+  uint32_t channels = options["channels"].isNumber() ? options["channels"].as<uint32_t>() : 2;
+
+  // AudioSpecificConfig is optional when ADTS frames are muxed
+  std::vector<uint8_t> config;
+  if (option_exists(options, "config")) config = vecFromJSArray<uint8_t>(options["config"]);
+
+  #ifdef DEBUG
+  printf("Audio Options ---\n");
+  printf("sampleRate=%d\n", sampleRate);
+  printf("channels=%d\n", channels);
+  printf("config=%d bytes\n", (int)config.size());
+  printf("\n");
+  #endif
+
+  return mp4_add_audio_track(muxer_handle, sampleRate, channels, config.data(), config.size());
 }
 
-static void nalu_callback (const uint8_t *nalu_data, int sizeof_nalu_data, void *token)
+int add_metadata_track (uint32_t muxer_handle, val options)
 {
-  MP4Muxer *muxer = (MP4Muxer *)token;
+  uint32_t timescale = options["timescale"].isNumber() ? options["timescale"].as<uint32_t>() : 0;
 
-  uint8_t *data = const_cast<uint8_t *>(nalu_data - STARTCODE_4BYTES);
-  const int nal_size = sizeof_nalu_data + STARTCODE_4BYTES;
+  // without config the track holds frame info samples
+  if (!option_exists(options, "config")) return mp4_add_metadata_track(muxer_handle, timescale, nullptr, 0);
+  static const uint8_t empty = 0;
+  std::vector<uint8_t> config = vecFromJSArray<uint8_t>(options["config"]);
+  return mp4_add_metadata_track(muxer_handle, timescale, config.empty() ? &empty : config.data(), config.size());
+}
 
-  // HME_CHECK_INTERNAL(nal_size >= 5);
-  // HME_CHECK_INTERNAL(data[0] == 0 && data[1] == 0 && data[2] == 0 && data[3] == 1);
+int mux_metadata (uint32_t muxer_handle, uintptr_t data_ptr, int data_size, int duration)
+{
+  return mp4_mux_metadata(muxer_handle, reinterpret_cast<const uint8_t*>(data_ptr), data_size, duration);
+}
 
-  // TODO check status MP4E_STATUS_OK
-  _write_nal(muxer, data, nal_size);
+int mux_frame_info (uint32_t muxer_handle, val options)
+{
+  mp4_frame_info_t info;
+  _read_frame_info(options, &info);
+  return mp4_mux_frame_info(muxer_handle, &info);
 }
 
-static int write_callback (int64_t offset, const void *buffer, size_t size, void *token)
+int mux_aac (uint32_t muxer_handle, uintptr_t data_ptr, int data_size)
 {
-  MP4Muxer *muxer = (MP4Muxer *)token;
-  uint8_t *data = (uint8_t*)(buffer);
-  return muxer->callback(
-    data,
-    (uint32_t)size,
-    (uint32_t)offset
-  );
+  return mp4_mux_aac(muxer_handle, reinterpret_cast<const uint8_t*>(data_ptr), data_size);
 }
 
-void mux_nal (uint32_t muxer_handle, uintptr_t nalu_ptr, int nalu_size)
+uintptr_t get_input_buffer (uint32_t muxer_handle, uint32_t size)
 {
-  MP4Muxer* muxer = mapMuxer[muxer_handle];
-  uint8_t* data = reinterpret_cast<uint8_t*>(nalu_ptr);
-  _write_nal(muxer, data, nalu_size);
+  return reinterpret_cast<uintptr_t>(mp4_get_input_buffer(muxer_handle, size));
 }
 
-bool option_exists (val options, std::string key)
+uintptr_t get_batch_table (uint32_t muxer_handle, uint32_t count)
 {
-  return options[key].typeOf().as<std::string>() != "undefined";
+  return reinterpret_cast<uintptr_t>(mp4_get_batch_table(muxer_handle, count));
+}
+
+int mux_batch (uint32_t muxer_handle, uint32_t count)
+{
+  return mp4_mux_batch(muxer_handle, count);
 }
 
 uint32_t create_muxer(val options, val write_fn)
 {
-  uint32_t width = options["width"].as<uint32_t>();
-  uint32_t height = options["height"].as<uint32_t>();
-  float fps = options["fps"].isNumber() ? options["fps"].as<float>() : 30.0f;
-  int fragmentation = options["fragmentation"].isTrue() ? 1 : 0;
-  int sequential = options["sequential"].isTrue() ? 1 : 0;
-  int hevc = options["hevc"].isTrue() ? 1 : 0;
+  mp4_muxer_config_t config;
+  memset(&config, 0, sizeof(config));
+  config.width = options["width"].as<uint32_t>();
+  config.height = options["height"].as<uint32_t>();
+  config.fps = options["fps"].isNumber() ? options["fps"].as<float>() : 30.0f;
+  config.fragmentation = options["fragmentation"].isTrue() ? 1 : 0;
+  config.sequential = options["sequential"].isTrue() ? 1 : 0;
+  config.hevc = options["hevc"].isTrue() ? 1 : 0;
+  config.buffer_size = options["bufferSize"].isNumber() ? options["bufferSize"].as<int>() : 0;
+  config.ring_size = options["ringSize"].isNumber() ? options["ringSize"].as<int>() : 0;
+  config.interleave = options["interleave"].isNumber() ? options["interleave"].as<float>() : 0.5f;
+  config.stats = options["stats"].isTrue() ? 1 : 0;
+  config.trace_events = options["trace"].isNumber() ? options["trace"].as<int>() : options["trace"].isTrue() ? 65536 : 0;
 
   #ifdef DEBUG
   printf("Mux Options ---\n");
-  printf("width=%d\n", width);
-  printf("height=%d\n", height);
-  printf("fps=%f\n", fps);
-  printf("sequential=%d\n", sequential);
-  printf("fragmentation=%d\n", fragmentation);
-  printf("hevc=%d\n", hevc);
+  printf("width=%d\n", config.width);
+  printf("height=%d\n", config.height);
+  printf("fps=%f\n", config.fps);
+  printf("sequential=%d\n", config.sequential);
+  printf("fragmentation=%d\n", config.fragmentation);
+  printf("hevc=%d\n", config.hevc);
+  printf("bufferSize=%d\n", config.buffer_size);
+  printf("ringSize=%d\n", config.ring_size);
+  printf("interleave=%f\n", config.interleave);
+  printf("stats=%d\n", config.stats);
+  printf("trace=%d\n", config.trace_events);
   printf("\n");
   #endif
-  
-  MP4Muxer *muxer = (MP4Muxer *)malloc(sizeof(MP4Muxer));
-  muxer->fps = fps;
-  
-  muxer->callback = [write_fn](const void *buffer, uint32_t size, uint32_t offset) -> int {
-    uint8_t *data = (uint8_t*)(buffer);
-    return write_fn(
-      val((uintptr_t)data),
-      val((uint32_t)size),
-      val((uint32_t)offset)
-    ).as<int>();
-  };
-
-  uint32_t handle = mapMuxerHandle++;
-  mapMuxer[handle] = muxer;
-
-  muxer->mux = MP4E_open(sequential, fragmentation, muxer, &write_callback);
-  // TODO: handle MP4E_STATUS_OK status
-  mp4_h26x_write_init(&muxer->writer, muxer->mux, width, height, hevc);
+
+  // with a ring, write_fn(extents_ptr, extent_count) is called once per call instead
+  config.write = &js_write;
+  config.drain = &js_drain;
+  config.token = new val(write_fn);
+  config.release = &js_release;
+  uint32_t handle = mp4_create_muxer(&config);
+  if (!handle) return 0;
+
+  // audio track has to be known before the first fragment is written
+  if ((option_exists(options, "audio") && add_audio_track(handle, options["audio"])) ||
+      (option_exists(options, "metadata") && add_metadata_track(handle, options["metadata"])))
+  {
+    mp4_finalize_muxer(handle);
+    return 0;
+  }
 
   return handle;
 }
 
+#if MP4_ENCODER
+
 uint32_t create_encoder(val options, val write_fn)
 {
-  uint32_t width = options["width"].as<uint32_t>();
-  uint32_t height = options["height"].as<uint32_t>();
-  uint32_t speed = options["speed"].isNumber() ? options["speed"].as<uint32_t>() : 10;
-  uint32_t kbps = options["kbps"].isNumber() ? options["kbps"].as<uint32_t>() : 0;
-  uint32_t quantizationParameter = options["quantizationParameter"].isNumber() ? options["quantizationParameter"].as<uint32_t>() : 10;
-  uint32_t qpMin = options["qpMin"].isNumber() ? options["qpMin"].as<uint32_t>() : 10;
-  uint32_t qpMax = options["qpMax"].isNumber() ? options["qpMax"].as<uint32_t>() : 51;
-  uint32_t groupOfPictures = options["groupOfPictures"].isNumber() ? options["groupOfPictures"].as<uint32_t>() : 20;
-  uint32_t desiredNaluBytes = options["desiredNaluBytes"].isNumber() ? options["desiredNaluBytes"].as<uint32_t>() : 0;
-  int vbvSize = options["vbvSize"].isNumber() ? options["vbvSize"].as<int>() : -1;
-  int temporalDenoise = options["temporalDenoise"].isTrue() ? 1 : 0;
-  bool rgbFlipY = options["rgbFlipY"].isTrue() ? true : false;
-  uint32_t default_kbps = kbps ? kbps : 5000;
+  mp4_encoder_config_t config;
+  memset(&config, 0, sizeof(config));
+  config.width = options["width"].as<uint32_t>();
+  config.height = options["height"].as<uint32_t>();
+  config.speed = options["speed"].isNumber() ? options["speed"].as<uint32_t>() : 10;
+  config.kbps = options["kbps"].isNumber() ? options["kbps"].as<uint32_t>() : 0;
+  config.quantization_parameter = options["quantizationParameter"].isNumber() ? options["quantizationParameter"].as<uint32_t>() : 10;
+  config.qp_min = options["qpMin"].isNumber() ? options["qpMin"].as<uint32_t>() : 10;
+  config.qp_max = options["qpMax"].isNumber() ? options["qpMax"].as<uint32_t>() : 51;
+  config.group_of_pictures = options["groupOfPictures"].isNumber() ? options["groupOfPictures"].as<uint32_t>() : 20;
+  config.desired_nalu_bytes = options["desiredNaluBytes"].isNumber() ? options["desiredNaluBytes"].as<uint32_t>() : 0;
+  config.vbv_size = options["vbvSize"].isNumber() ? options["vbvSize"].as<int>() : -1;
+  config.temporal_denoise = options["temporalDenoise"].isTrue() ? 1 : 0;
+  config.rgb_flip_y = options["rgbFlipY"].isTrue() ? 1 : 0;
+  config.frame_info = options["frameInfo"].isTrue() ? 1 : 0;
+  config.threads = options["threads"].isNumber() ? options["threads"].as<uint32_t>() : 0;
+  config.duration = options["duration"].isNumber() ? options["duration"].as<float>() : 0;
   // printf("isNum %d\n", options["foobar"].isNumber());
 
-  uint32_t muxer_handle = create_muxer(options, write_fn);
-  MP4Muxer *muxer = mapMuxer[muxer_handle];
-  float fps = muxer->fps;
-
   #ifdef DEBUG
   printf("Encoder Options ---\n");
-  printf("width=%d\n", width);
-  printf("height=%d\n", height);
-  printf("fps=%f\n", fps);
-  printf("rgbFlipY=%d\n", rgbFlipY);
-  printf("speed=%d\n", speed);
-  printf("kbps=%d\n", kbps);
-  printf("vbvSize=%d\n", vbvSize);
-  printf("qpMin=%d\n", qpMin);
-  printf("qpMax=%d\n", qpMax);
-  printf("quantizationParameter=%d\n", quantizationParameter);
-  printf("groupOfPictures=%d\n", groupOfPictures);
-  printf("desiredNaluBytes=%d\n", desiredNaluBytes);
-  printf("fragmentation=%d\n", fragmentation);
-  printf("sequential=%d\n", sequential);
-  printf("temporalDenoise=%d\n", temporalDenoise);
+  printf("width=%d\n", config.width);
+  printf("height=%d\n", config.height);
+  printf("rgbFlipY=%d\n", config.rgb_flip_y);
+  printf("speed=%d\n", config.speed);
+  printf("kbps=%d\n", config.kbps);
+  printf("vbvSize=%d\n", config.vbv_size);
+  printf("qpMin=%d\n", config.qp_min);
+  printf("qpMax=%d\n", config.qp_max);
+  printf("quantizationParameter=%d\n", config.quantization_parameter);
+  printf("groupOfPictures=%d\n", config.group_of_pictures);
+  printf("desiredNaluBytes=%d\n", config.desired_nalu_bytes);
+  printf("temporalDenoise=%d\n", config.temporal_denoise);
+  printf("frameInfo=%d\n", config.frame_info);
+  printf("threads=%d\n", config.threads);
+  printf("duration=%f\n", config.duration);
   printf("\n");
   #endif
 
-  // Set Options
-  Encoder *encoder = (Encoder *)malloc(sizeof(Encoder));
-  uint32_t handle = mapEncoderHandle++;
-  mapEncoder[handle] = encoder;
-
-  encoder->width = width;
-  encoder->height = height;
-  encoder->rgb_flip_y = rgbFlipY;
-  encoder->muxer_handle = muxer_handle;
-  
-  // Initialize H264 writer
-  H264E_create_param_t create_param;
-  memset(&create_param, 0, sizeof(create_param));
-  create_param.enableNEON = 0;
-  #if H264E_SVC_API
-  create_param.num_layers = 1;
-  create_param.inter_layer_pred_flag = 1;
-  create_param.inter_layer_pred_flag = 0;
-  #endif
-  create_param.gop = groupOfPictures;
-  create_param.height = encoder->height;
-  create_param.width = encoder->width;
-
-  // TODO: Expose these to JS API
-  create_param.fine_rate_control_flag = 0;
-  create_param.const_input_flag = 1;
-
-  // originally was at 100 * 10000 / 8
-  create_param.vbv_size_bytes = vbvSize < 0 ? default_kbps * 1000 / 8 * 2 : vbvSize;
-  create_param.temporal_denoise_flag = temporalDenoise;
-  
-  int sizeof_persist = 0;
-  int sizeof_scratch = 0;
-  int sizeof_result = H264E_sizeof(&create_param, &sizeof_persist, &sizeof_scratch);
-  // HME_CHECK(sizeof_result != H264E_STATUS_SIZE_NOT_MULTIPLE_2, "Size must be a multiple of 2");
-  // HME_CHECK_INTERNAL(sizeof_result == H264E_STATUS_SUCCESS);
-
-  encoder->enc = (H264E_persist_t *)ALIGNED_ALLOC(64, sizeof_persist);
-  encoder->scratch = (H264E_scratch_t *)ALIGNED_ALLOC(64, sizeof_scratch);
-
-  //TODO: H264E_STATUS_SUCCESS status
-  H264E_init(encoder->enc, &create_param);
-
-  memset(&encoder->run_param, 0, sizeof(encoder->run_param));
-  encoder->run_param.frame_type = 0;
-  encoder->run_param.encode_speed = speed;
-  encoder->run_param.desired_nalu_bytes = desiredNaluBytes;
-
-  if (kbps)
+  // the encoder takes over the muxer
+  uint32_t muxer_handle = create_muxer(options, write_fn);
+  if (!muxer_handle) return 0;
+  return mp4_create_encoder(&config, muxer_handle);
+}
+
+void encode_yuv (uint32_t encoder_handle, uintptr_t buffer_ptr)
+{
+  mp4_encode_yuv(encoder_handle, reinterpret_cast<uint8_t*>(buffer_ptr));
+}
+
+void set_frame_info (uint32_t encoder_handle, val options)
+{
+  mp4_frame_info_t info;
+  _read_frame_info(options, &info);
+  mp4_set_frame_info(encoder_handle, &info);
+}
+
+void encode_rgb (uint32_t encoder_handle, uintptr_t rgb_buffer_ptr, size_t stride, uintptr_t yuv_buffer_ptr)
+{
+  mp4_encode_rgb(encoder_handle, reinterpret_cast<const uint8_t*>(rgb_buffer_ptr), stride, reinterpret_cast<uint8_t*>(yuv_buffer_ptr));
+}
+
+uint32_t get_muxer (uint32_t encoder_handle)
+{
+  return mp4_get_muxer(encoder_handle);
+}
+
+void finalize_encoder (uint32_t encoder_handle)
+{
+  mp4_finalize_encoder(encoder_handle);
+}
+
+#endif // MP4_ENCODER
+
+void flush_muxer (uint32_t muxer_handle)
+{
+  mp4_flush_muxer(muxer_handle);
+}
+
+int close_muxer (uint32_t muxer_handle)
+{
+  return mp4_close_muxer(muxer_handle);
+}
+
+void finalize_muxer (uint32_t muxer_handle)
+{
+  mp4_finalize_muxer(muxer_handle);
+}
+
+val get_stats (uint32_t muxer_handle)
+{
+  mp4_stats_t stats;
+  if (mp4_get_stats(muxer_handle, &stats)) return val::null();
+
+  static const char *names[MP4_STAGE_COUNT] = { "convert", "encode", "mux", "putSample", "write", "flushIndex" };
+  val result = val::object();
+  for (int i = 0; i < MP4_STAGE_COUNT; i++)
   {
-    encoder->run_param.desired_frame_bytes = kbps * 1000 / 8 / fps;
-    encoder->run_param.qp_min = qpMin;
-    encoder->run_param.qp_max = qpMax;
+    const mp4_stage_stats_t *st = &stats.stages[i];
+    val stage = val::object();
+    stage.set("count", st->count);
+    stage.set("total", st->total);
+    stage.set("min", st->min);
+    stage.set("avg", st->avg);
+    stage.set("p99", st->p99);
+    stage.set("max", st->max);
+    result.set(names[i], stage);
   }
-  else
+  result.set("bytesWritten", (double)stats.bytes_written);
+  result.set("callbacks", stats.callbacks);
+  result.set("peakMemory", (double)stats.peak_memory);
+  return result;
+}
+
+val get_trace (uint32_t muxer_handle)
+{
+  std::string json(mp4_get_trace(muxer_handle, nullptr, 0), '\0');
+  if (json.empty()) return val::null();
+  mp4_get_trace(muxer_handle, &json[0], json.size());
+  return val(json);
+}
+
+uint32_t create_demuxer (val options, val read_fn)
+{
+  mp4_demuxer_config_t config;
+  memset(&config, 0, sizeof(config));
+  config.size = (int64_t)options["size"].as<double>();
+  config.lazy_index = options["lazyIndex"].isTrue() ? 1 : 0;
+
+  #ifdef DEBUG
+  printf("Demux Options ---\n");
+  printf("size=%f\n", (double)config.size);
+  printf("lazyIndex=%d\n", config.lazy_index);
+  printf("\n");
+  #endif
+
+  // a saved index skips parsing, unless it does not match the file
+  if (options["indexPointer"].isNumber())
   {
-    encoder->run_param.qp_min = encoder->run_param.qp_max = quantizationParameter;
+    config.index = reinterpret_cast<const void*>(options["indexPointer"].as<uintptr_t>());
+    config.index_size = options["indexSize"].as<uint32_t>();
   }
 
-  encoder->run_param.nalu_callback_token = muxer;
-  encoder->run_param.nalu_callback = &nalu_callback;
-
-  // memset(&encoder->yuv_planes, 0, sizeof(encoder->yuv_planes));
-  encoder->yuv_planes.stride[0] = width;
-  encoder->yuv_planes.stride[1] = width / 2;
-  encoder->yuv_planes.stride[2] = width / 2;
-  return handle;
+  // read_fn(pointer, size, offset) copies file bytes straight into the heap
+  config.read = &js_read;
+  config.token = new val(read_fn);
+  config.release = &js_release;
+  return mp4_create_demuxer(&config);
 }
 
-void encode_yuv (uint32_t encoder_handle, uintptr_t buffer_ptr)
+uint32_t get_track_count (uint32_t demuxer_handle)
 {
-  Encoder* encoder = mapEncoder[encoder_handle];
-  uint8_t* yuv = reinterpret_cast<uint8_t*>(buffer_ptr);
-  uint32_t width = encoder->width;
-  uint32_t height = encoder->height;
-  encoder->yuv_planes.yuv[0] = yuv;
-  encoder->yuv_planes.yuv[1] = yuv + width * height;
-  encoder->yuv_planes.yuv[2] = yuv + width * height * 5 / 4;
-
-  int sizeof_coded_data = 0;
-  uint8_t *coded_data = nullptr;
-  // TODO: check status H264E_STATUS_SUCCESS
-  H264E_encode(encoder->enc,
-    encoder->scratch,
-    &encoder->run_param,
-    &encoder->yuv_planes,
-    &coded_data,
-    &sizeof_coded_data);
+  return mp4_get_track_count(demuxer_handle);
 }
 
-void encode_rgb (uint32_t encoder_handle, uintptr_t rgb_buffer_ptr, size_t stride, uintptr_t yuv_buffer_ptr)
+val get_track_info (uint32_t demuxer_handle, uint32_t track)
 {
-  Encoder* encoder = mapEncoder[encoder_handle];
-  uint8_t* yuv = reinterpret_cast<uint8_t*>(yuv_buffer_ptr);
-  uint8_t* rgb = reinterpret_cast<uint8_t*>(rgb_buffer_ptr);
-
-  uint32_t width = encoder->width;
-  uint32_t height = encoder->height;
-  uint32_t image_size = width * height;
-  uint32_t upos = image_size;
-  uint32_t vpos = upos + upos / 4;
-  uint32_t i = 0;
-  bool flip = encoder->rgb_flip_y;
-  
-  // TODO: this could probably be optimized somehow ... ?
-  for (size_t y = 0; y < height; y++)
+  mp4_track_info_t tr;
+  if (mp4_get_track_info(demuxer_handle, track, &tr)) return val::null();
+
+  val info = val::object();
+  info.set("id", tr.id);
+  info.set("handler", std::string(tr.handler));
+  info.set("objectType", tr.object_type);
+  info.set("sampleCount", tr.sample_count);
+  info.set("timescale", tr.timescale);
+  info.set("duration", (double)tr.duration);
+  info.set("language", std::string(tr.language));
+  info.set("bitrate", tr.bitrate);
+  info.set("syncTable", tr.sync_table != 0);
+  if (!strcmp(tr.handler, "vide"))
+  {
+    info.set("width", tr.width);
+    info.set("height", tr.height);
+  }
+  else if (!strcmp(tr.handler, "soun"))
   {
-    if (!(y % 2))
-    {
-      for (size_t x = 0; x < width; x += 2)
-      {
-        uint32_t k = flip ? (x + (height - y - 1) * width) : i;
-        uint32_t kidx = stride * k;
-
-        uint8_t r = rgb[kidx];
-        uint8_t g = rgb[kidx + 1];
-        uint8_t b = rgb[kidx + 2];
-        yuv[i++] = ((66 * r + 129 * g + 25 * b) >> 8) + 16;
-        yuv[upos++] = ((-38 * r + -74 * g + 112 * b) >> 8) + 128;
-        yuv[vpos++] = ((112 * r + -94 * g + -18 * b) >> 8) + 128;
-        
-        kidx = stride * (k + 1);
-        yuv[i++] = ((66 * rgb[kidx] + 129 * rgb[kidx+1] + 25 * rgb[kidx+2]) >> 8) + 16;
-      }
-    }
-    else
-    {
-      for (size_t x = 0; x < width; x += 1)
-      {
-        uint32_t k = flip ? (x + (height - y - 1) * width) : i;
-        uint32_t kidx = stride * k;
-        yuv[i++] = ((66 * rgb[kidx] + 129 * rgb[kidx+1] + 25 * rgb[kidx+2]) >> 8) + 16;
-      }
-    }
+    info.set("sampleRate", tr.sample_rate);
+    info.set("channels", tr.channels);
   }
+  return info;
+}
 
-  encode_yuv(encoder_handle, yuv_buffer_ptr);
+// views into the heap, only valid until the demuxer is finalized or memory grows
+val get_sps (uint32_t demuxer_handle, uint32_t track, int index)
+{
+  size_t bytes = 0;
+  const uint8_t *sps = mp4_get_sps(demuxer_handle, track, index, &bytes);
+  if (!sps) return val::null();
+  return val(typed_memory_view(bytes, sps));
 }
 
-void finalize_muxer (uint32_t muxer_handle)
+val get_pps (uint32_t demuxer_handle, uint32_t track, int index)
 {
-  MP4Muxer *muxer = mapMuxer[muxer_handle];
-  MP4E_close(muxer->mux);
-  mp4_h26x_write_close(&muxer->writer);
-  free(muxer);
-  mapMuxer.erase(muxer_handle);
-  muxer = nullptr;
+  size_t bytes = 0;
+  const uint8_t *pps = mp4_get_pps(demuxer_handle, track, index, &bytes);
+  if (!pps) return val::null();
+  return val(typed_memory_view(bytes, pps));
 }
 
-void finalize_encoder (uint32_t encoder_handle)
+val get_dsi (uint32_t demuxer_handle, uint32_t track)
 {
-  Encoder *encoder = mapEncoder[encoder_handle];
+  size_t bytes = 0;
+  const uint8_t *dsi = mp4_get_dsi(demuxer_handle, track, &bytes);
+  if (!dsi) return val::null();
+  return val(typed_memory_view(bytes, dsi));
+}
 
-  // relese muxer
-  uint32_t muxer_handle = encoder->muxer_handle;
-  finalize_muxer(muxer_handle);
+val get_sample_info (uint32_t demuxer_handle, uint32_t track, uint32_t index)
+{
+  mp4_sample_info_t sample;
+  if (mp4_get_sample_info(demuxer_handle, track, index, &sample)) return val::null();
+
+  val info = val::object();
+  info.set("offset", (double)sample.offset);
+  info.set("size", sample.size);
+  info.set("timestamp", (double)sample.timestamp);
+  info.set("duration", sample.duration);
+  info.set("compositionOffset", sample.composition_offset);
+  info.set("keyframe", sample.keyframe != 0);
+  return info;
+}
 
-  // release encoder
-  free(encoder->enc);
-  free(encoder->scratch);
-  free(encoder);
-  mapEncoder.erase(encoder_handle);
-  encoder = nullptr;
+// time in track timescale units, mode is MP4_SEEK_*; returns sample index or -1
+int seek (uint32_t demuxer_handle, uint32_t track, double time, int mode)
+{
+  return mp4_seek(demuxer_handle, track, time > 0 ? (uint64_t)time : 0, mode);
+}
+
+// reads the sample straight into the heap at dst_ptr, returns its size,
+// or -1 if the sample does not exist, does not fit or can't be read
+int read_sample (uint32_t demuxer_handle, uint32_t track, uint32_t index, uintptr_t dst_ptr, int dst_size)
+{
+  return mp4_read_sample(demuxer_handle, track, index, reinterpret_cast<void*>(dst_ptr), dst_size > 0 ? dst_size : 0);
+}
+
+// writes the index blob at dst_ptr if it fits, returns its size or 0 on failure
+int save_index (uint32_t demuxer_handle, uintptr_t dst_ptr, int dst_size)
+{
+  return (int)mp4_save_index(demuxer_handle, reinterpret_cast<void*>(dst_ptr), dst_size > 0 ? dst_size : 0);
+}
+
+void finalize_demuxer (uint32_t demuxer_handle)
+{
+  mp4_finalize_demuxer(demuxer_handle);
+}
+
+int transmux (val options, val read_fn, val write_fn)
+{
+  double size = options["size"].as<double>();
+  int mode = option_exists(options, "format") && options["format"].as<std::string>() == "annexb" ? MP4_TRANSMUX_ANNEXB : MP4_TRANSMUX_FMP4;
+  return mp4_transmux_file((int64_t)size, &js_read, &read_fn, &js_write, &write_fn, mode);
 }
 
 EMSCRIPTEN_BINDINGS(H264MP4EncoderBinding) {
+#if MP4_ENCODER
   function("create_encoder", &create_encoder);
-  function("create_muxer", &create_muxer);
   function("encode_yuv", &encode_yuv);
   function("encode_rgb", &encode_rgb);
-  function("mux_nal", &mux_nal);
+  function("get_muxer", &get_muxer);
+  function("set_frame_info", &set_frame_info);
   function("finalize_encoder", &finalize_encoder);
+#endif
+  function("create_muxer", &create_muxer);
+  function("mux_nal", &mux_nal);
+  function("get_input_buffer", &get_input_buffer);
+  function("get_batch_table", &get_batch_table);
+  function("mux_batch", &mux_batch);
+  function("flush_muxer", &flush_muxer);
+  function("add_audio_track", &add_audio_track);
+  function("mux_aac", &mux_aac);
+  function("add_metadata_track", &add_metadata_track);
+  function("mux_metadata", &mux_metadata);
+  function("mux_frame_info", &mux_frame_info);
+  function("close_muxer", &close_muxer);
   function("finalize_muxer", &finalize_muxer);
+  function("get_stats", &get_stats);
+  function("get_trace", &get_trace);
+  function("create_demuxer", &create_demuxer);
+  function("get_track_count", &get_track_count);
+  function("get_track_info", &get_track_info);
+  function("get_sps", &get_sps);
+  function("get_pps", &get_pps);
+  function("get_dsi", &get_dsi);
+  function("get_sample_info", &get_sample_info);
+  function("read_sample", &read_sample);
+  function("seek", &seek);
+  function("save_index", &save_index);
+  function("finalize_demuxer", &finalize_demuxer);
+  function("transmux", &transmux);
 }
@@ -0,0 +1,248 @@
+// Command line tool for the native mp4core library: muxes H264/HEVC Annex B
+// streams into MP4 files, demuxes or remuxes MP4 files and prints their tracks
+
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mp4core.h"
+
+#ifdef _WIN32
+  #define fseeko _fseeki64
+  #define ftello _ftelli64
+#endif
+
+// input is read and muxed in blocks of this size
+#define READ_BLOCK (1024 * 1024)
+
+typedef struct File {
+  FILE *file;
+  int64_t pos;  // position after the last read or write, to skip seeking
+} File;
+
+static int file_open (File *f, const char *path, const char *mode)
+{
+  f->file = fopen(path, mode);
+  f->pos = 0;
+  if (!f->file) fprintf(stderr, "Could not open %s\n", path);
+  return f->file != NULL;
+}
+
+static int64_t file_size (File *f)
+{
+  if (fseeko(f->file, 0, SEEK_END)) return -1;
+  int64_t size = ftello(f->file);
+  f->pos = size;
+  return size;
+}
+
+static int file_write (int64_t offset, const void *buffer, size_t size, void *token)
+{
+  File *f = (File *)token;
+  if (offset != f->pos && fseeko(f->file, offset, SEEK_SET)) return MP4_STATUS_FILE_WRITE_ERROR;
+  f->pos = offset + size;
+  return fwrite(buffer, 1, size, f->file) == size ? MP4_STATUS_OK : MP4_STATUS_FILE_WRITE_ERROR;
+}
+
+static int file_read (int64_t offset, void *buffer, size_t size, void *token)
+{
+  File *f = (File *)token;
+  if (offset != f->pos && fseeko(f->file, offset, SEEK_SET)) return 1;
+  f->pos = offset + size;
+  return fread(buffer, 1, size, f->file) == size ? 0 : 1;
+}
+
+// position of the next start code at or after pos, including a leading zero
+// of a 4 byte start code, or size if there is none
+static size_t find_start_code (const uint8_t *data, size_t pos, size_t size)
+{
+  for (; pos + 3 <= size; pos++)
+  {
+    if (data[pos] == 0 && data[pos + 1] == 0 && data[pos + 2] == 1)
+      return pos > 0 && data[pos - 1] == 0 ? pos - 1 : pos;
+  }
+  return size;
+}
+
+// Muxes whole NAL units of the input buffer in one batch, returns the bytes
+// used; the last NAL unit is kept for the next block unless at end of input
+static int mux_block (uint32_t mux, const uint8_t *data, size_t size, int end, size_t *used)
+{
+  size_t count = 0;
+  size_t start = find_start_code(data, 0, size);
+  while (start < size)
+  {
+    size_t next = find_start_code(data, start + 3, size);
+    if (next == size && !end) break;
+    // the table may move when grown, so it is filled as records are found
+    mp4_batch_record_t *record = mp4_get_batch_table(mux, count + 1) + count;
+    count++;
+    record->offset = (uint32_t)start;
+    record->size = (uint32_t)(next - start);
+    record->duration = 0;
+    record->flags = 0;
+    start = next;
+  }
+  *used = start;
+  return count ? mp4_mux_batch(mux, count) : MP4_STATUS_OK;
+}
+
+// Writes the muxer's Chrome trace events to path
+static int write_trace (uint32_t mux, const char *path)
+{
+  size_t size = mp4_get_trace(mux, NULL, 0);
+  char *json = (char *)malloc(size);
+  int ok = json && size && mp4_get_trace(mux, json, size) == size;
+  FILE *f = ok ? fopen(path, "wb") : NULL;
+  if (f)
+  {
+    ok = fwrite(json, 1, size, f) == size;
+    if (fclose(f)) ok = 0;
+  }
+  free(json);
+  if (!f || !ok) fprintf(stderr, "Could not write trace %s\n", path);
+  return f && ok;
+}
+
+static int mux_file (int argc, char **argv)
+{
+  mp4_muxer_config_t config;
+  memset(&config, 0, sizeof(config));
+  config.fps = 30;
+  config.interleave = 0.5f;
+  config.buffer_size = READ_BLOCK;
+  const char *paths[2] = { NULL, NULL };
+  const char *trace_path = NULL;
+  int path_count = 0;
+  for (int i = 0; i < argc; i++)
+  {
+    if (!strcmp(argv[i], "--width") && i + 1 < argc) config.width = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--height") && i + 1 < argc) config.height = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--fps") && i + 1 < argc) config.fps = (float)atof(argv[++i]);
+    else if (!strcmp(argv[i], "--hevc")) config.hevc = 1;
+    else if (!strcmp(argv[i], "--sequential")) config.sequential = 1;
+    else if (!strcmp(argv[i], "--fragmentation")) config.fragmentation = 1;
+    else if (!strcmp(argv[i], "--trace") && i + 1 < argc) trace_path = argv[++i];
+    else if (path_count < 2 && argv[i][0] != '-') paths[path_count++] = argv[i];
+    else return -1;
+  }
+  if (path_count != 2 || !config.width || !config.height) return -1;
+
+  File in, out;
+  if (!file_open(&in, paths[0], "rb")) return 1;
+  if (!file_open(&out, paths[1], "wb"))
+  {
+    fclose(in.file);
+    return 1;
+  }
+  config.write = &file_write;
+  config.token = &out;
+  config.trace_events = trace_path ? 1 << 20 : 0;
+  uint32_t mux = mp4_create_muxer(&config);
+
+  // the input buffer holds the NAL unit left over from the previous block, then the next block
+  int err = mux ? MP4_STATUS_OK : MP4_STATUS_BAD_ARGUMENTS;
+  size_t pending = 0;
+  while (!err)
+  {
+    uint8_t *data = mp4_get_input_buffer(mux, pending + READ_BLOCK);
+    size_t bytes = fread(data + pending, 1, READ_BLOCK, in.file);
+    size_t size = pending + bytes;
+    int end = bytes < READ_BLOCK;
+    size_t used = 0;
+    err = mux_block(mux, data, size, end, &used);
+    pending = size - used;
+    memmove(data, data + used, pending);
+    if (end) break;
+  }
+  if (trace_path && mux)
+  {
+    // close first, for the trace to include writing the index
+    int close_err = mp4_close_muxer(mux);
+    if (!err) err = close_err;
+    if (!write_trace(mux, trace_path) && !err) err = MP4_STATUS_FILE_WRITE_ERROR;
+  }
+  mp4_finalize_muxer(mux);
+  fclose(in.file);
+  if (fclose(out.file)) err = MP4_STATUS_FILE_WRITE_ERROR;
+  if (err) fprintf(stderr, "Could not mux %s (error %d)\n", paths[0], err);
+  return err ? 1 : 0;
+}
+
+static int transmux_file (int argc, char **argv, int format)
+{
+  if (argc != 2) return -1;
+  File in, out;
+  if (!file_open(&in, argv[0], "rb")) return 1;
+  if (!file_open(&out, argv[1], "wb"))
+  {
+    fclose(in.file);
+    return 1;
+  }
+  int err = mp4_transmux_file(file_size(&in), &file_read, &in, &file_write, &out, format);
+  fclose(in.file);
+  if (fclose(out.file)) err = MP4_STATUS_FILE_WRITE_ERROR;
+  if (err) fprintf(stderr, "Could not remux %s (error %d)\n", argv[0], err);
+  return err ? 1 : 0;
+}
+
+static int print_info (int argc, char **argv)
+{
+  if (argc != 1) return -1;
+  File in;
+  if (!file_open(&in, argv[0], "rb")) return 1;
+
+  mp4_demuxer_config_t config;
+  memset(&config, 0, sizeof(config));
+  config.size = file_size(&in);
+  config.lazy_index = 1;
+  config.read = &file_read;
+  config.token = &in;
+  uint32_t demux = mp4_create_demuxer(&config);
+  if (!demux)
+  {
+    fprintf(stderr, "Could not open MP4 file %s\n", argv[0]);
+    fclose(in.file);
+    return 1;
+  }
+
+  uint32_t count = mp4_get_track_count(demux);
+  for (uint32_t i = 0; i < count; i++)
+  {
+    mp4_track_info_t tr;
+    mp4_get_track_info(demux, i, &tr);
+    printf("track %u: id %u, %s, object type 0x%02x, %u samples, %.3f s",
+      i, tr.id, tr.handler, tr.object_type, tr.sample_count, tr.timescale ? (double)tr.duration / tr.timescale : 0.0);
+    if (tr.width) printf(", %ux%u", tr.width, tr.height);
+    if (tr.sample_rate) printf(", %u Hz, %u channels", tr.sample_rate, tr.channels);
+    if (tr.bitrate) printf(", %u bps", tr.bitrate);
+    printf("\n");
+  }
+  mp4_finalize_demuxer(demux);
+  fclose(in.file);
+  return 0;
+}
+
+int main (int argc, char **argv)
+{
+  int result = -1;
+  if (argc >= 2)
+  {
+    if (!strcmp(argv[1], "mux")) result = mux_file(argc - 2, argv + 2);
+    else if (!strcmp(argv[1], "demux")) result = transmux_file(argc - 2, argv + 2, MP4_TRANSMUX_ANNEXB);
+    else if (!strcmp(argv[1], "fmp4")) result = transmux_file(argc - 2, argv + 2, MP4_TRANSMUX_FMP4);
+    else if (!strcmp(argv[1], "info")) result = print_info(argc - 2, argv + 2);
+  }
+  if (result < 0)
+  {
+    fprintf(stderr,
+      "usage: mp4-cli mux --width W --height H [--fps 30] [--hevc] [--sequential] [--fragmentation]\n"
+      "               [--trace trace.json] input.264 output.mp4\n"
+      "       mp4-cli demux input.mp4 output.264   H264 Annex B stream of the first video track\n"
+      "       mp4-cli fmp4 input.mp4 output.mp4    fragmented MP4\n"
+      "       mp4-cli info input.mp4\n");
+    return 2;
+  }
+  return result;
+}
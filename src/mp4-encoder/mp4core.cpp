@@ -0,0 +1,1284 @@
+#ifdef __EMSCRIPTEN__
+#include <emscripten.h>
+#include <emscripten/heap.h>
+#include <unistd.h>
+#endif
+
+#define ALIGNED_ALLOC(n, size) aligned_alloc(n, (size + n - 1) / n * n)
+#define TIMESCALE 90000
+
+// Threaded builds encode slices of a frame in parallel on a worker pool
+#if MP4_THREADS
+  #define H264E_MAX_THREADS 8
+#else
+  #define H264E_MAX_THREADS 0
+#endif
+
+#ifdef EMSCRIPTEN_SIMD_ENABLED
+  #define MINIH264_ONLY_SIMD 1
+  #define H264E_ENABLE_NEON 0
+#endif
+
+// Per-stage timing stats and trace events, collected for muxers created with
+// config->stats or config->trace_events
+#ifndef MP4_STATS
+  #define MP4_STATS 1
+#endif
+
+#define MINIH264_IMPLEMENTATION
+#define MINIMP4_IMPLEMENTATION
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include <stdint.h>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#if MP4_THREADS
+#include <thread>
+#include <deque>
+#include <condition_variable>
+#endif
+
+// Removed due to patent concerns, built with the encoder when MP4_ENCODER is set
+#if MP4_ENCODER
+#include "minih264e.h"
+#endif
+
+#include "minimp4.h"
+#include "mp4core.h"
+
+// Queued samples are written regardless of interleaving above this size
+#define INTERLEAVE_MAX_BYTES (16 * 1024 * 1024)
+
+// Frame info metadata sample, a fixed size big-endian record:
+//   u8 version, u8 flags, u16 reserved, u32 frame, u64 capture_us,
+//   u32 render_us, u32 encode_us, u64 hash
+#define FRAME_INFO_VERSION 1
+#define FRAME_INFO_BYTES 32
+#define FRAME_INFO_FIELDS (MP4_FRAME_INFO_CAPTURE | MP4_FRAME_INFO_RENDER | MP4_FRAME_INFO_ENCODE | MP4_FRAME_INFO_HASH)
+
+// DSI of the frame info track, identifies the sample format
+static const uint8_t FRAME_INFO_CONFIG[5] = { 'f', 'i', 'n', 'f', FRAME_INFO_VERSION };
+
+// Muxer output is copied into the ring and handed over in a single drain call
+// at the end of each encode or mux call, instead of one call per write
+typedef struct OutputRing {
+  uint8_t *data = nullptr;
+  size_t capacity = 0;
+  size_t head = 0;     // next write position
+  size_t pending = 0;  // bytes not drained yet, ending at head
+  std::vector<mp4_output_extent_t> extents;
+  int error = 0;       // first drain error, returned for all later writes
+} OutputRing;
+
+#if MP4_STATS
+// Histogram buckets of stage times: 4 per octave of microseconds
+#define STATS_BUCKETS 128
+// Nested stages timed at once, deeper ones are not timed
+#define STATS_DEPTH 8
+
+typedef struct StageStats {
+  uint32_t count;
+  double total;
+  double min;
+  double max;
+  uint32_t histogram[STATS_BUCKETS];
+} StageStats;
+
+// Stage timed for tracing, in milliseconds
+typedef struct TraceEvent {
+  double start;
+  double duration;
+  uint32_t bytes;
+  int stage;
+} TraceEvent;
+
+typedef struct MuxerStats {
+  StageStats stages[MP4_STAGE_COUNT];
+  uint64_t bytes_written;
+  uint64_t peak_memory;
+  // stages being timed, innermost last, with the time of the stages nested in each
+  int depth;
+  double start[STATS_DEPTH];
+  double nested[STATS_DEPTH];
+  // latest trace events, oldest ones are overwritten
+  std::vector<TraceEvent> trace;
+  size_t trace_head;
+  size_t trace_count;
+} MuxerStats;
+#endif
+
+typedef struct MP4Muxer {
+  MP4E_mux_t *mux = nullptr;
+  mp4_h26x_writer_t writer;
+  mp4_aac_writer_t audio;
+  bool has_audio;
+  int metadata_track; // -1 when there is no metadata track
+  uint32_t metadata_frames;
+  int interleave_ms;
+  float fps;
+  mp4_write_fn write;
+  mp4_drain_fn drain;
+  void *token;
+  void (*release)(void *token);
+  OutputRing ring;
+#if MP4_STATS
+  MuxerStats *stats = nullptr; // when enabled
+#endif
+  // input filled by the caller and kept between calls, only grows
+  std::vector<uint8_t> input;
+  std::vector<mp4_batch_record_t> batch;
+} MP4Muxer;
+
+typedef struct MP4Demuxer {
+  MP4D_demux_t demux;
+  mp4_read_fn read;
+  void *token;
+  void (*release)(void *token);
+} MP4Demuxer;
+
+#if MP4_ENCODER
+typedef struct Encoder {
+  uint32_t width;
+  uint32_t height;
+  bool rgb_flip_y;
+
+  H264E_io_yuv_t yuv_planes;
+  H264E_run_param_t run_param;
+
+  uint32_t muxer_handle;
+  MP4Muxer *muxer;
+
+  // frame info written to the metadata track after each encoded frame
+  bool frame_info;
+  mp4_frame_info_t pending_info;
+
+  H264E_persist_t *enc = nullptr;
+  H264E_scratch_t *scratch = nullptr;
+} Encoder;
+#endif
+
+
+// Objects referenced by handle: slot index in the low 16 bits and the slot's
+// generation in the high 16 bits, so handles of finalized objects are
+// rejected. Lookups are O(1) and lock-free, as slot pages never move; adding
+// and removing takes a lock. Handles are never 0.
+template <typename T>
+class HandleTable {
+public:
+  ~HandleTable ()
+  {
+    for (auto &page : pages) delete[] page.load();
+  }
+
+  uint32_t add (T *object)
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    uint32_t index = free_head;
+    if (index)
+    {
+      free_head = slot(index).next_free;
+    }
+    else
+    {
+      if (slot_count == PAGE_SLOTS * PAGES) return 0;
+      index = slot_count++;
+      if (!pages[index / PAGE_SLOTS].load(std::memory_order_relaxed))
+        pages[index / PAGE_SLOTS].store(new Slot[PAGE_SLOTS](), std::memory_order_release);
+    }
+    Slot &s = slot(index);
+    s.object.store(object, std::memory_order_release);
+    return (s.generation.load(std::memory_order_relaxed) << 16) | index;
+  }
+
+  T *get (uint32_t handle) const
+  {
+    uint32_t index = handle & 0xffff;
+    const Slot *page = pages[index / PAGE_SLOTS].load(std::memory_order_acquire);
+    if (!page || !index) return nullptr;
+    const Slot &s = page[index % PAGE_SLOTS];
+    if (s.generation.load(std::memory_order_acquire) != handle >> 16) return nullptr;
+    return s.object.load(std::memory_order_acquire);
+  }
+
+  // returns the object for the caller to destroy, nullptr if the handle is stale
+  T *remove (uint32_t handle)
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    T *object = get(handle);
+    if (!object) return nullptr;
+    uint32_t index = handle & 0xffff;
+    Slot &s = slot(index);
+    s.object.store(nullptr, std::memory_order_release);
+    s.generation.store(((handle >> 16) + 1) & 0xffff, std::memory_order_release);
+    s.next_free = free_head;
+    free_head = index;
+    return object;
+  }
+
+private:
+  static const uint32_t PAGE_SLOTS = 256;
+  static const uint32_t PAGES = 256;
+
+  struct Slot {
+    std::atomic<T*> object;
+    std::atomic<uint32_t> generation;
+    uint32_t next_free;
+  };
+
+  Slot &slot (uint32_t index)
+  {
+    return pages[index / PAGE_SLOTS].load(std::memory_order_relaxed)[index % PAGE_SLOTS];
+  }
+
+  std::atomic<Slot*> pages[PAGES] = {};
+  std::mutex lock;
+  uint32_t free_head = 0;   // list of free slots, linked by next_free
+  uint32_t slot_count = 1;  // slot 0 is not used
+};
+
+#if MP4_ENCODER
+static HandleTable<Encoder> encoders;
+#endif
+static HandleTable<MP4Muxer> muxers;
+static HandleTable<MP4Demuxer> demuxers;
+
+// muxer that can take more input, not closed by mp4_close_muxer()
+static MP4Muxer *_open_muxer (uint32_t handle)
+{
+  MP4Muxer *muxer = muxers.get(handle);
+  return muxer && muxer->mux ? muxer : nullptr;
+}
+
+#if MP4_ENCODER || MP4_STATS
+// milliseconds, for frame info encode times and stats
+static double _now_ms ()
+{
+#ifdef __EMSCRIPTEN__
+  return emscripten_get_now();
+#else
+  return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+#endif
+
+#if MP4_STATS
+static void _stage_begin (MP4Muxer *muxer)
+{
+  MuxerStats *stats = muxer->stats;
+  if (!stats) return;
+  if (stats->depth < STATS_DEPTH)
+  {
+    stats->start[stats->depth] = _now_ms();
+    stats->nested[stats->depth] = 0;
+  }
+  stats->depth++;
+}
+
+// records the time since the matching _stage_begin(), less nested stages
+static void _stage_end (MP4Muxer *muxer, int stage, size_t bytes = 0)
+{
+  MuxerStats *stats = muxer->stats;
+  if (!stats) return;
+  int depth = --stats->depth;
+  stats->bytes_written += bytes;
+  if (depth >= STATS_DEPTH) return;
+  double elapsed = _now_ms() - stats->start[depth];
+  double ms = elapsed - stats->nested[depth];
+
+  StageStats *st = &stats->stages[stage];
+  st->min = st->count ? std::min(st->min, ms) : ms;
+  st->max = st->count ? std::max(st->max, ms) : ms;
+  st->total += ms;
+  st->count++;
+  double us = ms * 1000.0;
+  int bucket = us > 1.0 ? (int)(log2(us) * 4.0) + 1 : 0;
+  st->histogram[std::min(bucket, STATS_BUCKETS - 1)]++;
+
+  if (!stats->trace.empty())
+  {
+    stats->trace[stats->trace_head] = { stats->start[depth], elapsed, (uint32_t)bytes, stage };
+    stats->trace_head = (stats->trace_head + 1) % stats->trace.size();
+    stats->trace_count = std::min(stats->trace_count + 1, stats->trace.size());
+  }
+
+  if (depth > 0)
+  {
+    stats->nested[depth - 1] += elapsed;
+    return;
+  }
+#ifdef __EMSCRIPTEN__
+  stats->peak_memory = std::max<uint64_t>(stats->peak_memory, (size_t)sbrk(0));
+#endif
+}
+
+// MP4E_set_hook() callback
+static void _mux_hook (void *token, int event, int end)
+{
+  MP4Muxer *muxer = (MP4Muxer *)token;
+  if (end) _stage_end(muxer, event == MP4E_HOOK_FLUSH_INDEX ? MP4_STAGE_FLUSH_INDEX : MP4_STAGE_PUT_SAMPLE);
+  else _stage_begin(muxer);
+}
+#else
+static inline void _stage_begin (MP4Muxer *) {}
+static inline void _stage_end (MP4Muxer *, int, size_t = 0) {}
+#endif
+
+// duration in TIMESCALE units, 0 is one frame
+static int _write_nal (MP4Muxer *muxer, const uint8_t *data, size_t size, unsigned duration = 0)
+{
+  _stage_begin(muxer);
+  int err = mp4_h26x_write_nal(&muxer->writer, data, size, duration ? duration : TIMESCALE/(muxer->fps));
+  _stage_end(muxer, MP4_STAGE_MUX);
+  return err;
+}
+
+#if MP4_ENCODER
+static void nalu_callback (const uint8_t *nalu_data, int sizeof_nalu_data, void *token)
+{
+  MP4Muxer *muxer = (MP4Muxer *)token;
+
+  uint8_t *data = const_cast<uint8_t *>(nalu_data - STARTCODE_4BYTES);
+  const int nal_size = sizeof_nalu_data + STARTCODE_4BYTES;
+
+  // HME_CHECK_INTERNAL(nal_size >= 5);
+  // HME_CHECK_INTERNAL(data[0] == 0 && data[1] == 0 && data[2] == 0 && data[3] == 1);
+
+  // TODO check status MP4E_STATUS_OK
+  _write_nal(muxer, data, nal_size);
+}
+
+#if MP4_THREADS
+// Workers running the encoders' slice jobs, shared by all encoders. The
+// calling thread takes jobs from the queue too, so a frame is encoded even
+// while workers are still starting.
+class ThreadPool {
+public:
+  ~ThreadPool ()
+  {
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      stopping = true;
+    }
+    wake.notify_all();
+    for (auto &worker : workers) worker.join();
+  }
+
+  // starts workers up to count, never stops them before exit
+  void reserve (size_t count)
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    while (workers.size() < count) workers.emplace_back([this] { work(); });
+  }
+
+  // runs the jobs and returns when all of them are done
+  void run (void (*job)(void *), void *args[], int count)
+  {
+    Batch batch;
+    batch.remaining = count;
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      for (int i = 0; i < count; i++) queue.push_back({ job, args[i], &batch });
+    }
+    wake.notify_all();
+
+    std::unique_lock<std::mutex> guard(lock);
+    while (batch.remaining > 0)
+    {
+      if (queue.empty())
+      {
+        done.wait(guard);
+        continue;
+      }
+      Task task = queue.front();
+      queue.pop_front();
+      guard.unlock();
+      task.job(task.arg);
+      guard.lock();
+      _finish(task);
+    }
+  }
+
+private:
+  typedef struct Batch {
+    int remaining;
+  } Batch;
+
+  typedef struct Task {
+    void (*job)(void *);
+    void *arg;
+    Batch *batch;
+  } Task;
+
+  void work ()
+  {
+    std::unique_lock<std::mutex> guard(lock);
+    for (;;)
+    {
+      wake.wait(guard, [this] { return stopping || !queue.empty(); });
+      if (stopping) return;
+      Task task = queue.front();
+      queue.pop_front();
+      guard.unlock();
+      task.job(task.arg);
+      guard.lock();
+      _finish(task);
+    }
+  }
+
+  // called with the lock held
+  void _finish (const Task &task)
+  {
+    if (--task.batch->remaining == 0) done.notify_all();
+  }
+
+  std::vector<std::thread> workers;
+  std::deque<Task> queue;
+  std::mutex lock;
+  std::condition_variable wake;
+  std::condition_variable done;
+  bool stopping = false;
+};
+
+static ThreadPool thread_pool;
+
+// H264E_create_param_t::run_func_in_thread
+static void run_jobs (void *token, void (*job)(void *), void *args[], int count)
+{
+  ((ThreadPool *)token)->run(job, args, count);
+}
+#endif
+#endif
+
+// passes pending ring output on, returns the first error of the muxer's drains
+static int _drain_output (MP4Muxer *muxer)
+{
+  OutputRing *ring = &muxer->ring;
+  if (ring->extents.empty()) return ring->error;
+  size_t bytes = 0;
+#if MP4_STATS
+  if (muxer->stats) for (const mp4_output_extent_t &extent : ring->extents) bytes += extent.size;
+#endif
+  _stage_begin(muxer);
+  int err = muxer->drain(ring->extents.data(), ring->extents.size(), muxer->token);
+  _stage_end(muxer, MP4_STAGE_WRITE, bytes);
+  ring->extents.clear();
+  ring->pending = 0;
+  if (err && !ring->error) ring->error = err;
+  return ring->error;
+}
+
+static void _add_extent (OutputRing *ring, int64_t offset, const uint8_t *data, size_t size)
+{
+  if (!ring->extents.empty())
+  {
+    // sequential writes land next to each other in the ring, so most frames are a single extent
+    mp4_output_extent_t &last = ring->extents.back();
+    if (last.offset + last.size == offset && last.data + last.size == data)
+    {
+      last.size += size;
+      return;
+    }
+  }
+  ring->extents.push_back({ offset, data, (uint32_t)size });
+}
+
+static int _ring_write (MP4Muxer *muxer, int64_t offset, const uint8_t *data, size_t size)
+{
+  OutputRing *ring = &muxer->ring;
+  if (ring->error) return ring->error;
+  if (size > ring->capacity)
+  {
+    // larger than the ring: drain it, then pass the muxer's own buffer on its own
+    int err = _drain_output(muxer);
+    if (err) return err;
+    _add_extent(ring, offset, data, size);
+    return _drain_output(muxer);
+  }
+  if (ring->pending + size > ring->capacity)
+  {
+    int err = _drain_output(muxer);
+    if (err) return err;
+  }
+  // at most two extents when the write wraps around the end of the ring
+  while (size)
+  {
+    size_t n = std::min(size, ring->capacity - ring->head);
+    memcpy(ring->data + ring->head, data, n);
+    _add_extent(ring, offset, ring->data + ring->head, n);
+    ring->head = (ring->head + n) % ring->capacity;
+    ring->pending += n;
+    offset += n;
+    data += n;
+    size -= n;
+  }
+  return MP4E_STATUS_OK;
+}
+
+static int write_callback (int64_t offset, const void *buffer, size_t size, void *token)
+{
+  MP4Muxer *muxer = (MP4Muxer *)token;
+  uint8_t *data = (uint8_t*)(buffer);
+  if (muxer->ring.capacity) return _ring_write(muxer, offset, data, size);
+  _stage_begin(muxer);
+  int err = muxer->write(offset, data, size, muxer->token);
+  _stage_end(muxer, MP4_STAGE_WRITE, size);
+  return err;
+}
+
+int mp4_mux_nal (uint32_t muxer_handle, const uint8_t *data, size_t size)
+{
+  MP4Muxer* muxer = _open_muxer(muxer_handle);
+  if (!muxer) return MP4E_STATUS_BAD_ARGUMENTS;
+  int err = _write_nal(muxer, data, size);
+  int drain_err = _drain_output(muxer);
+  return err ? err : drain_err;
+}
+
+static void _enable_interleave (MP4Muxer *muxer)
+{
+  // with more than one track, write samples in time order
+  MP4E_set_interleave(muxer->mux, muxer->interleave_ms, INTERLEAVE_MAX_BYTES);
+}
+
+static void _write_be (uint8_t *p, uint64_t x, int bytes)
+{
+  while (bytes--) *p++ = (uint8_t)(x >> (8 * bytes));
+}
+
+static int _write_frame_info (MP4Muxer *muxer, const mp4_frame_info_t *info)
+{
+  if (muxer->metadata_track < 0) return MP4E_STATUS_BAD_ARGUMENTS;
+  uint8_t data[FRAME_INFO_BYTES];
+  _write_be(data, FRAME_INFO_VERSION, 1);
+  _write_be(data + 1, info->flags & FRAME_INFO_FIELDS, 1);
+  _write_be(data + 2, 0, 2);
+  _write_be(data + 4, info->frame, 4);
+  _write_be(data + 8, info->capture_us, 8);
+  _write_be(data + 16, info->render_us, 4);
+  _write_be(data + 20, info->encode_us, 4);
+  _write_be(data + 24, info->hash, 8);
+  muxer->metadata_frames++;
+  return MP4E_put_sample(muxer->mux, muxer->metadata_track, data, FRAME_INFO_BYTES, 0, MP4E_SAMPLE_RANDOM_ACCESS);
+}
+
+// copies the fields set in src->flags
+static void _merge_frame_info (mp4_frame_info_t *dst, const mp4_frame_info_t *src)
+{
+  if (src->flags & MP4_FRAME_INFO_FRAME) dst->frame = src->frame;
+  if (src->flags & MP4_FRAME_INFO_CAPTURE) dst->capture_us = src->capture_us;
+  if (src->flags & MP4_FRAME_INFO_RENDER) dst->render_us = src->render_us;
+  if (src->flags & MP4_FRAME_INFO_ENCODE) dst->encode_us = src->encode_us;
+  if (src->flags & MP4_FRAME_INFO_HASH) dst->hash = src->hash;
+  dst->flags |= src->flags;
+}
+
+int mp4_add_audio_track (uint32_t muxer_handle, uint32_t sample_rate, uint32_t channels, const uint8_t *config, size_t config_size)
+{
+  MP4Muxer* muxer = _open_muxer(muxer_handle);
+  if (!muxer || muxer->has_audio) return MP4E_STATUS_BAD_ARGUMENTS;
+  // AudioSpecificConfig is optional when ADTS frames are muxed
+  int err = mp4_aac_write_init(&muxer->audio, muxer->mux, sample_rate, channels, config_size ? config : nullptr, config_size);
+  muxer->has_audio = err == MP4E_STATUS_OK;
+  if (muxer->has_audio) _enable_interleave(muxer);
+  return err;
+}
+
+int mp4_add_metadata_track (uint32_t muxer_handle, uint32_t timescale, const uint8_t *config, size_t config_size)
+{
+  MP4Muxer* muxer = _open_muxer(muxer_handle);
+  if (!muxer || muxer->metadata_track >= 0) return MP4E_STATUS_BAD_ARGUMENTS;
+  if (!timescale) timescale = TIMESCALE;
+  if (!config)
+  {
+    config = FRAME_INFO_CONFIG;
+    config_size = sizeof(FRAME_INFO_CONFIG);
+  }
+
+  MP4E_track_t tr;
+  memset(&tr, 0, sizeof(tr));
+  tr.track_media_kind = e_private;
+  tr.language[0] = 'u';
+  tr.language[1] = 'n';
+  tr.language[2] = 'd';
+  tr.language[3] = 0;
+  tr.object_type_indication = MP4_OBJECT_TYPE_USER_PRIVATE;
+  tr.time_scale = timescale;
+  // one video frame, unless given with each sample
+  tr.default_duration = (unsigned)(timescale / muxer->fps);
+  int track = MP4E_add_track(muxer->mux, &tr);
+  if (track < 0) return track;
+  if (config_size)
+  {
+    int err = MP4E_set_dsi(muxer->mux, track, config, config_size);
+    if (err) return err;
+  }
+  muxer->metadata_track = track;
+  _enable_interleave(muxer);
+  return MP4E_STATUS_OK;
+}
+
+int mp4_mux_metadata (uint32_t muxer_handle, const uint8_t *data, size_t size, uint32_t duration)
+{
+  MP4Muxer* muxer = _open_muxer(muxer_handle);
+  if (!muxer || muxer->metadata_track < 0) return MP4E_STATUS_BAD_ARGUMENTS;
+  int err = MP4E_put_sample(muxer->mux, muxer->metadata_track, data, size, duration, MP4E_SAMPLE_RANDOM_ACCESS);
+  int drain_err = _drain_output(muxer);
+  return err ? err : drain_err;
+}
+
+int mp4_mux_frame_info (uint32_t muxer_handle, const mp4_frame_info_t *info)
+{
+  MP4Muxer* muxer = _open_muxer(muxer_handle);
+  if (!muxer || !info) return MP4E_STATUS_BAD_ARGUMENTS;
+  mp4_frame_info_t record;
+  memset(&record, 0, sizeof(record));
+  record.frame = muxer->metadata_frames;
+  _merge_frame_info(&record, info);
+  int err = _write_frame_info(muxer, &record);
+  int drain_err = _drain_output(muxer);
+  return err ? err : drain_err;
+}
+
+int mp4_mux_aac (uint32_t muxer_handle, const uint8_t *data, size_t size)
+{
+  MP4Muxer* muxer = _open_muxer(muxer_handle);
+  if (!muxer || !muxer->has_audio) return MP4E_STATUS_BAD_ARGUMENTS;
+  int err = mp4_aac_write_frame(&muxer->audio, data, size);
+  int drain_err = _drain_output(muxer);
+  return err ? err : drain_err;
+}
+
+uint8_t *mp4_get_input_buffer (uint32_t muxer_handle, size_t size)
+{
+  MP4Muxer* muxer = _open_muxer(muxer_handle);
+  if (!muxer) return nullptr;
+  if (muxer->input.size() < size) muxer->input.resize(std::max<size_t>(size, muxer->input.size() * 2));
+  return muxer->input.data();
+}
+
+mp4_batch_record_t *mp4_get_batch_table (uint32_t muxer_handle, size_t count)
+{
+  MP4Muxer* muxer = _open_muxer(muxer_handle);
+  if (!muxer) return nullptr;
+  if (muxer->batch.size() < count) muxer->batch.resize(std::max<size_t>(count, muxer->batch.size() * 2));
+  return muxer->batch.data();
+}
+
+int mp4_mux_batch (uint32_t muxer_handle, size_t count)
+{
+  MP4Muxer* muxer = _open_muxer(muxer_handle);
+  if (!muxer || count > muxer->batch.size()) return MP4E_STATUS_BAD_ARGUMENTS;
+  int err = MP4E_STATUS_OK;
+  for (size_t i = 0; i < count && !err; i++)
+  {
+    const mp4_batch_record_t &record = muxer->batch[i];
+    if ((uint64_t)record.offset + record.size > muxer->input.size())
+    {
+      err = MP4E_STATUS_BAD_ARGUMENTS;
+      break;
+    }
+    const uint8_t *data = muxer->input.data() + record.offset;
+    if (record.flags & MP4_BATCH_AUDIO)
+      err = muxer->has_audio ? mp4_aac_write_frame(&muxer->audio, data, record.size) : MP4E_STATUS_BAD_ARGUMENTS;
+    else if (record.flags & MP4_BATCH_METADATA)
+      err = muxer->metadata_track >= 0 ? MP4E_put_sample(muxer->mux, muxer->metadata_track, data, record.size, record.duration, MP4E_SAMPLE_RANDOM_ACCESS) : MP4E_STATUS_BAD_ARGUMENTS;
+    else
+      err = _write_nal(muxer, data, record.size, record.duration);
+  }
+  int drain_err = _drain_output(muxer);
+  return err ? err : drain_err;
+}
+
+int mp4_get_stats (uint32_t muxer_handle, mp4_stats_t *out)
+{
+#if MP4_STATS
+  MP4Muxer *muxer = muxers.get(muxer_handle);
+  if (!muxer || !muxer->stats || !out) return MP4E_STATUS_BAD_ARGUMENTS;
+  const MuxerStats *stats = muxer->stats;
+  memset(out, 0, sizeof(*out));
+  for (int i = 0; i < MP4_STAGE_COUNT; i++)
+  {
+    const StageStats *st = &stats->stages[i];
+    mp4_stage_stats_t *dst = &out->stages[i];
+    if (!st->count) continue;
+    dst->count = st->count;
+    dst->total = st->total;
+    dst->min = st->min;
+    dst->max = st->max;
+    dst->avg = st->total / st->count;
+    // upper bound of the bucket holding the 99th percentile
+    uint32_t rank = st->count - st->count / 100, seen = 0;
+    int bucket = 0;
+    while (bucket < STATS_BUCKETS - 1 && (seen += st->histogram[bucket]) < rank) bucket++;
+    dst->p99 = std::min(st->max, bucket ? exp2(bucket / 4.0) / 1000.0 : 0.001);
+  }
+  out->bytes_written = stats->bytes_written;
+  out->callbacks = stats->stages[MP4_STAGE_WRITE].count;
+  out->peak_memory = stats->peak_memory;
+  return MP4E_STATUS_OK;
+#else
+  (void)muxer_handle;
+  (void)out;
+  return MP4E_STATUS_BAD_ARGUMENTS;
+#endif
+}
+
+size_t mp4_get_trace (uint32_t muxer_handle, char *json, size_t capacity)
+{
+#if MP4_STATS
+  MP4Muxer *muxer = muxers.get(muxer_handle);
+  if (!muxer || !muxer->stats || muxer->stats->trace.empty()) return 0;
+  const MuxerStats *stats = muxer->stats;
+  static const char *names[MP4_STAGE_COUNT] = { "convert", "encode", "mux", "put_sample", "write", "flush_index" };
+
+  // complete ("X") events in microseconds, on a thread per muxer
+  std::string out;
+  char line[256];
+  snprintf(line, sizeof(line),
+    "{\"traceEvents\":[\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"muxer %u\"}}",
+    muxer_handle, muxer_handle);
+  out += line;
+  size_t size = stats->trace.size();
+  for (size_t i = 0; i < stats->trace_count; i++)
+  {
+    const TraceEvent *e = &stats->trace[(stats->trace_head + size - stats->trace_count + i) % size];
+    snprintf(line, sizeof(line),
+      ",\n{\"name\":\"%s\",\"cat\":\"mp4\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%u,\"args\":{\"bytes\":%u}}",
+      names[e->stage], e->start * 1000.0, e->duration * 1000.0, muxer_handle, e->bytes);
+    out += line;
+  }
+  out += "\n],\"displayTimeUnit\":\"ms\"}\n";
+
+  if (json && out.size() <= capacity) memcpy(json, out.data(), out.size());
+  return out.size();
+#else
+  (void)muxer_handle;
+  (void)json;
+  (void)capacity;
+  return 0;
+#endif
+}
+
+static void _delete_muxer (MP4Muxer *muxer)
+{
+  if (muxer->release) muxer->release(muxer->token);
+  free(muxer->ring.data);
+#if MP4_STATS
+  delete muxer->stats;
+#endif
+  delete muxer;
+}
+
+uint32_t mp4_create_muxer (const mp4_muxer_config_t *config)
+{
+  if (!config) return 0;
+  if (config->ring_size > 0 ? !config->drain : !config->write)
+  {
+    if (config->release) config->release(config->token);
+    return 0;
+  }
+
+  MP4Muxer *muxer = new MP4Muxer();
+  muxer->fps = config->fps > 0 ? config->fps : 30.0f;
+  muxer->has_audio = false;
+  muxer->metadata_track = -1;
+  muxer->metadata_frames = 0;
+  muxer->interleave_ms = config->interleave > 0 ? (int)(config->interleave * 1000) : 0;
+  muxer->write = config->write;
+  muxer->drain = config->drain;
+  muxer->token = config->token;
+  muxer->release = config->release;
+
+  if (config->ring_size > 0)
+  {
+    muxer->ring.data = (uint8_t *)malloc(config->ring_size);
+    if (!muxer->ring.data)
+    {
+      _delete_muxer(muxer);
+      return 0;
+    }
+    muxer->ring.capacity = config->ring_size;
+  }
+#if MP4_STATS
+  if (config->stats || config->trace_events > 0)
+  {
+    muxer->stats = new MuxerStats();
+    muxer->stats->trace.resize(std::max(config->trace_events, 0));
+  }
+#endif
+
+  uint32_t handle = muxers.add(muxer);
+  if (!handle)
+  {
+    _delete_muxer(muxer);
+    return 0;
+  }
+
+  muxer->mux = MP4E_open(config->sequential, config->fragmentation, muxer, &write_callback);
+  // TODO: handle MP4E_STATUS_OK status
+  if (config->buffer_size > 0) MP4E_set_output_buffer(muxer->mux, config->buffer_size);
+#if MP4_STATS
+  if (muxer->stats) MP4E_set_hook(muxer->mux, &_mux_hook);
+#endif
+  mp4_h26x_write_init(&muxer->writer, muxer->mux, config->width, config->height, config->hevc);
+  return handle;
+}
+
+int mp4_flush_muxer (uint32_t muxer_handle)
+{
+  MP4Muxer *muxer = _open_muxer(muxer_handle);
+  if (!muxer) return MP4E_STATUS_BAD_ARGUMENTS;
+  int err = MP4E_flush(muxer->mux);
+  int drain_err = _drain_output(muxer);
+  return err ? err : drain_err;
+}
+
+static int _close_muxer (MP4Muxer *muxer)
+{
+  int err = MP4E_close(muxer->mux);
+  mp4_h26x_write_close(&muxer->writer);
+  muxer->mux = nullptr;
+  int drain_err = _drain_output(muxer);
+  return err ? err : drain_err;
+}
+
+int mp4_close_muxer (uint32_t muxer_handle)
+{
+  MP4Muxer *muxer = _open_muxer(muxer_handle);
+  if (!muxer) return MP4E_STATUS_BAD_ARGUMENTS;
+  return _close_muxer(muxer);
+}
+
+void mp4_finalize_muxer (uint32_t muxer_handle)
+{
+  MP4Muxer *muxer = muxers.remove(muxer_handle);
+  if (!muxer) return;
+  if (muxer->mux) _close_muxer(muxer);
+  _delete_muxer(muxer);
+}
+
+#if MP4_ENCODER
+
+// Grows the WASM heap once, so that size more bytes can be allocated without
+// growing it again, which would detach HEAPU8 views held by JS
+static void _reserve_heap (size_t size)
+{
+#ifdef __EMSCRIPTEN__
+  size_t end = (size_t)sbrk(0) + size;
+  if (end > emscripten_get_heap_size()) emscripten_resize_heap(end);
+#endif
+}
+
+// Reserves memory for config->duration seconds of video up front: the
+// index and sample buffers of the muxer, then heap room for the frame buffers
+// of api.js and the per-frame copies of the muxer
+static void _reserve_memory (Encoder *encoder, const mp4_encoder_config_t *config)
+{
+  MP4Muxer *muxer = encoder->muxer;
+  size_t pixels = (size_t)encoder->width * encoder->height;
+  int frames = (int)ceilf(config->duration * muxer->fps);
+
+  // largest coded frame, and the average one from the bitrate, or half a byte per pixel
+  size_t frame_max = pixels * 3 / 2;
+  size_t frame_avg = config->kbps ? (size_t)(config->kbps * 125.0f / muxer->fps) : pixels / 2;
+  // frames held at once: one, or an interleaving window
+  int window = muxer->interleave_ms ? (int)ceilf(muxer->fps * muxer->interleave_ms / 1000.0f) + 1 : 1;
+
+  MP4E_reserve(muxer->mux, muxer->writer.mux_track_id, frames, (int)std::min<size_t>(frame_avg * window + frame_max, INTERLEAVE_MAX_BYTES));
+  if (encoder->frame_info) MP4E_reserve(muxer->mux, muxer->metadata_track, frames, FRAME_INFO_BYTES * window);
+
+  // YUV and RGBA frames, the NAL unit copied by the muxer, and the index window written on close
+  _reserve_heap(pixels * 3 / 2 + pixels * 4 + frame_max + MP4E_INDEX_WINDOW_BYTES);
+}
+
+uint32_t mp4_create_encoder (const mp4_encoder_config_t *config, uint32_t muxer_handle)
+{
+  MP4Muxer *muxer = _open_muxer(muxer_handle);
+  if (!muxer) return 0;
+  if (!config)
+  {
+    mp4_finalize_muxer(muxer_handle);
+    return 0;
+  }
+  uint32_t width = config->width;
+  uint32_t height = config->height;
+  uint32_t default_kbps = config->kbps ? config->kbps : 5000;
+  float fps = muxer->fps;
+
+  // Set Options
+  Encoder *encoder = new Encoder();
+  uint32_t handle = encoders.add(encoder);
+  if (!handle)
+  {
+    delete encoder;
+    mp4_finalize_muxer(muxer_handle);
+    return 0;
+  }
+
+  encoder->width = width;
+  encoder->height = height;
+  encoder->rgb_flip_y = config->rgb_flip_y != 0;
+  encoder->muxer_handle = muxer_handle;
+  encoder->muxer = muxer;
+  encoder->frame_info = config->frame_info && (muxer->metadata_track >= 0 || mp4_add_metadata_track(muxer_handle, 0, nullptr, 0) == MP4E_STATUS_OK);
+  memset(&encoder->pending_info, 0, sizeof(encoder->pending_info));
+
+  // Initialize H264 writer
+  H264E_create_param_t create_param;
+  memset(&create_param, 0, sizeof(create_param));
+  create_param.enableNEON = 0;
+  #if H264E_SVC_API
+  create_param.num_layers = 1;
+  create_param.inter_layer_pred_flag = 1;
+  create_param.inter_layer_pred_flag = 0;
+  #endif
+  create_param.gop = config->group_of_pictures;
+  create_param.height = encoder->height;
+  create_param.width = encoder->width;
+
+  // TODO: Expose these to JS API
+  create_param.fine_rate_control_flag = 0;
+  create_param.const_input_flag = 1;
+
+  // originally was at 100 * 10000 / 8
+  create_param.vbv_size_bytes = config->vbv_size < 0 ? default_kbps * 1000 / 8 * 2 : config->vbv_size;
+  create_param.temporal_denoise_flag = config->temporal_denoise;
+
+  #if MP4_THREADS
+  // one thread per core by default, the calling thread being one of them
+  uint32_t threads = config->threads ? config->threads : std::thread::hardware_concurrency();
+  #ifdef __EMSCRIPTEN__
+  // workers can't be started while an encode call blocks, so only those of the pool are used
+  uint32_t pool_size = MAIN_THREAD_EM_ASM_INT({ return typeof MP4_THREAD_POOL_SIZE === 'number' ? MP4_THREAD_POOL_SIZE : 0; });
+  threads = std::min(threads, pool_size + 1);
+  #endif
+  threads = std::max(1u, std::min(threads, (uint32_t)H264E_MAX_THREADS));
+  if (threads > 1)
+  {
+    thread_pool.reserve(threads - 1);
+    create_param.max_threads = threads;
+    create_param.token = &thread_pool;
+    create_param.run_func_in_thread = &run_jobs;
+  }
+  #endif
+
+  int sizeof_persist = 0;
+  int sizeof_scratch = 0;
+  int sizeof_result = H264E_sizeof(&create_param, &sizeof_persist, &sizeof_scratch);
+  // HME_CHECK(sizeof_result != H264E_STATUS_SIZE_NOT_MULTIPLE_2, "Size must be a multiple of 2");
+  // HME_CHECK_INTERNAL(sizeof_result == H264E_STATUS_SUCCESS);
+
+  encoder->enc = (H264E_persist_t *)ALIGNED_ALLOC(64, sizeof_persist);
+  encoder->scratch = (H264E_scratch_t *)ALIGNED_ALLOC(64, sizeof_scratch);
+
+  //TODO: H264E_STATUS_SUCCESS status
+  H264E_init(encoder->enc, &create_param);
+
+  memset(&encoder->run_param, 0, sizeof(encoder->run_param));
+  encoder->run_param.frame_type = 0;
+  encoder->run_param.encode_speed = config->speed;
+  encoder->run_param.desired_nalu_bytes = config->desired_nalu_bytes;
+
+  if (config->kbps)
+  {
+    encoder->run_param.desired_frame_bytes = config->kbps * 1000 / 8 / fps;
+    encoder->run_param.qp_min = config->qp_min;
+    encoder->run_param.qp_max = config->qp_max;
+  }
+  else
+  {
+    encoder->run_param.qp_min = encoder->run_param.qp_max = config->quantization_parameter;
+  }
+
+  encoder->run_param.nalu_callback_token = muxer;
+  encoder->run_param.nalu_callback = &nalu_callback;
+
+  // memset(&encoder->yuv_planes, 0, sizeof(encoder->yuv_planes));
+  encoder->yuv_planes.stride[0] = width;
+  encoder->yuv_planes.stride[1] = width / 2;
+  encoder->yuv_planes.stride[2] = width / 2;
+
+  if (config->duration > 0) _reserve_memory(encoder, config);
+  return handle;
+}
+
+void mp4_encode_yuv (uint32_t encoder_handle, uint8_t *yuv)
+{
+  Encoder* encoder = encoders.get(encoder_handle);
+  if (!encoder || !encoder->muxer->mux) return;
+  uint32_t width = encoder->width;
+  uint32_t height = encoder->height;
+  encoder->yuv_planes.yuv[0] = yuv;
+  encoder->yuv_planes.yuv[1] = yuv + width * height;
+  encoder->yuv_planes.yuv[2] = yuv + width * height * 5 / 4;
+
+  int sizeof_coded_data = 0;
+  uint8_t *coded_data = nullptr;
+  double start = encoder->frame_info ? _now_ms() : 0;
+  _stage_begin(encoder->muxer);
+  // TODO: check status H264E_STATUS_SUCCESS
+  H264E_encode(encoder->enc,
+    encoder->scratch,
+    &encoder->run_param,
+    &encoder->yuv_planes,
+    &coded_data,
+    &sizeof_coded_data);
+  _stage_end(encoder->muxer, MP4_STAGE_ENCODE);
+
+  if (encoder->frame_info)
+  {
+    MP4Muxer *muxer = encoder->muxer;
+    mp4_frame_info_t *info = &encoder->pending_info;
+    if (!(info->flags & MP4_FRAME_INFO_ENCODE))
+    {
+      info->encode_us = (uint32_t)((_now_ms() - start) * 1000.0);
+      info->flags |= MP4_FRAME_INFO_ENCODE;
+    }
+    info->frame = muxer->metadata_frames;
+    _write_frame_info(muxer, info);
+    memset(info, 0, sizeof(*info));
+  }
+  _drain_output(encoder->muxer);
+}
+
+void mp4_set_frame_info (uint32_t encoder_handle, const mp4_frame_info_t *info)
+{
+  Encoder* encoder = encoders.get(encoder_handle);
+  if (!encoder || !info) return;
+  _merge_frame_info(&encoder->pending_info, info);
+}
+
+void mp4_encode_rgb (uint32_t encoder_handle, const uint8_t *rgb, size_t stride, uint8_t *yuv)
+{
+  Encoder* encoder = encoders.get(encoder_handle);
+  if (!encoder || !encoder->muxer->mux) return;
+
+  uint32_t width = encoder->width;
+  uint32_t height = encoder->height;
+  uint32_t image_size = width * height;
+  uint32_t upos = image_size;
+  uint32_t vpos = upos + upos / 4;
+  uint32_t i = 0;
+  bool flip = encoder->rgb_flip_y;
+  _stage_begin(encoder->muxer);
+
+  // TODO: this could probably be optimized somehow ... ?
+  for (size_t y = 0; y < height; y++)
+  {
+    if (!(y % 2))
+    {
+      for (size_t x = 0; x < width; x += 2)
+      {
+        uint32_t k = flip ? (x + (height - y - 1) * width) : i;
+        uint32_t kidx = stride * k;
+
+        uint8_t r = rgb[kidx];
+        uint8_t g = rgb[kidx + 1];
+        uint8_t b = rgb[kidx + 2];
+        yuv[i++] = ((66 * r + 129 * g + 25 * b) >> 8) + 16;
+        yuv[upos++] = ((-38 * r + -74 * g + 112 * b) >> 8) + 128;
+        yuv[vpos++] = ((112 * r + -94 * g + -18 * b) >> 8) + 128;
+
+        kidx = stride * (k + 1);
+        yuv[i++] = ((66 * rgb[kidx] + 129 * rgb[kidx+1] + 25 * rgb[kidx+2]) >> 8) + 16;
+      }
+    }
+    else
+    {
+      for (size_t x = 0; x < width; x += 1)
+      {
+        uint32_t k = flip ? (x + (height - y - 1) * width) : i;
+        uint32_t kidx = stride * k;
+        yuv[i++] = ((66 * rgb[kidx] + 129 * rgb[kidx+1] + 25 * rgb[kidx+2]) >> 8) + 16;
+      }
+    }
+  }
+  _stage_end(encoder->muxer, MP4_STAGE_CONVERT);
+
+  mp4_encode_yuv(encoder_handle, yuv);
+}
+
+uint32_t mp4_get_muxer (uint32_t encoder_handle)
+{
+  Encoder* encoder = encoders.get(encoder_handle);
+  if (!encoder) return 0;
+  return encoder->muxer_handle;
+}
+
+void mp4_finalize_encoder (uint32_t encoder_handle)
+{
+  Encoder *encoder = encoders.remove(encoder_handle);
+  if (!encoder) return;
+
+  // relese muxer
+  mp4_finalize_muxer(encoder->muxer_handle);
+
+  // release encoder
+  free(encoder->enc);
+  free(encoder->scratch);
+  delete encoder;
+}
+
+#endif // MP4_ENCODER
+
+static int read_callback (int64_t offset, void *buffer, size_t size, void *token)
+{
+  MP4Demuxer *demuxer = (MP4Demuxer *)token;
+  return demuxer->read(offset, buffer, size, demuxer->token);
+}
+
+static void _delete_demuxer (MP4Demuxer *demuxer)
+{
+  MP4D_close(&demuxer->demux);
+  if (demuxer->release) demuxer->release(demuxer->token);
+  delete demuxer;
+}
+
+uint32_t mp4_create_demuxer (const mp4_demuxer_config_t *config)
+{
+  if (!config || !config->read) return 0;
+  MP4Demuxer *demuxer = new MP4Demuxer();
+  demuxer->read = config->read;
+  demuxer->token = config->token;
+  demuxer->release = config->release;
+
+  // a saved index skips parsing, unless it does not match the file
+  bool indexed = config->index && MP4D_open_index(&demuxer->demux, &read_callback, demuxer, config->size, config->index, config->index_size) != 0;
+  int flags = config->lazy_index ? MP4D_OPEN_LAZY_INDEX : 0;
+  if (!indexed && !MP4D_open_ex(&demuxer->demux, &read_callback, demuxer, config->size, flags))
+  {
+    _delete_demuxer(demuxer);
+    return 0;
+  }
+
+  uint32_t handle = demuxers.add(demuxer);
+  if (!handle) _delete_demuxer(demuxer);
+  return handle;
+}
+
+uint32_t mp4_get_track_count (uint32_t demuxer_handle)
+{
+  MP4Demuxer *demuxer = demuxers.get(demuxer_handle);
+  if (!demuxer) return 0;
+  return demuxer->demux.track_count;
+}
+
+int mp4_get_track_info (uint32_t demuxer_handle, uint32_t track, mp4_track_info_t *info)
+{
+  MP4Demuxer *demuxer = demuxers.get(demuxer_handle);
+  if (!demuxer || !info || track >= demuxer->demux.track_count) return MP4E_STATUS_BAD_ARGUMENTS;
+  const MP4D_track_t *tr = demuxer->demux.track + track;
+
+  memset(info, 0, sizeof(*info));
+  for (int i = 0; i < 4; i++) info->handler[i] = (char)(tr->handler_type >> (24 - 8 * i));
+  memcpy(info->language, tr->language, sizeof(info->language));
+  info->language[3] = 0;
+  info->id = tr->track_id;
+  info->object_type = tr->object_type_indication;
+  info->sample_count = tr->sample_count;
+  info->timescale = tr->timescale;
+  info->duration = tr->duration;
+  info->bitrate = tr->avg_bitrate_bps;
+  info->sync_table = tr->has_sync_table != 0;
+  if (tr->handler_type == MP4D_HANDLER_TYPE_VIDE)
+  {
+    info->width = tr->SampleDescription.video.width;
+    info->height = tr->SampleDescription.video.height;
+  }
+  else if (tr->handler_type == MP4D_HANDLER_TYPE_SOUN)
+  {
+    info->sample_rate = tr->SampleDescription.audio.samplerate_hz;
+    info->channels = tr->SampleDescription.audio.channelcount;
+  }
+  return MP4E_STATUS_OK;
+}
+
+const uint8_t *mp4_get_sps (uint32_t demuxer_handle, uint32_t track, int index, size_t *size)
+{
+  MP4Demuxer *demuxer = demuxers.get(demuxer_handle);
+  if (!demuxer) return nullptr;
+  int bytes = 0;
+  const uint8_t *sps = (const uint8_t *)MP4D_read_sps(&demuxer->demux, track, index, &bytes);
+  if (size) *size = sps ? bytes : 0;
+  return sps;
+}
+
+const uint8_t *mp4_get_pps (uint32_t demuxer_handle, uint32_t track, int index, size_t *size)
+{
+  MP4Demuxer *demuxer = demuxers.get(demuxer_handle);
+  if (!demuxer) return nullptr;
+  int bytes = 0;
+  const uint8_t *pps = (const uint8_t *)MP4D_read_pps(&demuxer->demux, track, index, &bytes);
+  if (size) *size = pps ? bytes : 0;
+  return pps;
+}
+
+const uint8_t *mp4_get_dsi (uint32_t demuxer_handle, uint32_t track, size_t *size)
+{
+  MP4Demuxer *demuxer = demuxers.get(demuxer_handle);
+  if (!demuxer || track >= demuxer->demux.track_count) return nullptr;
+  const MP4D_track_t *tr = demuxer->demux.track + track;
+  if (size) *size = tr->dsi ? tr->dsi_bytes : 0;
+  return tr->dsi;
+}
+
+int mp4_get_sample_info (uint32_t demuxer_handle, uint32_t track, uint32_t index, mp4_sample_info_t *info)
+{
+  MP4Demuxer *demuxer = demuxers.get(demuxer_handle);
+  if (!demuxer || !info || track >= demuxer->demux.track_count || index >= demuxer->demux.track[track].sample_count) return MP4E_STATUS_BAD_ARGUMENTS;
+  unsigned bytes = 0, duration = 0;
+  uint64_t timestamp = 0;
+  MP4D_file_offset_t offset = MP4D_frame_offset(&demuxer->demux, track, index, &bytes, &timestamp, &duration);
+
+  info->offset = offset;
+  info->size = bytes;
+  info->timestamp = timestamp;
+  info->duration = duration;
+  info->composition_offset = MP4D_composition_offset(&demuxer->demux, track, index);
+  info->keyframe = MP4D_is_sync_sample(&demuxer->demux, track, index) != 0;
+  return MP4E_STATUS_OK;
+}
+
+int mp4_seek (uint32_t demuxer_handle, uint32_t track, uint64_t time, int mode)
+{
+  MP4Demuxer *demuxer = demuxers.get(demuxer_handle);
+  if (!demuxer) return -1;
+  return MP4D_seek(&demuxer->demux, track, time, mode);
+}
+
+int mp4_read_sample (uint32_t demuxer_handle, uint32_t track, uint32_t index, void *data, size_t capacity)
+{
+  MP4Demuxer *demuxer = demuxers.get(demuxer_handle);
+  if (!demuxer || track >= demuxer->demux.track_count || index >= demuxer->demux.track[track].sample_count) return -1;
+  unsigned bytes = 0;
+  MP4D_file_offset_t offset = MP4D_frame_offset(&demuxer->demux, track, index, &bytes, nullptr, nullptr);
+  if (bytes > capacity) return -1;
+  if (read_callback(offset, data, bytes, demuxer)) return -1;
+  return (int)bytes;
+}
+
+size_t mp4_save_index (uint32_t demuxer_handle, void *data, size_t capacity)
+{
+  MP4Demuxer *demuxer = demuxers.get(demuxer_handle);
+  if (!demuxer) return 0;
+  return MP4D_save_index(&demuxer->demux, data, capacity);
+}
+
+void mp4_finalize_demuxer (uint32_t demuxer_handle)
+{
+  MP4Demuxer *demuxer = demuxers.remove(demuxer_handle);
+  if (!demuxer) return;
+  _delete_demuxer(demuxer);
+}
+
+int mp4_transmux_file (int64_t size, mp4_read_fn read, void *read_token, mp4_write_fn write, void *write_token, int format)
+{
+  return mp4_transmux(read, read_token, size, write, write_token, format == MP4_TRANSMUX_ANNEXB ? MP4_TRANSMUX_ANNEXB : MP4_TRANSMUX_FMP4);
+}
@@ -0,0 +1,255 @@
+#ifndef MP4CORE_H
+#define MP4CORE_H
+
+// C API of the encoder, muxer and demuxer, used by the Emscripten bindings
+// (mp4.cpp) and by native programs linking the mp4core library.
+//
+// Objects are referenced by handles, which are never 0. Calls with the handle
+// of a finalized object are ignored or return an error. Handles may be used
+// from several threads, but each object must only be used by one thread at a time.
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Symbols exported from the shared library
+#if defined(_WIN32) && defined(MP4CORE_SHARED)
+  #ifdef MP4CORE_BUILD
+    #define MP4CORE_API __declspec(dllexport)
+  #else
+    #define MP4CORE_API __declspec(dllimport)
+  #endif
+#elif defined(__GNUC__)
+  #define MP4CORE_API __attribute__((visibility("default")))
+#else
+  #define MP4CORE_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Status codes, same as minimp4's MP4E_STATUS_*
+#define MP4_STATUS_OK                 0
+#define MP4_STATUS_BAD_ARGUMENTS     -1
+#define MP4_STATUS_NO_MEMORY         -2
+#define MP4_STATUS_FILE_WRITE_ERROR  -3
+
+// Frame info flags, set for the fields holding a value
+#define MP4_FRAME_INFO_CAPTURE  0x01
+#define MP4_FRAME_INFO_RENDER   0x02
+#define MP4_FRAME_INFO_ENCODE   0x04
+#define MP4_FRAME_INFO_HASH     0x08
+#define MP4_FRAME_INFO_FRAME    0x80  // frame index given, not written to the sample
+
+// mp4_batch_record_t flags, the record is H264/HEVC Annex B data without either
+#define MP4_BATCH_AUDIO     0x01
+#define MP4_BATCH_METADATA  0x02
+
+// mp4_seek() modes
+#define MP4_SEEK_PREVIOUS_SYNC  0  // sync sample at or before given time
+#define MP4_SEEK_NEXT_SYNC      1  // sync sample at or after given time
+#define MP4_SEEK_EXACT          2  // sample, which decoding time span contains given time
+
+// mp4_transmux_file() formats
+#define MP4_TRANSMUX_FMP4    0  // fragmented MP4
+#define MP4_TRANSMUX_ANNEXB  1  // H264 elementary stream of the first video track
+
+// Stages timed by mp4_get_stats()
+#define MP4_STAGE_CONVERT     0  // RGB to YUV conversion of mp4_encode_rgb()
+#define MP4_STAGE_ENCODE      1  // H264 encoding
+#define MP4_STAGE_MUX         2  // parsing and muxing a NAL unit, mp4_h26x_write_nal()
+#define MP4_STAGE_PUT_SAMPLE  3  // adding a sample of any track, MP4E_put_sample()
+#define MP4_STAGE_WRITE       4  // write or drain callback
+#define MP4_STAGE_FLUSH_INDEX 5  // writing file headers and the index
+#define MP4_STAGE_COUNT       6
+
+// Callbacks return 0 on success. offset is the position in the file
+typedef int (*mp4_write_fn)(int64_t offset, const void *buffer, size_t size, void *token);
+typedef int (*mp4_read_fn)(int64_t offset, void *buffer, size_t size, void *token);
+
+// Output extent passed to mp4_drain_fn, bytes are only valid during the call.
+// 16 bytes on 32-bit targets, as read by JS from the WASM heap
+typedef struct mp4_output_extent_t {
+  int64_t offset;
+  const uint8_t *data;
+  uint32_t size;
+} mp4_output_extent_t;
+
+// Called with all output written since the last drain, to be written in order
+typedef int (*mp4_drain_fn)(const mp4_output_extent_t *extents, size_t count, void *token);
+
+typedef struct mp4_muxer_config_t {
+  uint32_t width;
+  uint32_t height;
+  float fps;              // 0 is 30
+  int sequential;
+  int fragmentation;
+  int hevc;
+  int buffer_size;        // output buffer coalescing sequential writes, 0 to disable
+  int ring_size;          // output ring drained once per call, 0 to disable
+  float interleave;       // seconds per interleaved chunk, 0 writes samples in call order
+  int stats;              // collect mp4_get_stats() stats, ignored when built without MP4_STATS
+  int trace_events;       // keep this many of the latest stage events for mp4_get_trace(), 0 to disable
+
+  mp4_write_fn write;     // output without a ring
+  mp4_drain_fn drain;     // output with a ring
+  void *token;
+  void (*release)(void *token);  // called when the muxer is finalized, or failed to be created, may be NULL
+} mp4_muxer_config_t;
+
+// Encoder settings, see the Simple API settings in README.md
+typedef struct mp4_encoder_config_t {
+  uint32_t width;
+  uint32_t height;
+  uint32_t speed;
+  uint32_t kbps;
+  uint32_t quantization_parameter;
+  uint32_t qp_min;
+  uint32_t qp_max;
+  uint32_t group_of_pictures;
+  uint32_t desired_nalu_bytes;
+  int vbv_size;
+  int temporal_denoise;
+  int rgb_flip_y;
+  int frame_info;
+  uint32_t threads;       // threaded builds only, 0 is one per core, 1 encodes on the calling thread; WASM: at most the worker pool + 1
+  float duration;         // expected seconds of video, to reserve memory for up front, 0 to grow as needed
+} mp4_encoder_config_t;
+
+typedef struct mp4_frame_info_t {
+  uint32_t flags;         // MP4_FRAME_INFO_*
+  uint32_t frame;
+  uint64_t capture_us;
+  uint32_t render_us;
+  uint32_t encode_us;
+  uint64_t hash;
+} mp4_frame_info_t;
+
+// offset is into the muxer's input buffer, duration is in the track's
+// timescale (0 is one video frame, ignored for audio)
+typedef struct mp4_batch_record_t {
+  uint32_t offset;
+  uint32_t size;
+  uint32_t duration;
+  uint32_t flags;         // MP4_BATCH_*
+} mp4_batch_record_t;
+
+// Times of a stage in milliseconds, excluding the stages nested in it
+// (encoding excludes muxing its NAL units, and so on)
+typedef struct mp4_stage_stats_t {
+  uint32_t count;
+  double total;
+  double min;
+  double avg;
+  double p99;             // from a histogram with 4 buckets per octave, within 19%
+  double max;
+} mp4_stage_stats_t;
+
+typedef struct mp4_stats_t {
+  mp4_stage_stats_t stages[MP4_STAGE_COUNT];  // MP4_STAGE_*
+  uint64_t bytes_written;
+  uint32_t callbacks;     // write or drain calls
+  uint64_t peak_memory;   // highest WASM heap top seen after a call, 0 in native builds
+} mp4_stats_t;
+
+typedef struct mp4_demuxer_config_t {
+  int64_t size;           // file size in bytes
+  int lazy_index;
+  const void *index;      // blob saved by mp4_save_index(), may be NULL
+  size_t index_size;
+
+  mp4_read_fn read;
+  void *token;
+  void (*release)(void *token);  // called when the demuxer is finalized, or failed to open, may be NULL
+} mp4_demuxer_config_t;
+
+typedef struct mp4_track_info_t {
+  uint32_t id;
+  char handler[5];
+  char language[4];
+  uint32_t object_type;
+  uint32_t sample_count;
+  uint32_t timescale;
+  uint64_t duration;
+  uint32_t bitrate;
+  int sync_table;
+  uint32_t width;         // video tracks
+  uint32_t height;
+  uint32_t sample_rate;   // audio tracks
+  uint32_t channels;
+} mp4_track_info_t;
+
+typedef struct mp4_sample_info_t {
+  int64_t offset;
+  uint32_t size;
+  uint64_t timestamp;
+  uint32_t duration;
+  int32_t composition_offset;
+  int keyframe;
+} mp4_sample_info_t;
+
+// Muxer, returns 0 on failure
+MP4CORE_API uint32_t mp4_create_muxer(const mp4_muxer_config_t *config);
+MP4CORE_API int mp4_mux_nal(uint32_t muxer, const uint8_t *data, size_t size);
+MP4CORE_API int mp4_flush_muxer(uint32_t muxer);
+MP4CORE_API int mp4_add_audio_track(uint32_t muxer, uint32_t sample_rate, uint32_t channels, const uint8_t *config, size_t config_size);
+MP4CORE_API int mp4_mux_aac(uint32_t muxer, const uint8_t *data, size_t size);
+// without config, the track holds frame info samples
+MP4CORE_API int mp4_add_metadata_track(uint32_t muxer, uint32_t timescale, const uint8_t *config, size_t config_size);
+MP4CORE_API int mp4_mux_metadata(uint32_t muxer, const uint8_t *data, size_t size, uint32_t duration);
+MP4CORE_API int mp4_mux_frame_info(uint32_t muxer, const mp4_frame_info_t *info);
+// writes the rest of the file like mp4_finalize_muxer(), but keeps the handle
+// for mp4_get_stats() and mp4_get_trace() until finalized; muxing then fails
+MP4CORE_API int mp4_close_muxer(uint32_t muxer);
+MP4CORE_API void mp4_finalize_muxer(uint32_t muxer);
+
+// The input buffer and the batch table belong to the muxer and are reused by
+// every call; both may move when grown, so get the pointers before filling them
+MP4CORE_API uint8_t *mp4_get_input_buffer(uint32_t muxer, size_t size);
+MP4CORE_API mp4_batch_record_t *mp4_get_batch_table(uint32_t muxer, size_t count);
+// muxes the first count records of the batch table, stops at the first error
+MP4CORE_API int mp4_mux_batch(uint32_t muxer, size_t count);
+
+// Stats of the muxer and its encoder, if created with config->stats
+MP4CORE_API int mp4_get_stats(uint32_t muxer, mp4_stats_t *stats);
+// Chrome trace event JSON of the latest stage events, if created with
+// config->trace_events; writes it if it fits, returns its size or 0 on failure
+MP4CORE_API size_t mp4_get_trace(uint32_t muxer, char *json, size_t capacity);
+
+// Encoder, only available when built with minih264. The encoder takes over the
+// muxer, which is finalized with it, or right away if creation fails. Returns 0 on failure
+MP4CORE_API uint32_t mp4_create_encoder(const mp4_encoder_config_t *config, uint32_t muxer);
+// yuv is I420, width * height * 3 / 2 bytes
+MP4CORE_API void mp4_encode_yuv(uint32_t encoder, uint8_t *yuv);
+// rgb pixels of stride bytes are converted into yuv, then encoded
+MP4CORE_API void mp4_encode_rgb(uint32_t encoder, const uint8_t *rgb, size_t stride, uint8_t *yuv);
+// fields are merged into the frame info written with the next frame
+MP4CORE_API void mp4_set_frame_info(uint32_t encoder, const mp4_frame_info_t *info);
+MP4CORE_API uint32_t mp4_get_muxer(uint32_t encoder);
+MP4CORE_API void mp4_finalize_encoder(uint32_t encoder);
+
+// Demuxer, returns 0 if the file can't be opened
+MP4CORE_API uint32_t mp4_create_demuxer(const mp4_demuxer_config_t *config);
+MP4CORE_API uint32_t mp4_get_track_count(uint32_t demuxer);
+MP4CORE_API int mp4_get_track_info(uint32_t demuxer, uint32_t track, mp4_track_info_t *info);
+// SPS, PPS and decoder specific info are valid until the demuxer is finalized, NULL if missing
+MP4CORE_API const uint8_t *mp4_get_sps(uint32_t demuxer, uint32_t track, int index, size_t *size);
+MP4CORE_API const uint8_t *mp4_get_pps(uint32_t demuxer, uint32_t track, int index, size_t *size);
+MP4CORE_API const uint8_t *mp4_get_dsi(uint32_t demuxer, uint32_t track, size_t *size);
+MP4CORE_API int mp4_get_sample_info(uint32_t demuxer, uint32_t track, uint32_t index, mp4_sample_info_t *info);
+// time in track timescale units, returns sample index or -1
+MP4CORE_API int mp4_seek(uint32_t demuxer, uint32_t track, uint64_t time, int mode);
+// returns the sample size, or -1 if it does not exist, does not fit or can't be read
+MP4CORE_API int mp4_read_sample(uint32_t demuxer, uint32_t track, uint32_t index, void *data, size_t capacity);
+// writes the index blob if it fits, returns its size or 0 on failure
+MP4CORE_API size_t mp4_save_index(uint32_t demuxer, void *data, size_t capacity);
+MP4CORE_API void mp4_finalize_demuxer(uint32_t demuxer);
+
+// Remuxes a file without decoding, one sample at a time in file order
+MP4CORE_API int mp4_transmux_file(int64_t size, mp4_read_fn read, void *read_token, mp4_write_fn write, void *write_token, int format);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // MP4CORE_H
@@ -0,0 +1,165 @@
+const loadEncoder = require("../");
+const fs = require("fs");
+const path = require("path");
+const { promisify } = require("util");
+const readFile = promisify(fs.readFile);
+
+(async () => {
+  const Encoder = await loadEncoder();
+  const file = path.resolve(__dirname, "fixtures/foreman.264");
+  const buffer = await readFile(file);
+
+  // round-trip: mux the elementary stream, then demux the MP4 file
+  // with a full index, a lazy index and an index restored from saveIndex()
+  let previousIndex = null;
+  for (const settings of [{ sequential: true }, { fragmentation: true }]) {
+    const mp4 = mux(Encoder, buffer, settings);
+    const name = Object.keys(settings)[0];
+
+    const eager = Encoder.createDemuxer(mp4);
+    const lazy = Encoder.createDemuxer(mp4, { lazyIndex: true });
+    const index = eager.saveIndex();
+    const restored = Encoder.createDemuxer(mp4, { index });
+    const restoredLazy = Encoder.createDemuxer(mp4, {
+      lazyIndex: true,
+      index: lazy.saveIndex(),
+    });
+
+    const track = eager.tracks.findIndex((t) => t.handler === "vide");
+    if (track < 0) throw new Error(name + ": no video track");
+    const { sampleCount, timescale } = eager.tracks[track];
+    if (!sampleCount) throw new Error(name + ": no samples");
+
+    const others = { lazy, restored, restoredLazy };
+    // an index saved from another file is ignored and the file is parsed
+    if (previousIndex) {
+      others.stale = Encoder.createDemuxer(mp4, { index: previousIndex });
+    }
+    previousIndex = index;
+    for (const [label, demuxer] of Object.entries(others)) {
+      const expected = eager.tracks[track];
+      const actual = demuxer.tracks[track];
+      for (const key of ["sampleCount", "timescale", "duration", "syncTable"]) {
+        check(name, label, "track " + key, expected[key], actual[key]);
+      }
+    }
+
+    let end = 0;
+    for (let i = 0; i < sampleCount; i++) {
+      const expected = eager.sampleInfo(track, i);
+      for (const [label, demuxer] of Object.entries(others)) {
+        const actual = demuxer.sampleInfo(track, i);
+        for (const key of Object.keys(expected)) {
+          check(name, label, "sample " + i + " " + key, expected[key], actual[key]);
+        }
+      }
+      end = expected.timestamp + expected.duration;
+    }
+
+    // probe every frame boundary and the middle of each frame
+    const modes = ["previous", "next", "exact"];
+    const step = end / sampleCount / 2;
+    for (let t = 0; t <= end + step; t += step) {
+      const us = (t * 1e6) / timescale;
+      for (const mode of modes) {
+        const expected = eager.seek(track, us, mode);
+        for (const [label, demuxer] of Object.entries(others)) {
+          check(name, label, "seek " + mode + " " + us, expected, demuxer.seek(track, us, mode));
+        }
+      }
+    }
+    if (eager.seek(track, 0, "previous") !== 0) {
+      throw new Error(name + ": first key frame is not sample 0");
+    }
+
+    // samples read through every index must have the same bytes
+    for (let i = 0; i < sampleCount; i += 7) {
+      const expected = eager.sample(track, i).data.slice();
+      for (const [label, demuxer] of Object.entries(others)) {
+        const actual = demuxer.sample(track, i).data;
+        if (Buffer.compare(Buffer.from(expected), Buffer.from(actual)) !== 0) {
+          throw new Error(name + ": " + label + " sample " + i + " data differs");
+        }
+      }
+    }
+
+    eager.end();
+    for (const demuxer of Object.values(others)) demuxer.end();
+    console.log(name + ": " + sampleCount + " samples OK");
+  }
+})().catch((err) => {
+  console.error(err);
+  process.exitCode = 1;
+});
+
+function check(name, label, what, expected, actual) {
+  if (expected !== actual) {
+    throw new Error(
+      name + ": " + label + " " + what + " is " + actual + ", expected " + expected
+    );
+  }
+}
+
+function mux(Encoder, buffer, settings) {
+  const chunks = [];
+  let size = 0;
+  const mux = Encoder.create_muxer(
+    { width: 352, height: 288, ...settings },
+    write
+  );
+  for (const nal of readNAL(buffer)) {
+    const p = Encoder.get_input_buffer(mux, nal.byteLength);
+    Encoder.HEAPU8.set(nal, p);
+    Encoder.mux_nal(mux, p, nal.byteLength);
+  }
+  Encoder.finalize_muxer(mux);
+
+  const mp4 = new Uint8Array(size);
+  for (const { offset, data } of chunks) mp4.set(data, offset);
+  return mp4;
+
+  function write(pointer, size_, offset) {
+    const data = Encoder.HEAPU8.slice(pointer, pointer + size_);
+    chunks.push({ offset, data });
+    size = Math.max(size, offset + size_);
+    return 0;
+  }
+}
+
+// For an arbitrary stream of data, yield/iterate
+// on each AnnexB NAL chunk (including the startcode)
+function* readNAL(buffer, offset = 0) {
+  let h264Size = buffer.byteLength;
+  while (h264Size > 0) {
+    const nal_size = getNALSize(buffer, offset, h264Size);
+    if (nal_size < 4) {
+      offset += 1;
+      h264Size -= 1;
+      continue;
+    }
+    yield buffer.subarray(offset, offset + nal_size);
+    offset += nal_size;
+    h264Size -= nal_size;
+  }
+
+  function getNALSize(buf, ptr, size) {
+    let pos = 3;
+    while (size - pos > 3) {
+      if (
+        buf[ptr + pos] == 0 &&
+        buf[ptr + pos + 1] == 0 &&
+        buf[ptr + pos + 2] == 1
+      )
+        return pos;
+      if (
+        buf[ptr + pos] == 0 &&
+        buf[ptr + pos + 1] == 0 &&
+        buf[ptr + pos + 2] == 0 &&
+        buf[ptr + pos + 3] == 1
+      )
+        return pos;
+      pos++;
+    }
+    return size;
+  }
+}
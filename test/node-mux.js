@@ -26,15 +26,27 @@ const readFile = promisify(fs.readFile);
   const file = path.resolve(__dirname, "fixtures/foreman.264");
   const buffer = await readFile(file);
 
-  for (let chunk of readNAL(buffer)) {
-    // malloc() / free() a pointer
-    const p = Encoder.create_buffer(chunk.byteLength);
-    // set data in memory
-    Encoder.HEAPU8.set(chunk, p);
-    // write NAL units with AnnexB format
-    // <Uint8Array [startcode] | [NAL] | [startcode] | [NAL] ...>
-    Encoder.mux_nal(mux, p, chunk.byteLength);
-    Encoder.free_buffer(p);
+  // copy the AnnexB data into the muxer's input arena once
+  // <Uint8Array [startcode] | [NAL] | [startcode] | [NAL] ...>
+  const input = Encoder.get_input_buffer(mux, buffer.byteLength);
+  Encoder.HEAPU8.set(buffer, input);
+
+  // then mux the NAL units in batches, each one a record of
+  // (offset into the arena, size, duration, flags) in the muxer's table
+  const batchSize = 256;
+  const chunks = Array.from(readNAL(buffer));
+  for (let i = 0; i < chunks.length; i += batchSize) {
+    const batch = chunks.slice(i, i + batchSize);
+    const table = Encoder.get_batch_table(mux, batch.length);
+    const records = new Uint32Array(Encoder.HEAPU8.buffer, table, batch.length * 4);
+    batch.forEach((chunk, k) => {
+      records[k * 4] = chunk.byteOffset - buffer.byteOffset;
+      records[k * 4 + 1] = chunk.byteLength;
+      records[k * 4 + 2] = 0; // duration, 0 is one frame
+      records[k * 4 + 3] = 0; // flags, 0 is video
+    });
+    const err = Encoder.mux_batch(mux, batch.length);
+    if (err) throw new Error("Could not mux NAL units (error " + err + ")");
   }
 
   // Note: this may trigger more writes